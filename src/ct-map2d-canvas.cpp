@@ -18,8 +18,13 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cmath>
 #include <iostream>
+#include <limits>
+#include <set>
 #include <gtkmm.h>
 #include <glibmm/i18n.h>
 #include <camoto/gamemaps/util.hpp>
@@ -33,35 +38,613 @@ using namespace camoto::gamemaps;
 
 #include <cairomm/context.h>
 
+Map2DTileCache::TileImage::TileImage()
+	:	loaded(false),
+		queued(false),
+		dims({0, 0}),
+		srcPos({0, 0}),
+		average(0),
+		opaque(false),
+		hexDigit(false),
+		digit(0)
+{
+}
+
+Map2DTileCache::Map2DTileCache()
+	:	hits(0),
+		misses(0),
+		decodeTime(0),
+		generation(0)
+{
+}
+
+Map2DTileCache::TileImage& Map2DTileCache::get(Code code)
+{
+	if (code < MAP2D_DENSE_CODE_LIMIT) {
+		if (code >= this->dense.size()) this->dense.resize(code + 1);
+		return this->dense[code];
+	}
+	return this->sparse[code];
+}
+
+void Map2DTileCache::clear()
+{
+	this->dense.clear();
+	this->sparse.clear();
+	return;
+}
+
+void Map2DTileCache::clearScaled()
+{
+	for (auto& t : this->dense) t.scaled.clear();
+	for (auto& t : this->sparse) t.second.scaled.clear();
+	return;
+}
+
+unsigned long Map2DTileCache::scaledBytes() const
+{
+	unsigned long bytes = 0;
+	auto add = [&bytes](const TileImage& t) {
+		for (auto& s : t.scaled) {
+			if (s) bytes += s->get_height() * s->get_stride();
+		}
+	};
+	for (auto& t : this->dense) add(t);
+	for (auto& t : this->sparse) add(t.second);
+	return bytes;
+}
+
 DrawingArea_Map2D::DrawingArea_Map2D(BaseObjectType *obj,
 	const Glib::RefPtr<Gtk::Builder>& refBuilder)
-	:	Gtk::DrawingArea(obj)
+	:	Gtk::DrawingArea(obj),
+		hexLabelBytes(0),
+		zoom(0),
+		chunkBytes(0),
+		scaledBytes(0),
+		flushPending(false),
+		decoder(1),
+		renderer(DrawingArea_Map2D::getRenderer())
 {
-	auto imgDigits = createCairoSurface(UtilImage::HexDigits);
-	this->hexDigitDims.x = imgDigits->get_width() / 16;
-	this->hexDigitDims.y = imgDigits->get_height();
-	this->patDigits = Cairo::SurfacePattern::create(imgDigits);
+	this->imgDigits = createCairoSurface(UtilImage::HexDigits);
+	this->hexDigitDims.x = this->imgDigits->get_width() / 16;
+	this->hexDigitDims.y = this->imgDigits->get_height();
+	this->patDigits = Cairo::SurfacePattern::create(this->imgDigits);
+	// Keep the digits sharp when zoomed in
+	this->patDigits->set_filter(Cairo::FILTER_NEAREST);
+	this->hexDigitAverage = averageColour(this->imgDigits, {
+		0, 0, this->imgDigits->get_width(), this->imgDigits->get_height()
+	});
+
+	this->imgUnknown = createCairoSurface(UtilImage::UnknownTile);
+	this->patUnknown = Cairo::SurfacePattern::create(this->imgUnknown);
+	this->patUnknown->set_extend(Cairo::EXTEND_REPEAT);
+	this->patUnknown->set_filter(Cairo::FILTER_NEAREST);
+
+	this->dispatchDecoded.connect(
+		sigc::mem_fun(this, &DrawingArea_Map2D::on_tiles_decoded));
 }
 
 DrawingArea_Map2D::~DrawingArea_Map2D()
 {
+	// Make sure no background jobs are still using this object
+	this->decoder.cancel();
+	this->decoder.wait();
+
+#ifdef DEBUG
+	unsigned int indexLayer = 0;
+	for (auto& c : this->imgCache) {
+		std::cout << "[map2d] Layer " << indexLayer << " tile cache: " << c.hits
+			<< " hits, " << c.misses << " misses, " << c.decodeTime * 1000
+			<< " ms decoding\n";
+		indexLayer++;
+	}
+#endif
 }
 
 void DrawingArea_Map2D::content(std::shared_ptr<camoto::gamemaps::Map2D> obj,
-	TilesetCollection& allTilesets)
+	TilesetCollection& allTilesets,
+	const std::vector<std::shared_ptr<std::mutex>>& tilesetLocks)
 {
+	// Stop decoding images from any previous map before replacing it
+	this->decoder.cancel();
+	this->decoder.wait();
+	{
+		std::lock_guard<std::mutex> lock(this->mtxDecoded);
+		this->decoded.clear();
+	}
+
 	this->obj = obj;
 	this->allTilesets = allTilesets;
+	this->tilesetLocks = tilesetLocks;
+	std::sort(this->tilesetLocks.begin(), this->tilesetLocks.end());
+	this->tilesetLocks.erase(
+		std::unique(this->tilesetLocks.begin(), this->tilesetLocks.end()),
+		this->tilesetLocks.end());
+
+	this->chunks.clear();
+	this->chunkLRU.clear();
+	this->chunkBytes = 0;
+	this->imgCache.clear();
+	this->imgCache.resize(obj->layers().size());
+	this->scaledBytes = 0;
+	this->dirtyCells.clear();
+	this->dirtyCells.resize(obj->layers().size());
+	this->buildIndex();
+	this->updateSize();
+
+	// Start decoding every image used in the map.  Until each one is ready a
+	// placeholder is drawn in its place, so the map appears straight away.
+	for (unsigned int indexLayer = 0; indexLayer < this->layerIndex.size(); indexLayer++) {
+		this->queueDecode(indexLayer, nullptr);
+	}
+	return;
+}
+
+void DrawingArea_Map2D::setZoom(int level)
+{
+	level = std::min(std::max(level, MAP2D_ZOOM_MIN), MAP2D_ZOOM_MAX);
+	if (level == this->zoom) return;
+
+	// Chunks and scaled images for the old level are kept, in case the user
+	// switches straight back to it.
+	this->zoom = level;
+	this->updateSize();
+	this->queue_draw();
+	return;
+}
+
+int DrawingArea_Map2D::getZoom() const
+{
+	return this->zoom;
+}
+
+bool DrawingArea_Map2D::tileColour(unsigned int indexLayer,
+	Map2DTileCache::Code code, uint32_t *colour)
+{
+	auto& thisTile = this->imgCache[indexLayer].get(code);
+	*colour = thisTile.average;
+	return thisTile.loaded;
+}
+
+sigc::signal<void>& DrawingArea_Map2D::signal_tiles_loaded()
+{
+	return this->sigTilesLoaded;
+}
+
+void DrawingArea_Map2D::invalidateCells(unsigned int indexLayer,
+	const Rect& cells)
+{
+	if ((cells.width <= 0) || (cells.height <= 0)) return;
+
+	// Changes are gathered up and dealt with once the main loop is idle, so
+	// painting a run of tiles or changing several layers at once doesn't redraw
+	// the same area more than once.
+	DrawingArea_Map2D::mergeRect(&this->dirtyCells[indexLayer], cells);
+	if (!this->flushPending) {
+		this->flushPending = true;
+		// Run before the next redraw, so it never sees an out of date index
+		Glib::signal_idle().connect(
+			sigc::mem_fun(this, &DrawingArea_Map2D::on_flush_dirty),
+			Glib::PRIORITY_HIGH_IDLE);
+	}
+	return;
+}
+
+void DrawingArea_Map2D::invalidateLayer(unsigned int indexLayer)
+{
+	// Anything could have changed, including the tileset, so start again
+	this->dirtyCells[indexLayer].clear();
+	auto& li = this->layerIndex[indexLayer];
+	// The layer may have changed size, so drop its chunks without going by the
+	// old size
+	this->eraseLayerChunks(indexLayer);
+	auto& cache = this->imgCache[indexLayer];
+	this->scaledBytes -= cache.scaledBytes();
+	cache.clear();
+	cache.generation++;
+	li.overhang = {0, 0};
+	this->reindexLayer(indexLayer);
+	this->queueDecode(indexLayer, nullptr);
+	this->updateSize();
+	this->queue_draw();
+
+	this->sigCellsInvalidated.emit(indexLayer,
+		Rect{0, 0, li.layerSize.x, li.layerSize.y});
+	return;
+}
+
+sigc::signal<void, unsigned int, const Rect&>&
+	DrawingArea_Map2D::signal_cells_invalidated()
+{
+	return this->sigCellsInvalidated;
+}
+
+bool DrawingArea_Map2D::on_flush_dirty()
+{
+	this->flushPending = false;
+	if (!this->obj) return false;
+
+	double scale = std::ldexp(1.0, this->zoom);
+	std::vector<Rect> dirtyPixels;
+	unsigned int numLayers = this->layerIndex.size();
+	for (unsigned int indexLayer = 0; indexLayer < numLayers; indexLayer++) {
+		auto& dirty = this->dirtyCells[indexLayer];
+		if (dirty.empty()) continue;
+		auto& li = this->layerIndex[indexLayer];
+
+		// Items may have been added, removed or moved, so they might now be in
+		// different buckets.
+		unsigned long oldNumItems = li.numItems;
+		this->reindexLayer(indexLayer);
+		if (li.numItems != oldNumItems) {
+			// Item indices have shifted, so the lists of items drawn as placeholders
+			// are out of date.
+			this->refreshPending(indexLayer);
+		}
+
+		for (auto& cells : dirty) {
+			// The old or new image in these cells might spill into the cells to the
+			// right and below.
+			Rect area = {
+				cells.x,
+				cells.y,
+				cells.width + li.overhang.x,
+				cells.height + li.overhang.y,
+			};
+
+			// Start decoding any images that haven't been seen before
+			std::vector<unsigned int> items;
+			this->visibleItems(indexLayer, area, &items);
+			this->queueDecode(indexLayer, &items);
+
+			this->repaintChunks(indexLayer, area);
+
+			// Round outwards to whole pixels, in case of zooming out
+			DrawingArea_Map2D::mergeRect(&dirtyPixels, {
+				(long)std::floor(area.x * li.tileSize.x * scale),
+				(long)std::floor(area.y * li.tileSize.y * scale),
+				(long)std::ceil(area.width * li.tileSize.x * scale) + 1,
+				(long)std::ceil(area.height * li.tileSize.y * scale) + 1,
+			});
+		}
+
+		// Let other views know, now the index is up to date
+		std::vector<Rect> changed;
+		std::swap(changed, dirty);
+		for (auto& cells : changed) this->sigCellsInvalidated.emit(indexLayer, cells);
+	}
+
+	for (auto& r : dirtyPixels) {
+		this->queue_draw_area(r.x, r.y, r.width, r.height);
+	}
+	return false; // don't run again
+}
+
+void DrawingArea_Map2D::mergeRect(std::vector<Rect> *rects, Rect r)
+{
+	// Absorb any rectangle that overlaps or touches the new one.  Each merge can
+	// make the new one overlap others it didn't before, so go around again until
+	// none are left.
+	bool merged;
+	do {
+		merged = false;
+		for (auto it = rects->begin(); it != rects->end(); ++it) {
+			long x1 = std::max((long)r.x, (long)it->x);
+			long y1 = std::max((long)r.y, (long)it->y);
+			long x2 = std::min((long)r.x + r.width, (long)it->x + it->width);
+			long y2 = std::min((long)r.y + r.height, (long)it->y + it->height);
+			if ((x1 > x2) || (y1 > y2)) continue; // no overlap
+
+			long ux1 = std::min((long)r.x, (long)it->x);
+			long uy1 = std::min((long)r.y, (long)it->y);
+			long ux2 = std::max((long)r.x + r.width, (long)it->x + it->width);
+			long uy2 = std::max((long)r.y + r.height, (long)it->y + it->height);
+			r = {ux1, uy1, ux2 - ux1, uy2 - uy1};
+			rects->erase(it);
+			merged = true;
+			break;
+		}
+	} while (merged);
+	rects->push_back(r);
+	return;
+}
+
+void DrawingArea_Map2D::repaintChunks(unsigned int indexLayer,
+	const Rect& cells)
+{
+	auto& li = this->layerIndex[indexLayer];
+	auto& tileSize = li.tileSize;
+	std::vector<unsigned int> redraw;
 
+	// Full size and enlarged chunks are redrawn first, as the zoomed out ones
+	// are shrunk from the full size ones.
+	for (int zoom = 0; zoom <= MAP2D_ZOOM_MAX; zoom++) {
+		long numCells = DrawingArea_Map2D::chunkCells(zoom);
+		long scale = 1L << zoom;
+		long cx1 = std::max((long)cells.x, 0L) / numCells;
+		long cy1 = std::max((long)cells.y, 0L) / numCells;
+		long cx2 = ((long)cells.x + cells.width + numCells - 1) / numCells;
+		long cy2 = ((long)cells.y + cells.height + numCells - 1) / numCells;
+
+		auto itChunk = this->chunks.lower_bound({indexLayer, zoom, cy1, cx1});
+		while (
+			(itChunk != this->chunks.end())
+			&& (itChunk->first.layer == indexLayer)
+			&& (itChunk->first.zoom == zoom)
+			&& (itChunk->first.y < cy2)
+		) {
+			auto& key = itChunk->first;
+			auto& chunk = itChunk->second;
+			if ((key.x < cx1) || (key.x >= cx2)) {
+				++itChunk;
+				continue;
+			}
+			if (
+				!chunk.surface
+				|| (chunk.surface->get_format() == Cairo::FORMAT_RGB24)
+			) {
+				// This chunk was empty so it has no surface to draw onto, or it was
+				// opaque and may not be any more.  Render it from scratch when it's
+				// next needed.
+				itChunk = this->eraseChunk(itChunk);
+				continue;
+			}
+
+			auto crChunk = Cairo::Context::create(chunk.surface);
+			crChunk->translate(-key.x * numCells * tileSize.x * scale,
+				-key.y * numCells * tileSize.y * scale);
+			crChunk->rectangle(
+				cells.x * tileSize.x * scale,
+				cells.y * tileSize.y * scale,
+				cells.width * tileSize.x * scale,
+				cells.height * tileSize.y * scale
+			);
+			crChunk->clip();
+			crChunk->set_operator(Cairo::OPERATOR_CLEAR);
+			crChunk->paint();
+			crChunk->set_operator(Cairo::OPERATOR_OVER);
+			this->visibleItems(indexLayer, cells, &redraw);
+			this->drawItems(crChunk, indexLayer, zoom, redraw, &chunk.pending);
+
+			std::sort(chunk.pending.begin(), chunk.pending.end());
+			chunk.pending.erase(
+				std::unique(chunk.pending.begin(), chunk.pending.end()),
+				chunk.pending.end()
+			);
+			++itChunk;
+		}
+	}
+
+	for (int zoom = -1; zoom >= MAP2D_ZOOM_MIN; zoom--) {
+		long numCells = DrawingArea_Map2D::chunkCells(zoom);
+		long shrink = 1L << -zoom;
+		long cx1 = std::max((long)cells.x, 0L) / numCells;
+		long cy1 = std::max((long)cells.y, 0L) / numCells;
+		long cx2 = ((long)cells.x + cells.width + numCells - 1) / numCells;
+		long cy2 = ((long)cells.y + cells.height + numCells - 1) / numCells;
+
+		// Fetching the full size chunks could push these ones out of the cache,
+		// so make a list of them first.
+		std::vector<ChunkKey> keys;
+		auto itChunk = this->chunks.lower_bound({indexLayer, zoom, cy1, cx1});
+		while (
+			(itChunk != this->chunks.end())
+			&& (itChunk->first.layer == indexLayer)
+			&& (itChunk->first.zoom == zoom)
+			&& (itChunk->first.y < cy2)
+		) {
+			auto& key = itChunk->first;
+			if ((key.x >= cx1) && (key.x < cx2)) keys.push_back(key);
+			++itChunk;
+		}
+
+		// Full size chunks covering the changed cells
+		long sx1 = std::max((long)cells.x, 0L) / MAP2D_CHUNK_SIZE;
+		long sy1 = std::max((long)cells.y, 0L) / MAP2D_CHUNK_SIZE;
+		long sx2 = ((long)cells.x + cells.width + MAP2D_CHUNK_SIZE - 1)
+			/ MAP2D_CHUNK_SIZE;
+		long sy2 = ((long)cells.y + cells.height + MAP2D_CHUNK_SIZE - 1)
+			/ MAP2D_CHUNK_SIZE;
+
+		for (auto& key : keys) {
+			// Get the full size chunks first, in case they have to be rendered
+			struct Sub {
+				long x, y;
+				Cairo::RefPtr<Cairo::ImageSurface> surface;
+			};
+			std::vector<Sub> subs;
+			std::vector<unsigned int> subPending;
+			for (long sy = std::max(sy1, key.y * shrink);
+				sy < std::min(sy2, (key.y + 1) * shrink); sy++
+			) {
+				for (long sx = std::max(sx1, key.x * shrink);
+					sx < std::min(sx2, (key.x + 1) * shrink); sx++
+				) {
+					auto sub = this->getChunk(indexLayer, 0, sx, sy);
+					if (!sub) continue;
+					subs.push_back({sx, sy, sub});
+					auto itSub = this->chunks.find({indexLayer, 0, sy, sx});
+					assert(itSub != this->chunks.end());
+					subPending.insert(subPending.end(),
+						itSub->second.pending.begin(), itSub->second.pending.end());
+				}
+			}
+
+			auto itChunk = this->chunks.find(key);
+			if (itChunk == this->chunks.end()) continue; // dropped from the cache
+			auto& chunk = itChunk->second;
+			if (!chunk.surface) {
+				this->eraseChunk(itChunk);
+				continue;
+			}
+
+			// Clear whole pixels, so the edges aren't blended with the old image
+			long originX = key.x * numCells * tileSize.x;
+			long originY = key.y * numCells * tileSize.y;
+			auto crChunk = Cairo::Context::create(chunk.surface);
+			double x1 = std::floor(((long)cells.x * tileSize.x - originX) / (double)shrink);
+			double y1 = std::floor(((long)cells.y * tileSize.y - originY) / (double)shrink);
+			double x2 = std::ceil((((long)cells.x + cells.width) * tileSize.x - originX) / (double)shrink);
+			double y2 = std::ceil((((long)cells.y + cells.height) * tileSize.y - originY) / (double)shrink);
+			crChunk->rectangle(x1, y1, x2 - x1, y2 - y1);
+			crChunk->clip();
+			crChunk->set_operator(Cairo::OPERATOR_CLEAR);
+			crChunk->paint();
+			crChunk->set_operator(Cairo::OPERATOR_OVER);
+
+			crChunk->scale(1.0 / shrink, 1.0 / shrink);
+			for (auto& sub : subs) {
+				crChunk->set_source(sub.surface,
+					sub.x * MAP2D_CHUNK_SIZE * tileSize.x - originX,
+					sub.y * MAP2D_CHUNK_SIZE * tileSize.y - originY);
+				crChunk->paint();
+			}
+
+			chunk.pending.insert(chunk.pending.end(), subPending.begin(),
+				subPending.end());
+			std::sort(chunk.pending.begin(), chunk.pending.end());
+			chunk.pending.erase(
+				std::unique(chunk.pending.begin(), chunk.pending.end()),
+				chunk.pending.end()
+			);
+		}
+	}
+	return;
+}
+
+void DrawingArea_Map2D::refreshPending(unsigned int indexLayer)
+{
+	auto& items = this->obj->layers()[indexLayer]->items();
+	auto& cache = this->imgCache[indexLayer];
+	std::vector<unsigned int> visible;
+
+	auto itChunk = this->chunks.lower_bound({indexLayer, MAP2D_ZOOM_MIN,
+		std::numeric_limits<long>::min(), std::numeric_limits<long>::min()});
+	while (
+		(itChunk != this->chunks.end())
+		&& (itChunk->first.layer == indexLayer)
+	) {
+		auto& key = itChunk->first;
+		auto& chunk = itChunk->second;
+		++itChunk;
+		if (chunk.pending.empty()) continue;
+
+		long numCells = DrawingArea_Map2D::chunkCells(key.zoom);
+		this->visibleItems(indexLayer,
+			{key.x * numCells, key.y * numCells, numCells, numCells}, &visible);
+		chunk.pending.clear();
+		for (auto i : visible) {
+			if (!cache.get(items[i].code).loaded) chunk.pending.push_back(i);
+		}
+	}
+	return;
+}
+
+long DrawingArea_Map2D::chunkCells(int zoom)
+{
+	// Cover fewer cells when zoomed in and more when zoomed out, so chunks stay
+	// around the same size in pixels.
+	if (zoom >= 0) return std::max(MAP2D_CHUNK_SIZE >> zoom, 1);
+	return MAP2D_CHUNK_SIZE << -zoom;
+}
+
+void DrawingArea_Map2D::updateSize()
+{
 	// Set the canvas size to match the map size
 	Point mapSize = {0, 0};
-	for (auto& layer : obj->layers()) {
-		Point layerSize, tileSize;
-		getLayerDims(*this->obj, *layer, &layerSize, &tileSize);
-		mapSize.x = std::max(mapSize.x, layerSize.x * tileSize.x);
-		mapSize.y = std::max(mapSize.y, layerSize.y * tileSize.y);
+	for (auto& li : this->layerIndex) {
+		mapSize.x = std::max(mapSize.x, li.layerSize.x * li.tileSize.x);
+		mapSize.y = std::max(mapSize.y, li.layerSize.y * li.tileSize.y);
 	}
-	this->set_size_request(mapSize.x, mapSize.y);
+	double scale = std::ldexp(1.0, this->zoom);
+	this->set_size_request(
+		(int)std::ceil(mapSize.x * scale),
+		(int)std::ceil(mapSize.y * scale)
+	);
+	return;
+}
+
+void DrawingArea_Map2D::buildIndex()
+{
+	auto& layers = this->obj->layers();
+	this->layerIndex.clear();
+	this->layerIndex.resize(layers.size());
+
+	for (unsigned int indexLayer = 0; indexLayer < layers.size(); indexLayer++) {
+		this->layerIndex[indexLayer].overhang = {0, 0};
+		this->reindexLayer(indexLayer);
+	}
+	return;
+}
+
+void DrawingArea_Map2D::reindexLayer(unsigned int indexLayer)
+{
+	auto& layer = this->obj->layers()[indexLayer];
+	auto& li = this->layerIndex[indexLayer];
+	getLayerDims(*this->obj, *layer, &li.layerSize, &li.tileSize);
+	li.buckets.x = (li.layerSize.x + MAP2D_BUCKET_SIZE - 1) / MAP2D_BUCKET_SIZE;
+	li.buckets.y = (li.layerSize.y + MAP2D_BUCKET_SIZE - 1) / MAP2D_BUCKET_SIZE;
+	if (li.buckets.x < 1) li.buckets.x = 1;
+	if (li.buckets.y < 1) li.buckets.y = 1;
+	li.bucketItems.clear();
+	li.bucketItems.resize(li.buckets.x * li.buckets.y);
+
+	unsigned int indexItem = 0;
+	for (auto& t : layer->items()) {
+		// Items outside the layer bounds go in the nearest edge bucket, so they
+		// are still drawn if the canvas ever extends that far.
+		long bx = std::min(std::max((long)t.pos.x / MAP2D_BUCKET_SIZE, 0L),
+			(long)li.buckets.x - 1);
+		long by = std::min(std::max((long)t.pos.y / MAP2D_BUCKET_SIZE, 0L),
+			(long)li.buckets.y - 1);
+		li.bucketItems[by * li.buckets.x + bx].push_back(indexItem);
+		indexItem++;
+	}
+	li.numItems = indexItem;
+	return;
+}
+
+void DrawingArea_Map2D::visibleItems(unsigned int indexLayer,
+	const Rect& cells, std::vector<unsigned int> *items) const
+{
+	auto& li = this->layerIndex[indexLayer];
+	items->clear();
+
+	// Widen the area up and to the left to catch oversized images whose cells
+	// are just out of view.
+	long x1 = (long)cells.x - (long)li.overhang.x;
+	long y1 = (long)cells.y - (long)li.overhang.y;
+	long x2 = (long)cells.x + (long)cells.width;
+	long y2 = (long)cells.y + (long)cells.height;
+
+	// Items outside the layer live in the edge buckets, so clamp rather than
+	// skipping buckets that are out of range.
+	long bx1 = std::min(std::max(x1 / MAP2D_BUCKET_SIZE, 0L), (long)li.buckets.x - 1);
+	long by1 = std::min(std::max(y1 / MAP2D_BUCKET_SIZE, 0L), (long)li.buckets.y - 1);
+	long bx2 = std::min(std::max((x2 + MAP2D_BUCKET_SIZE - 1) / MAP2D_BUCKET_SIZE, 1L),
+		(long)li.buckets.x);
+	long by2 = std::min(std::max((y2 + MAP2D_BUCKET_SIZE - 1) / MAP2D_BUCKET_SIZE, 1L),
+		(long)li.buckets.y);
+
+	auto& allItems = this->obj->layers()[indexLayer]->items();
+	for (long by = by1; by < by2; by++) {
+		for (long bx = bx1; bx < bx2; bx++) {
+			for (auto i : li.bucketItems[by * li.buckets.x + bx]) {
+				// Skip items removed since the index was last updated
+				if (i >= allItems.size()) continue;
+				long px = allItems[i].pos.x;
+				long py = allItems[i].pos.y;
+				// Buckets are coarser than the search area, so check each item
+				if ((px >= x1) && (px < x2) && (py >= y1) && (py < y2)) {
+					items->push_back(i);
+				}
+			}
+		}
+	}
+
+	// Buckets are visited in spatial order, so put the items back in layer order
+	// in case any overlap.
+	std::sort(items->begin(), items->end());
 	return;
 }
 
@@ -69,88 +652,894 @@ bool DrawingArea_Map2D::on_draw(const Cairo::RefPtr<Cairo::Context>& cr)
 {
 	if (!this->obj) return false; // map2d instance not set yet
 
-	for (auto& layer : this->obj->layers()) {
-		// Figure out the layer size (in tiles) and the tile size
-		Point layerSize, tileSize;
-		getLayerDims(*this->obj, *layer, &layerSize, &tileSize);
+	// Only the exposed part of the canvas needs to be redrawn
+	double clipX1, clipY1, clipX2, clipY2;
+	cr->get_clip_extents(clipX1, clipY1, clipX2, clipY2);
 
-		// Run through all items in the layer and render them one by one
-		for (auto& t : layer->items()) {
-			TileImage& thisTile = this->imgCache[t.code];
-			if (!thisTile.loaded) {
-				// Tile hasn't been cached yet, load it from the tileset
-				Map2D::Layer::ImageFromCodeInfo imgType;
-				try {
-					imgType = layer->imageFromCode(t, this->allTilesets);
-				} catch (const std::exception& e) {
-					std::cerr << "Error loading image: " << e.what() << std::endl;
-					imgType.type = Map2D::Layer::ImageFromCodeInfo::ImageType::Unknown;
+	double scale = std::ldexp(1.0, this->zoom);
+	long numCells = DrawingArea_Map2D::chunkCells(this->zoom);
+
+	unsigned int numLayers = this->layerIndex.size();
+	for (unsigned int indexLayer = 0; indexLayer < numLayers; indexLayer++) {
+		auto& li = this->layerIndex[indexLayer];
+		auto& tileSize = li.tileSize;
+		if ((tileSize.x <= 0) || (tileSize.y <= 0)) continue;
+
+		// Convert the exposed area from pixels into chunks
+		double chunkWidth = numCells * tileSize.x * scale;
+		double chunkHeight = numCells * tileSize.y * scale;
+		long cx1 = std::max((long)std::floor(clipX1 / chunkWidth), 0L);
+		long cy1 = std::max((long)std::floor(clipY1 / chunkHeight), 0L);
+		long cx2 = (long)std::ceil(clipX2 / chunkWidth);
+		long cy2 = (long)std::ceil(clipY2 / chunkHeight);
+
+		// Draw any missing chunks in parallel before blitting them one by one
+		this->renderChunks(indexLayer, this->zoom, {cx1, cy1, cx2 - cx1, cy2 - cy1});
+
+		// Blit each visible chunk, rendering any that aren't cached yet
+		for (long cy = cy1; cy < cy2; cy++) {
+			for (long cx = cx1; cx < cx2; cx++) {
+				auto surface = this->getChunk(indexLayer, this->zoom, cx, cy);
+				if (!surface) continue; // nothing in this chunk
+				cr->set_source(surface, cx * chunkWidth, cy * chunkHeight);
+				if (surface->get_format() == Cairo::FORMAT_RGB24) {
+					// Nothing below shows through, so copy rather than blend
+					cr->set_operator(Cairo::OPERATOR_SOURCE);
+					cr->rectangle(cx * chunkWidth, cy * chunkHeight,
+						surface->get_width(), surface->get_height());
+					cr->fill();
+					cr->set_operator(Cairo::OPERATOR_OVER);
+				} else {
+					cr->paint();
 				}
-				// Display nothing by default, but could be changed to a question mark
-				thisTile.dims = {0, 0};
-
-				switch (imgType.type) {
-					case Map2D::Layer::ImageFromCodeInfo::ImageType::Supplied: {
-						assert(imgType.img);
-						auto surface = createCairoSurface(imgType.img.get(), nullptr);
-						thisTile.surfacePattern = Cairo::SurfacePattern::create(surface);
-						thisTile.dims = imgType.img->dimensions();
-						break;
+			}
+		}
+	}
+	return true;
+}
+
+Cairo::RefPtr<Cairo::ImageSurface> DrawingArea_Map2D::getChunk(
+	unsigned int indexLayer, int zoom, long cx, long cy)
+{
+	ChunkKey key = {indexLayer, zoom, cy, cx};
+	auto itChunk = this->chunks.find(key);
+	if (itChunk != this->chunks.end()) {
+		// Move to the front of the LRU list as it's just been used
+		auto& chunk = itChunk->second;
+		this->chunkLRU.splice(this->chunkLRU.begin(), this->chunkLRU, chunk.lru);
+		return chunk.surface;
+	}
+
+	auto& li = this->layerIndex[indexLayer];
+	long numCells = DrawingArea_Map2D::chunkCells(zoom);
+	Rect cells = {
+		cx * numCells,
+		cy * numCells,
+		numCells,
+		numCells,
+	};
+
+	// Chunks along the right and bottom edges don't need to extend past the
+	// end of the layer.
+	long width = std::min(numCells, (long)li.layerSize.x - cells.x);
+	long height = std::min(numCells, (long)li.layerSize.y - cells.y);
+	width = std::max(width, 1L) * li.tileSize.x;
+	height = std::max(height, 1L) * li.tileSize.y;
+
+	Chunk chunk;
+	chunk.bytes = 0;
+	if (zoom >= 0) {
+		std::vector<unsigned int> visible;
+		this->visibleItems(indexLayer, cells, &visible);
+		if (!visible.empty()) {
+			long scale = 1L << zoom;
+			chunk.surface = Cairo::ImageSurface::create(
+				this->isChunkOpaque(indexLayer, cells, visible)
+					? Cairo::FORMAT_RGB24 : Cairo::FORMAT_ARGB32,
+				width * scale, height * scale);
+
+			auto crChunk = Cairo::Context::create(chunk.surface);
+			crChunk->translate(-cells.x * li.tileSize.x * scale,
+				-cells.y * li.tileSize.y * scale);
+			this->drawItems(crChunk, indexLayer, zoom, visible, &chunk.pending);
+		}
+	} else {
+		// Zoomed out, so shrink the full size chunks covering the same area
+		// rather than drawing every tile at a fraction of a pixel.  Cairo's default
+		// filter averages the pixels when shrinking, so detail isn't just dropped.
+		long shrink = 1L << -zoom;
+		Cairo::RefPtr<Cairo::Context> crChunk;
+		for (long sy = cy * shrink; sy < (cy + 1) * shrink; sy++) {
+			for (long sx = cx * shrink; sx < (cx + 1) * shrink; sx++) {
+				auto sub = this->getChunk(indexLayer, 0, sx, sy);
+				if (!sub) continue; // nothing in this part of the chunk
+
+				if (!crChunk) {
+					chunk.surface = Cairo::ImageSurface::create(Cairo::FORMAT_ARGB32,
+						(width + shrink - 1) / shrink, (height + shrink - 1) / shrink);
+					crChunk = Cairo::Context::create(chunk.surface);
+					crChunk->scale(1.0 / shrink, 1.0 / shrink);
+				}
+				crChunk->set_source(sub,
+					(sx - cx * shrink) * MAP2D_CHUNK_SIZE * li.tileSize.x,
+					(sy - cy * shrink) * MAP2D_CHUNK_SIZE * li.tileSize.y);
+				crChunk->paint();
+
+				// Redraw this chunk once the full size chunk has its placeholders
+				// replaced.
+				auto itSub = this->chunks.find({indexLayer, 0, sy, sx});
+				assert(itSub != this->chunks.end());
+				auto& subPending = itSub->second.pending;
+				chunk.pending.insert(chunk.pending.end(), subPending.begin(),
+					subPending.end());
+			}
+		}
+	}
+	if (chunk.surface) {
+		chunk.bytes = chunk.surface->get_stride() * chunk.surface->get_height();
+	}
+	return this->storeChunk(key, std::move(chunk));
+}
+
+Cairo::RefPtr<Cairo::ImageSurface> DrawingArea_Map2D::storeChunk(
+	const ChunkKey& key, Chunk chunk)
+{
+	// Empty chunks are cached too, but take up no space as they have no surface
+	this->chunkLRU.push_front(key);
+	chunk.lru = this->chunkLRU.begin();
+	this->chunkBytes += chunk.bytes;
+	auto surface = chunk.surface;
+	this->chunks[key] = std::move(chunk);
+
+	// Discard the least recently used chunks if over the limit.  This could drop
+	// chunks already drawn in this frame but never the one just rendered.
+	while ((this->chunkBytes > MAP2D_CHUNK_CACHE_LIMIT) && (this->chunkLRU.size() > 1)) {
+		auto itOld = this->chunks.find(this->chunkLRU.back());
+		assert(itOld != this->chunks.end());
+		this->eraseChunk(itOld);
+	}
+	return surface;
+}
+
+void DrawingArea_Map2D::renderChunks(unsigned int indexLayer, int zoom,
+	const Rect& chunkArea)
+{
+	auto& li = this->layerIndex[indexLayer];
+	auto& items = this->obj->layers()[indexLayer]->items();
+	auto& cache = this->imgCache[indexLayer];
+
+	// Work out which full size chunks are needed.  When zoomed out, these are
+	// only the ones covering zoomed out chunks that aren't cached yet.
+	std::vector<ChunkKey> missing;
+	long shrink = (zoom < 0) ? (1L << -zoom) : 1;
+	int renderZoom = std::max(zoom, 0);
+	for (long cy = chunkArea.y; cy < (long)chunkArea.y + chunkArea.height; cy++) {
+		for (long cx = chunkArea.x; cx < (long)chunkArea.x + chunkArea.width; cx++) {
+			if (this->chunks.find({indexLayer, zoom, cy, cx}) != this->chunks.end()) {
+				continue;
+			}
+			for (long sy = cy * shrink; sy < (cy + 1) * shrink; sy++) {
+				for (long sx = cx * shrink; sx < (cx + 1) * shrink; sx++) {
+					ChunkKey key = {indexLayer, renderZoom, sy, sx};
+					if (this->chunks.find(key) == this->chunks.end()) {
+						missing.push_back(key);
 					}
-					case Map2D::Layer::ImageFromCodeInfo::ImageType::Blank:
-						thisTile.dims = {0, 0};
-						break;
-//					case Map2D::Layer::ImageFromCodeInfo::ImageType::Unknown:
-					case Map2D::Layer::ImageFromCodeInfo::ImageType::HexDigit: {
-						int numDigits = 4;
-						if (imgType.digit <= 0x1F) numDigits = 1;
-						else if (imgType.digit <= 0x1FF) numDigits = 2;
-						thisTile.dims = tileSize;//{this->hexDigitDims.x * numDigits, this->hexDigitDims.y};
-						auto surface = Cairo::ImageSurface::create(Cairo::FORMAT_ARGB32,
-							thisTile.dims.x, thisTile.dims.y);
-						// Draw the digits
-						auto crDigits = Cairo::Context::create(surface);
-
-						unsigned int numberWidth = (this->hexDigitDims.x - 1) * numDigits + 1;
-						Point origin = {
-							(tileSize.x - numberWidth) / 2,
-							(tileSize.y - this->hexDigitDims.y) / 2
-						};
-						// Start at the end of the number and draw digits from right-to-left
-						// from the last (least significant) digit back to the first.
-						crDigits->translate(origin.x + numberWidth, origin.y);
-						for (int i = 0; i < numDigits; i++) {
-							int digit = imgType.digit & (0xF << (i * 4));
-							auto patMatrix = Cairo::identity_matrix();
-							patMatrix.translate(this->hexDigitDims.x * digit, 0);
-
-							crDigits->translate(-this->hexDigitDims.x, 0);
-							crDigits->rectangle(0, 0, this->hexDigitDims.x, this->hexDigitDims.y);
-
-							this->patDigits->set_matrix(patMatrix);
-							crDigits->set_source(this->patDigits);
-							crDigits->fill();
-							// Overwrite the padding pixel for the next digit
-							crDigits->translate(1, 0);
-						}
-						thisTile.surfacePattern = Cairo::SurfacePattern::create(surface);
+				}
+			}
+		}
+	}
+	if (missing.size() < 2) return;
+
+	// Everything the workers need is gathered here in the main thread, as
+	// looking up the cache can change it and the map may be edited later.
+	long scale = 1L << renderZoom;
+	long numCells = DrawingArea_Map2D::chunkCells(renderZoom);
+	std::vector<ChunkKey> keys;
+	std::vector<Chunk> rendered;
+	std::vector<ChunkJob> jobs;
+	std::vector<unsigned int> visible;
+	unsigned long jobBytes = 0;
+	for (auto& key : missing) {
+		Rect cells = {
+			key.x * numCells,
+			key.y * numCells,
+			numCells,
+			numCells,
+		};
+		Chunk chunk;
+		chunk.bytes = 0;
+		this->visibleItems(indexLayer, cells, &visible);
+		if (visible.empty()) {
+			// Nothing to draw, so cache it as empty straight away
+			this->storeChunk(key, std::move(chunk));
+			continue;
+		}
+
+		long width = std::min(numCells, (long)li.layerSize.x - cells.x);
+		long height = std::min(numCells, (long)li.layerSize.y - cells.y);
+		width = std::max(width, 1L) * li.tileSize.x * scale;
+		height = std::max(height, 1L) * li.tileSize.y * scale;
+
+		// Leave room in the cache for the chunks already drawn this frame, and
+		// for shrinking when zoomed out.  getChunk() will draw any left over.
+		unsigned long bytes = height
+			* Cairo::ImageSurface::format_stride_for_width(Cairo::FORMAT_ARGB32, width);
+		if (jobBytes + bytes > MAP2D_CHUNK_CACHE_LIMIT / 2) break;
+		jobBytes += bytes;
+
+		chunk.surface = Cairo::ImageSurface::create(
+			this->isChunkOpaque(indexLayer, cells, visible)
+				? Cairo::FORMAT_RGB24 : Cairo::FORMAT_ARGB32,
+			width, height);
+		chunk.bytes = bytes;
+
+		ChunkJob job;
+		job.target = chunk.surface->cobj();
+		job.scale = scale;
+		job.digits = this->imgDigits->cobj();
+		job.digitDims = this->hexDigitDims;
+		job.unknown = this->imgUnknown->cobj();
+		job.ops.reserve(visible.size());
+		for (auto i : visible) {
+			auto& t = items[i];
+			auto& thisTile = cache.get(t.code);
+			ChunkOp op;
+			op.x = ((long)t.pos.x - cells.x) * li.tileSize.x;
+			op.y = ((long)t.pos.y - cells.y) * li.tileSize.y;
+			op.source = nullptr;
+			op.srcX = 0;
+			op.srcY = 0;
+			op.width = li.tileSize.x;
+			op.height = li.tileSize.y;
+			op.digit = 0;
+			if (!thisTile.loaded) {
+				cache.misses++;
+				chunk.pending.push_back(i);
+				op.type = ChunkOp::Type::Placeholder;
+			} else {
+				cache.hits++;
+				if (thisTile.hexDigit) {
+					op.type = ChunkOp::Type::HexDigit;
+					op.digit = thisTile.digit;
+				} else if ((thisTile.dims.x != 0) && (thisTile.dims.y != 0)) {
+					op.type = ChunkOp::Type::Image;
+					op.source = thisTile.surface->cobj();
+					op.srcX = thisTile.srcPos.x;
+					op.srcY = thisTile.srcPos.y;
+					op.width = thisTile.dims.x;
+					op.height = thisTile.dims.y;
+				} else {
+					continue; // no image
+				}
+			}
+			job.ops.push_back(op);
+		}
+		keys.push_back(key);
+		rendered.push_back(std::move(chunk));
+		jobs.push_back(std::move(job));
+	}
+
+	for (auto& job : jobs) {
+		const ChunkJob *pJob = &job;
+		this->renderer->add([pJob]() {
+			DrawingArea_Map2D::paintChunk(*pJob);
+		});
+	}
+	this->renderer->wait();
+
+	for (unsigned int i = 0; i < keys.size(); i++) {
+		this->storeChunk(keys[i], std::move(rendered[i]));
+	}
+	return;
+}
+
+std::shared_ptr<WorkerPool> DrawingArea_Map2D::getRenderer()
+{
+	static std::weak_ptr<WorkerPool> shared;
+	auto renderer = shared.lock();
+	if (!renderer) {
+		renderer = std::make_shared<WorkerPool>(0);
+		shared = renderer;
+	}
+	return renderer;
+}
+
+void DrawingArea_Map2D::paintChunk(const ChunkJob& job)
+{
+	// Wrap the raw objects in RefPtrs belonging only to this thread.  Each
+	// wrapper takes its own Cairo reference, which unlike the RefPtr count is
+	// safe to change from any thread.
+	auto target = Cairo::RefPtr<Cairo::Surface>(
+		new Cairo::Surface(job.target, false));
+	auto crChunk = Cairo::Context::create(target);
+	crChunk->scale(job.scale, job.scale);
+
+	auto patDigits = Cairo::SurfacePattern::create(
+		Cairo::RefPtr<Cairo::Surface>(new Cairo::Surface(job.digits, false)));
+	patDigits->set_filter(Cairo::FILTER_NEAREST);
+
+	auto patUnknown = Cairo::SurfacePattern::create(
+		Cairo::RefPtr<Cairo::Surface>(new Cairo::Surface(job.unknown, false)));
+	patUnknown->set_extend(Cairo::EXTEND_REPEAT);
+	patUnknown->set_filter(Cairo::FILTER_NEAREST);
+
+	// Most items share the same few atlas pages, so only wrap each page once
+	std::map<cairo_surface_t *, Cairo::RefPtr<Cairo::SurfacePattern>> sources;
+
+	for (auto& op : job.ops) {
+		crChunk->save();
+		crChunk->translate(op.x, op.y);
+		switch (op.type) {
+			case ChunkOp::Type::Image: {
+				auto& pattern = sources[op.source];
+				if (!pattern) {
+					pattern = Cairo::SurfacePattern::create(
+						Cairo::RefPtr<Cairo::Surface>(new Cairo::Surface(op.source, false)));
+					// Keep the pixels sharp as they are enlarged, rather than blurring
+					pattern->set_filter(Cairo::FILTER_NEAREST);
+				}
+				auto patMatrix = Cairo::identity_matrix();
+				patMatrix.translate(op.srcX, op.srcY);
+				pattern->set_matrix(patMatrix);
+				crChunk->rectangle(0, 0, op.width, op.height);
+				crChunk->set_source(pattern);
+				crChunk->fill();
+				break;
+			}
+			case ChunkOp::Type::HexDigit:
+				DrawingArea_Map2D::drawHexDigits(crChunk, patDigits, job.digitDims,
+					op.digit, {op.width, op.height});
+				break;
+			case ChunkOp::Type::Placeholder:
+				crChunk->rectangle(0, 0, op.width, op.height);
+				crChunk->set_source(patUnknown);
+				crChunk->fill();
+				break;
+		}
+		crChunk->restore();
+	}
+	target->flush();
+	return;
+}
+
+bool DrawingArea_Map2D::isChunkOpaque(unsigned int indexLayer,
+	const Rect& cells, const std::vector<unsigned int>& indices)
+{
+	auto& li = this->layerIndex[indexLayer];
+	auto& items = this->obj->layers()[indexLayer]->items();
+	auto& cache = this->imgCache[indexLayer];
+
+	// Cells past the edge of the layer are not part of the chunk's surface
+	long width = std::min((long)cells.width, (long)li.layerSize.x - cells.x);
+	long height = std::min((long)cells.height, (long)li.layerSize.y - cells.y);
+	if ((width <= 0) || (height <= 0)) return false;
+
+	std::vector<bool> covered(width * height, false);
+	unsigned long remaining = width * height;
+	for (auto i : indices) {
+		auto& t = items[i];
+		long x = (long)t.pos.x - cells.x;
+		long y = (long)t.pos.y - cells.y;
+		if ((x < 0) || (y < 0) || (x >= width) || (y >= height)) continue;
+		auto& thisTile = cache.get(t.code);
+		if (!thisTile.loaded || !thisTile.opaque) continue;
+		if (
+			((long)thisTile.dims.x < (long)li.tileSize.x)
+			|| ((long)thisTile.dims.y < (long)li.tileSize.y)
+		) {
+			continue;
+		}
+		if (!covered[y * width + x]) {
+			covered[y * width + x] = true;
+			remaining--;
+		}
+	}
+	return remaining == 0;
+}
+
+std::map<DrawingArea_Map2D::ChunkKey, DrawingArea_Map2D::Chunk>::iterator
+	DrawingArea_Map2D::eraseChunk(
+		std::map<ChunkKey, Chunk>::iterator itChunk)
+{
+	this->chunkBytes -= itChunk->second.bytes;
+	this->chunkLRU.erase(itChunk->second.lru);
+	return this->chunks.erase(itChunk);
+}
+
+void DrawingArea_Map2D::eraseLayerChunks(unsigned int indexLayer)
+{
+	auto itChunk = this->chunks.lower_bound({indexLayer, MAP2D_ZOOM_MIN,
+		std::numeric_limits<long>::min(), std::numeric_limits<long>::min()});
+	while (
+		(itChunk != this->chunks.end())
+		&& (itChunk->first.layer == indexLayer)
+	) {
+		itChunk = this->eraseChunk(itChunk);
+	}
+	return;
+}
+
+void DrawingArea_Map2D::invalidateChunks(unsigned int indexLayer,
+	const Rect& cells)
+{
+	auto& li = this->layerIndex[indexLayer];
+
+	// The same cells appear in a different chunk at each zoom level
+	for (int zoom = MAP2D_ZOOM_MIN; zoom <= MAP2D_ZOOM_MAX; zoom++) {
+		long numCells = DrawingArea_Map2D::chunkCells(zoom);
+
+		// Images can spill into cells to the right and below their own, so those
+		// chunks may need to be redrawn too.
+		long cx1 = std::max((long)cells.x, 0L) / numCells;
+		long cy1 = std::max((long)cells.y, 0L) / numCells;
+		long cx2 = ((long)cells.x + cells.width + li.overhang.x + numCells - 1)
+			/ numCells;
+		long cy2 = ((long)cells.y + cells.height + li.overhang.y + numCells - 1)
+			/ numCells;
+
+		auto itChunk = this->chunks.lower_bound({indexLayer, zoom, cy1, cx1});
+		while (
+			(itChunk != this->chunks.end())
+			&& (itChunk->first.layer == indexLayer)
+			&& (itChunk->first.zoom == zoom)
+			&& (itChunk->first.y < cy2)
+		) {
+			auto& key = itChunk->first;
+			if ((key.x >= cx1) && (key.x < cx2)) {
+				itChunk = this->eraseChunk(itChunk);
+			} else {
+				++itChunk;
+			}
+		}
+	}
+	return;
+}
+
+void DrawingArea_Map2D::drawItems(const Cairo::RefPtr<Cairo::Context>& cr,
+	unsigned int indexLayer, int zoom, const std::vector<unsigned int>& indices,
+	std::vector<unsigned int> *pending)
+{
+	auto& layer = this->obj->layers()[indexLayer];
+	auto& tileSize = this->layerIndex[indexLayer].tileSize;
+	auto& items = layer->items();
+	auto& cache = this->imgCache[indexLayer];
+	long scale = 1L << zoom;
+
+	for (auto i : indices) {
+		auto& t = items[i];
+		auto& thisTile = cache.get(t.code);
+		cr->save();
+		cr->translate(t.pos.x * tileSize.x * scale, t.pos.y * tileSize.y * scale);
+		if (thisTile.loaded) {
+			cache.hits++;
+			if (thisTile.hexDigit) {
+				cr->scale(scale, scale);
+				this->drawHexLabel(cr, thisTile.digit, tileSize);
+			} else if ((thisTile.dims.x != 0) && (thisTile.dims.y != 0)) {
+				if (zoom == 0) {
+					cr->set_source(thisTile.surface, -thisTile.srcPos.x, -thisTile.srcPos.y);
+					cr->rectangle(0, 0, thisTile.dims.x, thisTile.dims.y);
+					cr->fill();
+				} else {
+					cr->set_source(this->getScaledTile(thisTile, zoom), 0, 0);
+					cr->paint();
+				}
+			}
+		} else {
+			// Image is still being decoded in the background, so draw a placeholder
+			// and come back to this item once the image is ready.
+			cache.misses++;
+			if (pending) pending->push_back(i);
+			cr->scale(scale, scale);
+			cr->rectangle(0, 0, tileSize.x, tileSize.y);
+			cr->set_source(this->patUnknown);
+			cr->fill();
+		}
+		cr->restore();
+	}
+	return;
+}
+
+void DrawingArea_Map2D::drawHexDigits(const Cairo::RefPtr<Cairo::Context>& cr,
+	const Cairo::RefPtr<Cairo::SurfacePattern>& patDigits,
+	const Point& digitDims, unsigned int digit, const Point& cellSize)
+{
+	int numDigits = 1;
+	while ((numDigits < 8) && (digit >> (numDigits * 4))) numDigits++;
+
+	// Each digit image has a padding pixel on the right, which is overlapped by
+	// the next digit.
+	long digitWidth = digitDims.x;
+	long numberWidth = (digitWidth - 1) * numDigits + 1;
+	long originX = ((long)cellSize.x - numberWidth) / 2;
+	long originY = ((long)cellSize.y - (long)digitDims.y) / 2;
+
+	// Start at the end of the number and draw digits from right-to-left
+	// from the last (least significant) digit back to the first.
+	for (int i = 0; i < numDigits; i++) {
+		unsigned int value = (digit >> (i * 4)) & 0xF;
+		long x = originX + numberWidth - (i + 1) * (digitWidth - 1) - 1;
+
+		auto patMatrix = Cairo::identity_matrix();
+		patMatrix.translate(digitWidth * value - x, -originY);
+		patDigits->set_matrix(patMatrix);
+
+		cr->rectangle(x, originY, digitWidth, digitDims.y);
+		cr->set_source(patDigits);
+		cr->fill();
+	}
+	return;
+}
+
+void DrawingArea_Map2D::drawHexLabel(const Cairo::RefPtr<Cairo::Context>& cr,
+	unsigned int digit, const Point& cellSize)
+{
+	auto key = std::make_pair(digit,
+		std::make_pair((long)cellSize.x, (long)cellSize.y));
+	auto itLabel = this->hexLabels.find(key);
+	if (itLabel == this->hexLabels.end()) {
+		unsigned long bytes = cellSize.y
+			* Cairo::ImageSurface::format_stride_for_width(Cairo::FORMAT_ARGB32,
+				cellSize.x);
+		if (this->hexLabelBytes + bytes > MAP2D_LABEL_CACHE_LIMIT) {
+			// Cache is full, so draw the digits directly.  This is slower but only
+			// happens on maps using a great many different numbers.
+			DrawingArea_Map2D::drawHexDigits(cr, this->patDigits,
+				this->hexDigitDims, digit, cellSize);
+			return;
+		}
+		auto label = Cairo::ImageSurface::create(Cairo::FORMAT_ARGB32,
+			cellSize.x, cellSize.y);
+		DrawingArea_Map2D::drawHexDigits(Cairo::Context::create(label),
+			this->patDigits, this->hexDigitDims, digit, cellSize);
+		itLabel = this->hexLabels.insert(std::make_pair(key, label)).first;
+		this->hexLabelBytes += bytes;
+	}
+
+	auto pattern = Cairo::SurfacePattern::create(itLabel->second);
+	pattern->set_filter(Cairo::FILTER_NEAREST);
+	cr->rectangle(0, 0, cellSize.x, cellSize.y);
+	cr->set_source(pattern);
+	cr->fill();
+	return;
+}
+
+Cairo::RefPtr<Cairo::ImageSurface> DrawingArea_Map2D::getScaledTile(
+	Map2DTileCache::TileImage& tile, int zoom)
+{
+	assert(zoom > 0);
+	if ((tile.scaled.size() >= (unsigned int)zoom) && tile.scaled[zoom - 1]) {
+		return tile.scaled[zoom - 1];
+	}
+
+	long scale = 1L << zoom;
+	long width = tile.dims.x * scale;
+	long height = tile.dims.y * scale;
+	unsigned long bytes = height
+		* Cairo::ImageSurface::format_stride_for_width(Cairo::FORMAT_ARGB32, width);
+	if (this->scaledBytes + bytes > MAP2D_SCALED_CACHE_LIMIT) {
+		// Start again rather than tracking which images were used least recently.
+		// They are quick to scale, and most will be needed again straight away.
+		for (auto& c : this->imgCache) c.clearScaled();
+		this->scaledBytes = 0;
+	}
+
+	// Only make room once the cache has been cleared, as that empties this
+	// tile's list too
+	if (tile.scaled.size() < (unsigned int)zoom) tile.scaled.resize(zoom);
+	auto& scaled = tile.scaled[zoom - 1];
+	scaled = Cairo::ImageSurface::create(Cairo::FORMAT_ARGB32, width, height);
+	this->scaledBytes += bytes;
+
+	auto patMatrix = Cairo::identity_matrix();
+	patMatrix.translate(tile.srcPos.x, tile.srcPos.y);
+	auto pattern = Cairo::SurfacePattern::create(tile.surface);
+	pattern->set_matrix(patMatrix);
+	// Keep the pixels sharp as they are enlarged, rather than blurring them
+	pattern->set_filter(Cairo::FILTER_NEAREST);
+
+	auto crScaled = Cairo::Context::create(scaled);
+	crScaled->scale(scale, scale);
+	crScaled->rectangle(0, 0, tile.dims.x, tile.dims.y);
+	crScaled->set_source(pattern);
+	crScaled->fill();
+	return scaled;
+}
+
+void DrawingArea_Map2D::queueDecode(unsigned int indexLayer,
+	const std::vector<unsigned int> *indices)
+{
+	auto& items = this->obj->layers()[indexLayer]->items();
+	auto& cache = this->imgCache[indexLayer];
+
+	// Only the first item using each code needs to be decoded.  Items are
+	// queued in the order they appear in the layer, which is usually row by
+	// row from the top-left, so the initially visible area tends to finish
+	// first.
+	std::vector<Map2D::Layer::Item> batch;
+	auto add = [&](const Map2D::Layer::Item& t) {
+		auto& thisTile = cache.get(t.code);
+		if (thisTile.loaded || thisTile.queued) return;
+		thisTile.queued = true;
+		batch.push_back(t);
+		if (batch.size() >= MAP2D_DECODE_BATCH) {
+			this->decoder.add(std::bind(&DrawingArea_Map2D::decodeTiles, this,
+				indexLayer, cache.generation, batch));
+			batch.clear();
+		}
+	};
+	if (indices) {
+		for (auto i : *indices) add(items[i]);
+	} else {
+		for (auto& t : items) add(t);
+	}
+	if (!batch.empty()) {
+		this->decoder.add(std::bind(&DrawingArea_Map2D::decodeTiles, this,
+			indexLayer, cache.generation, batch));
+	}
+	return;
+}
+
+void DrawingArea_Map2D::decodeTiles(unsigned int indexLayer,
+	unsigned int generation, std::vector<Map2D::Layer::Item> items)
+{
+	auto& layer = this->obj->layers()[indexLayer];
+	auto timeStart = std::chrono::steady_clock::now();
+
+	DecodedBatch batch;
+	batch.layer = indexLayer;
+	batch.generation = generation;
+	batch.tiles.reserve(items.size());
+
+	// Other tabs may be reading the same tilesets, so hold them all until the
+	// images have been read and packed.
+	std::vector<std::unique_lock<std::mutex>> locks;
+	for (auto& l : this->tilesetLocks) locks.emplace_back(*l);
+
+	// Keep every image open until the whole batch has been packed into an atlas
+	std::vector<std::unique_ptr<Image>> opened;
+	std::vector<const Image *> images;
+	for (auto& t : items) {
+		DecodedTile d;
+		d.code = t.code;
+		d.digit = 0;
+		std::unique_ptr<Image> img;
+		try {
+			auto imgType = layer->imageFromCode(t, this->allTilesets);
+			d.type = imgType.type;
+			switch (imgType.type) {
+				case Map2D::Layer::ImageFromCodeInfo::ImageType::Supplied:
+					assert(imgType.img);
+					img = std::move(imgType.img);
+					break;
+				case Map2D::Layer::ImageFromCodeInfo::ImageType::HexDigit:
+					// The digits are drawn on the main thread as that's where the digit
+					// images live.
+					d.digit = imgType.digit;
+					break;
+				default:
+					break;
+			}
+		} catch (const std::exception& e) {
+			std::cerr << "Error loading image: " << e.what() << std::endl;
+			d.type = Map2D::Layer::ImageFromCodeInfo::ImageType::Unknown;
+		}
+		batch.tiles.push_back(d);
+		images.push_back(img.get());
+		opened.push_back(std::move(img));
+	}
+	batch.atlas.build(images, nullptr);
+	opened.clear();
+	locks.clear();
+
+	std::chrono::duration<double> elapsed =
+		std::chrono::steady_clock::now() - timeStart;
+	batch.decodeTime = elapsed.count();
+
+	// Hand the images over to the main thread.  This thread must not keep any
+	// copies of the Cairo pointers, as their reference counts are not atomic, so
+	// the atlas is moved rather than copied.
+	{
+		std::lock_guard<std::mutex> lock(this->mtxDecoded);
+		this->decoded.push_back(std::move(batch));
+	}
+	this->dispatchDecoded.emit();
+	return;
+}
+
+void DrawingArea_Map2D::on_tiles_decoded()
+{
+	std::vector<DecodedBatch> results;
+	{
+		std::lock_guard<std::mutex> lock(this->mtxDecoded);
+		std::swap(results, this->decoded);
+	}
+	if (results.empty()) return;
+
+	std::set<unsigned int> changedLayers, grownLayers;
+	for (auto& batch : results) {
+		auto& li = this->layerIndex[batch.layer];
+		auto& cache = this->imgCache[batch.layer];
+		// Skip images decoded before the layer was last invalidated
+		if (batch.generation != cache.generation) continue;
+		cache.decodeTime += batch.decodeTime;
+
+		unsigned int indexAtlas = 0;
+		for (auto& d : batch.tiles) {
+			auto& ent = batch.atlas.entry(indexAtlas++);
+			auto& thisTile = cache.get(d.code);
+			if (thisTile.loaded) continue;
+
+			// Display nothing by default, but could be changed to a question mark
+			thisTile.dims = {0, 0};
+
+			switch (d.type) {
+				case Map2D::Layer::ImageFromCodeInfo::ImageType::Supplied:
+					if ((ent.rect.width == 0) || (ent.rect.height == 0)) break;
+					thisTile.surface = batch.atlas.pages()[ent.page];
+					thisTile.srcPos = {ent.rect.x, ent.rect.y};
+					thisTile.dims = {ent.rect.width, ent.rect.height};
+					thisTile.opaque = ent.opaque;
+					break;
+				case Map2D::Layer::ImageFromCodeInfo::ImageType::Blank:
+					thisTile.dims = {0, 0};
+					break;
+	//			case Map2D::Layer::ImageFromCodeInfo::ImageType::Unknown:
+				case Map2D::Layer::ImageFromCodeInfo::ImageType::HexDigit:
+					// Drawn from the digit images as needed, see drawHexLabel()
+					thisTile.hexDigit = true;
+					thisTile.digit = d.digit;
+					thisTile.dims = li.tileSize;
+					break;
+	//			case Map2D::Layer::ImageFromCodeInfo::ImageType::Interactive:
+				case Map2D::Layer::ImageFromCodeInfo::ImageType::NumImageTypes: // Avoid compiler warning about unhandled enum
+					assert(false);
+					break;
+				default:
+					break;
+			}
+			thisTile.loaded = true;
+			if (thisTile.hexDigit) {
+				thisTile.average = this->hexDigitAverage;
+			} else {
+				thisTile.average = averageColour(thisTile.surface, {
+					thisTile.srcPos.x, thisTile.srcPos.y, thisTile.dims.x, thisTile.dims.y
+				});
+			}
+			changedLayers.insert(batch.layer);
+
+			// Remember how far oversized images spill into neighbouring cells
+			if ((thisTile.dims.x == 0) || (thisTile.dims.y == 0)) continue;
+			auto& tileSize = li.tileSize;
+			long spillX = ((long)thisTile.dims.x + tileSize.x - 1) / tileSize.x - 1;
+			long spillY = ((long)thisTile.dims.y + tileSize.y - 1) / tileSize.y - 1;
+			if (spillX > (long)li.overhang.x) {
+				li.overhang.x = spillX;
+				grownLayers.insert(batch.layer);
+			}
+			if (spillY > (long)li.overhang.y) {
+				li.overhang.y = spillY;
+				grownLayers.insert(batch.layer);
+			}
+		}
+	}
+
+	for (auto indexLayer : changedLayers) {
+		if (grownLayers.count(indexLayer)) {
+			// Images from cells out of view might now reach into chunks that have
+			// already been drawn, so start again for this layer.
+			this->eraseLayerChunks(indexLayer);
+			this->queue_draw();
+			continue;
+		}
+		auto& cache = this->imgCache[indexLayer];
+		auto& items = this->obj->layers()[indexLayer]->items();
+		auto itChunk = this->chunks.lower_bound({indexLayer, MAP2D_ZOOM_MIN,
+			std::numeric_limits<long>::min(), std::numeric_limits<long>::min()});
+		while (
+			(itChunk != this->chunks.end())
+			&& (itChunk->first.layer == indexLayer)
+		) {
+			auto& key = itChunk->first;
+			auto& chunk = itChunk->second;
+			if (chunk.pending.empty()) {
+				++itChunk;
+			} else if (key.zoom >= 0) {
+				this->redrawPending(key, chunk);
+				++itChunk;
+			} else {
+				// Zoomed out chunks are shrunk from full size ones, so if any of their
+				// images have arrived, shrink them again when next drawn.
+				bool ready = false;
+				for (auto i : chunk.pending) {
+					if ((i >= items.size()) || cache.get(items[i].code).loaded) {
+						ready = true;
 						break;
 					}
-//					case Map2D::Layer::ImageFromCodeInfo::ImageType::Interactive:
-					case Map2D::Layer::ImageFromCodeInfo::ImageType::NumImageTypes: // Avoid compiler warning about unhandled enum
-						assert(false);
-						break;
 				}
-				thisTile.loaded = true;
+				if (!ready) {
+					++itChunk;
+					continue;
+				}
+				if (key.zoom == this->zoom) {
+					double scale = std::ldexp(1.0, key.zoom);
+					long numCells = DrawingArea_Map2D::chunkCells(key.zoom);
+					auto& tileSize = this->layerIndex[indexLayer].tileSize;
+					this->queue_draw_area(
+						key.x * numCells * tileSize.x * scale,
+						key.y * numCells * tileSize.y * scale,
+						numCells * tileSize.x * scale,
+						numCells * tileSize.y * scale
+					);
+				}
+				itChunk = this->eraseChunk(itChunk);
 			}
+		}
+	}
+
+	this->sigTilesLoaded.emit();
+	return;
+}
+
+void DrawingArea_Map2D::redrawPending(const ChunkKey& key, Chunk& chunk)
+{
+	auto& li = this->layerIndex[key.layer];
+	auto& tileSize = li.tileSize;
+	auto& items = this->obj->layers()[key.layer]->items();
+	auto& cache = this->imgCache[key.layer];
+	long numCells = DrawingArea_Map2D::chunkCells(key.zoom);
+	long scale = 1L << key.zoom;
+
+	auto crChunk = Cairo::Context::create(chunk.surface);
+	crChunk->translate(-key.x * numCells * tileSize.x * scale,
+		-key.y * numCells * tileSize.y * scale);
+
+	std::vector<unsigned int> pending, redraw;
+	std::swap(pending, chunk.pending);
+	for (auto i : pending) {
+		if (i >= items.size()) continue; // removed since
+		auto& t = items[i];
+		auto& thisTile = cache.get(t.code);
+		if (!thisTile.loaded) {
+			chunk.pending.push_back(i);
+			continue;
+		}
+
+		// Redraw everything under both the placeholder and the real image, which
+		// may be larger than a cell.
+		Rect cells = {
+			t.pos.x,
+			t.pos.y,
+			std::max(1L, ((long)thisTile.dims.x + tileSize.x - 1) / tileSize.x),
+			std::max(1L, ((long)thisTile.dims.y + tileSize.y - 1) / tileSize.y),
+		};
+		Rect pixels = {
+			cells.x * tileSize.x * scale,
+			cells.y * tileSize.y * scale,
+			cells.width * tileSize.x * scale,
+			cells.height * tileSize.y * scale,
+		};
+		crChunk->save();
+		crChunk->rectangle(pixels.x, pixels.y, pixels.width, pixels.height);
+		crChunk->clip();
+		crChunk->set_operator(Cairo::OPERATOR_CLEAR);
+		crChunk->paint();
+		crChunk->set_operator(Cairo::OPERATOR_OVER);
+		this->visibleItems(key.layer, cells, &redraw);
+		this->drawItems(crChunk, key.layer, key.zoom, redraw, &chunk.pending);
+		crChunk->restore();
 
-			if ((thisTile.dims.x == 0) || (thisTile.dims.y == 0)) continue; // no image
-			cr->save();
-			cr->translate(t.pos.x * tileSize.x, t.pos.y * tileSize.y);
-			cr->set_source(thisTile.surfacePattern);//, 0, 0);
-			cr->paint();
-			cr->restore();
+		if (key.zoom == this->zoom) {
+			this->queue_draw_area(pixels.x, pixels.y, pixels.width, pixels.height);
 		}
 	}
-	return true;
+
+	// Neighbouring items still waiting on their images may have been drawn
+	// again, so remove the duplicates.
+	std::sort(chunk.pending.begin(), chunk.pending.end());
+	chunk.pending.erase(
+		std::unique(chunk.pending.begin(), chunk.pending.end()),
+		chunk.pending.end()
+	);
+	return;
 }
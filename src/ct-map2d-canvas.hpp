@@ -21,9 +21,109 @@
 #ifndef STUDIO_CT_MAP2D_CANVAS_HPP_
 #define STUDIO_CT_MAP2D_CANVAS_HPP_
 
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 #include <camoto/gamegraphics/image.hpp> // Point
 #include <camoto/gamemaps/map2d.hpp>
+#include <glibmm/dispatcher.h>
 #include <gtkmm/drawingarea.h>
+#include "util-atlas.hpp"
+#include "util-worker.hpp"
+
+/// Number of cells along each edge of a spatial index bucket.
+#define MAP2D_BUCKET_SIZE 16
+
+/// Number of cells along each edge of a pre-rendered chunk.
+#define MAP2D_CHUNK_SIZE 32
+
+/// Maximum amount of memory to use for pre-rendered chunks, in bytes.
+#define MAP2D_CHUNK_CACHE_LIMIT (128 * 1024 * 1024)
+
+/// Tile codes below this value are cached in a flat array, the rest in a hash.
+#define MAP2D_DENSE_CODE_LIMIT 16384
+
+/// Most zoomed out level, as a power of two (-2 is 1/4 size).
+#define MAP2D_ZOOM_MIN -2
+
+/// Most zoomed in level, as a power of two (3 is 8 times size).
+#define MAP2D_ZOOM_MAX 3
+
+/// Maximum amount of memory to use for tile images enlarged for zooming in.
+#define MAP2D_SCALED_CACHE_LIMIT (64 * 1024 * 1024)
+
+/// Number of images decoded by each background job.
+#define MAP2D_DECODE_BATCH 64
+
+/// Maximum amount of memory to use for caching rendered hex number labels.
+#define MAP2D_LABEL_CACHE_LIMIT (4 * 1024 * 1024)
+
+/// Images for each tile code used in a single map layer.
+class Map2DTileCache
+{
+	public:
+		typedef decltype(camoto::gamemaps::Map2D::Layer::Item::code) Code;
+
+		/// Image to draw for a single tile code.
+		struct TileImage {
+			TileImage();
+
+			bool loaded;                        ///< false if not yet decoded
+			bool queued;                        ///< true if waiting to be decoded
+			camoto::gamegraphics::Point dims;   ///< Image size, {0, 0} for none
+			Cairo::RefPtr<Cairo::ImageSurface> surface; ///< Atlas page holding image
+			camoto::gamegraphics::Point srcPos; ///< Image's top-left within surface
+			uint32_t average;                   ///< Average colour, Cairo ARGB32
+			bool opaque;                        ///< true if no pixels transparent
+			bool hexDigit;                      ///< true to draw digit as a label
+			unsigned int digit;                 ///< Number shown if hexDigit is true
+
+			/// Image enlarged for each zoom level above 1:1, [0] being level 1.
+			/// Entries are null until the image is first drawn at that level.
+			std::vector<Cairo::RefPtr<Cairo::ImageSurface>> scaled;
+		};
+
+		Map2DTileCache();
+
+		/// Get the cached image for a tile code.
+		/**
+		 * An empty entry is created if the code hasn't been seen before.  The
+		 * entry's loaded member will be false until the image has been decoded.
+		 *
+		 * @param code
+		 *   Item::code value.
+		 *
+		 * @return Cache entry, which remains valid until the next call to get() or
+		 *   clear().
+		 */
+		TileImage& get(Code code);
+
+		/// Remove all images from the cache.
+		void clear();
+
+		/// Remove the enlarged copies of every image, keeping the originals.
+		void clearScaled();
+
+		/// Get the memory used by the enlarged copies of every image.
+		unsigned long scaledBytes() const;
+
+		unsigned long hits;   ///< Lookups that found an image already decoded
+		unsigned long misses; ///< Lookups that found an image not yet decoded
+		double decodeTime;    ///< Total time spent decoding images, in seconds
+
+		/// Incremented each time the cache is emptied because the layer has
+		/// changed, so images decoded for the old layer can be ignored.
+		unsigned int generation;
+
+	protected:
+		/// Entries for codes below MAP2D_DENSE_CODE_LIMIT, indexed by code.
+		std::vector<TileImage> dense;
+
+		/// Entries for codes too large for the dense array.
+		std::unordered_map<Code, TileImage> sparse;
+};
 
 class DrawingArea_Map2D: public Gtk::DrawingArea
 {
@@ -33,27 +133,571 @@ class DrawingArea_Map2D: public Gtk::DrawingArea
 		virtual ~DrawingArea_Map2D();
 
 		/// Set a 2D tile-based map to display in this tab.
+		/**
+		 * @param obj
+		 *   Map to display.
+		 *
+		 * @param allTilesets
+		 *   Tilesets the map's images come from.
+		 *
+		 * @param tilesetLocks
+		 *   Locks to hold while reading from the tilesets, for any that are shared
+		 *   with other tabs.  See Project::openShared().
+		 */
 		void content(std::shared_ptr<camoto::gamemaps::Map2D> obj,
-			camoto::gamemaps::TilesetCollection& allTilesets);
+			camoto::gamemaps::TilesetCollection& allTilesets,
+			const std::vector<std::shared_ptr<std::mutex>>& tilesetLocks);
+
+		/// Change the zoom level.
+		/**
+		 * @param level
+		 *   Zoom level as a power of two, so 0 is 1:1, 1 is double size and -1 is
+		 *   half size.  It is clamped to MAP2D_ZOOM_MIN and MAP2D_ZOOM_MAX.
+		 */
+		void setZoom(int level);
+
+		/// Get the current zoom level, as passed to setZoom().
+		int getZoom() const;
+
+		/// Get the average colour of the image for a tile code.
+		/**
+		 * @param indexLayer
+		 *   Index of the layer in obj->layers().
+		 *
+		 * @param code
+		 *   Item::code value.
+		 *
+		 * @param colour
+		 *   On return, the average colour of the code's image in Cairo's ARGB32
+		 *   format, or 0 if the image has not been decoded yet.
+		 *
+		 * @return true if the image has been decoded, false if not.
+		 */
+		bool tileColour(unsigned int indexLayer, Map2DTileCache::Code code,
+			uint32_t *colour);
+
+		/// Signal raised after a batch of tile images has been decoded.
+		sigc::signal<void>& signal_tiles_loaded();
+
+		/// Redraw some cells after their items have changed.
+		/**
+		 * Only the affected parts of any pre-rendered chunks are redrawn, and
+		 * only the matching parts of the widget are queued for redrawing, so
+		 * changing a single tile costs about as much as drawing a single tile.
+		 * Calls are merged and handled together before the next redraw.
+		 *
+		 * Items may have been changed, added, removed or moved.  When an item is
+		 * moved, both its old and new cells must be invalidated.
+		 *
+		 * @param indexLayer
+		 *   Index of the layer in obj->layers().
+		 *
+		 * @param cells
+		 *   Area that has changed, in units of the layer's cells.
+		 */
+		void invalidateCells(unsigned int indexLayer,
+			const camoto::gamegraphics::Rect& cells);
+
+		/// Redraw an entire layer after it has changed.
+		/**
+		 * All cached images and chunks for the layer are discarded, so this
+		 * should be used when the layer's size or tileset has changed.
+		 *
+		 * @param indexLayer
+		 *   Index of the layer in obj->layers().
+		 */
+		void invalidateLayer(unsigned int indexLayer);
+
+		/// Signal raised once changes passed to invalidateCells() or
+		/// invalidateLayer() have been dealt with.
+		/**
+		 * The parameters are the same as for invalidateCells().  This allows
+		 * other views of the same map to stay up to date, and visibleItems()
+		 * will return the new items by the time it is raised.
+		 */
+		sigc::signal<void, unsigned int, const camoto::gamegraphics::Rect&>&
+			signal_cells_invalidated();
+
+		/// Find all items in a layer that may be visible within an area.
+		/**
+		 * @param indexLayer
+		 *   Index of the layer in obj->layers().
+		 *
+		 * @param cells
+		 *   Area to search, in units of cells rather than pixels.
+		 *
+		 * @param items
+		 *   On return, the indices into layer->items() of every item that may
+		 *   overlap the area, in the same order as they appear in the layer so
+		 *   they are still painted in the correct order.
+		 */
+		void visibleItems(unsigned int indexLayer,
+			const camoto::gamegraphics::Rect& cells,
+			std::vector<unsigned int> *items) const;
 
 	protected:
 		virtual bool on_draw(const Cairo::RefPtr<Cairo::Context>& cr);
 
-		camoto::gamegraphics::Point hexDigitDims;
-		Cairo::RefPtr<Cairo::SurfacePattern> patDigits;
+		/// Number of cells along each edge of a chunk at the given zoom level.
+		static long chunkCells(int zoom);
+
+		/// Resize the widget to fit the map at the current zoom level.
+		void updateSize();
+
+		/// Sort every item in every layer into its spatial index bucket.
+		void buildIndex();
+
+		/// Sort every item in one layer into its spatial index bucket.
+		/**
+		 * @param indexLayer
+		 *   Index of the layer in obj->layers().
+		 */
+		void reindexLayer(unsigned int indexLayer);
+
+		/// Redraw the areas passed to invalidateCells().
+		/**
+		 * Called when the main loop is idle.
+		 */
+		bool on_flush_dirty();
+
+		/// Add a rectangle to a list, merging it with any it touches.
+		/**
+		 * @param rects
+		 *   List to add to, none of which overlap or touch.
+		 *
+		 * @param r
+		 *   Rectangle to add.
+		 */
+		static void mergeRect(std::vector<camoto::gamegraphics::Rect> *rects,
+			camoto::gamegraphics::Rect r);
+
+		/// Redraw some cells in any cached chunks of a layer.
+		/**
+		 * @param indexLayer
+		 *   Index of the layer in obj->layers().
+		 *
+		 * @param cells
+		 *   Area to redraw, in units of cells.  This must already include any
+		 *   cells that images could spill into.
+		 */
+		void repaintChunks(unsigned int indexLayer,
+			const camoto::gamegraphics::Rect& cells);
+
+		/// Work out again which items in each chunk of a layer are placeholders.
+		/**
+		 * Used when items have been added to or removed from the layer, which
+		 * changes the item indices stored in each chunk.
+		 *
+		 * @param indexLayer
+		 *   Index of the layer in obj->layers().
+		 */
+		void refreshPending(unsigned int indexLayer);
+
+		/// Get a pre-rendered chunk of a layer, rendering it if needed.
+		/**
+		 * Chunks at zoomed out levels are made by shrinking the 1:1 chunks
+		 * covering the same area.
+		 *
+		 * @param indexLayer
+		 *   Index of the layer in obj->layers().
+		 *
+		 * @param zoom
+		 *   Zoom level to render at.
+		 *
+		 * @param cx
+		 *   Chunk column, in units of chunkCells(zoom) cells.
+		 *
+		 * @param cy
+		 *   Chunk row, in units of chunkCells(zoom) cells.
+		 *
+		 * @return The rendered chunk, or a null pointer if there is nothing to
+		 *   draw in this part of the layer.
+		 */
+		Cairo::RefPtr<Cairo::ImageSurface> getChunk(unsigned int indexLayer,
+			int zoom, long cx, long cy);
+
+		struct Chunk;
+		struct ChunkKey;
+		struct ChunkJob;
+
+		/// Find out whether a chunk will be completely covered by opaque images.
+		/**
+		 * Such chunks are stored in FORMAT_RGB24 and drawn without blending.
+		 * Only images the same size as a cell or larger are considered.
+		 *
+		 * @param indexLayer
+		 *   Index of the layer in obj->layers().
+		 *
+		 * @param cells
+		 *   Area covered by the chunk, in units of cells.
+		 *
+		 * @param indices
+		 *   Items in the chunk, as returned by visibleItems().
+		 *
+		 * @return true if every cell within the layer has an opaque image.
+		 */
+		bool isChunkOpaque(unsigned int indexLayer,
+			const camoto::gamegraphics::Rect& cells,
+			const std::vector<unsigned int>& indices);
+
+		/// Add a newly rendered chunk to the cache.
+		/**
+		 * Least recently used chunks are discarded if this takes the cache over
+		 * MAP2D_CHUNK_CACHE_LIMIT, but never the one just added.
+		 *
+		 * @param key
+		 *   Location of the chunk.
+		 *
+		 * @param chunk
+		 *   Chunk to add.  Its lru member is set by this function.
+		 *
+		 * @return The chunk's surface, which may be null.
+		 */
+		Cairo::RefPtr<Cairo::ImageSurface> storeChunk(const ChunkKey& key,
+			Chunk chunk);
+
+		/// Render all missing chunks in an area, using every CPU core.
+		/**
+		 * Any chunks not already cached are split between the renderer threads,
+		 * so a large exposed area is drawn in parallel rather than one chunk at a
+		 * time by getChunk().  When zoomed out, the full size chunks the area will
+		 * be shrunk from are rendered instead.
+		 *
+		 * Nothing is done if fewer than two chunks are missing, as getChunk() can
+		 * draw those just as quickly without the handover to other threads.
+		 *
+		 * @param indexLayer
+		 *   Index of the layer in obj->layers().
+		 *
+		 * @param zoom
+		 *   Zoom level the area will be drawn at.
+		 *
+		 * @param chunkArea
+		 *   Area to render, in units of chunks at this zoom level.
+		 */
+		void renderChunks(unsigned int indexLayer, int zoom,
+			const camoto::gamegraphics::Rect& chunkArea);
+
+		/// Draw one chunk prepared by renderChunks().  Runs in a worker thread.
+		/**
+		 * cairomm's reference counts are not thread safe, so the job only holds
+		 * plain Cairo pointers and this function wraps them in RefPtrs of its
+		 * own.  The main thread must not touch any of the surfaces involved until
+		 * the job has finished.
+		 *
+		 * @param job
+		 *   Chunk to draw.
+		 */
+		static void paintChunk(const ChunkJob& job);
+
+		/// Get the threads shared by every map canvas for renderChunks().
+		/**
+		 * Chunks are only rendered while on_draw() waits for them, and GTK draws
+		 * one widget at a time, so one set of threads is enough however many
+		 * maps are open.  The threads are started by the first canvas and stop
+		 * once the last one is destroyed.  Only call from the main thread.
+		 */
+		static std::shared_ptr<WorkerPool> getRenderer();
+
+		/// Remove a chunk from the cache.
+		/**
+		 * @param itChunk
+		 *   Chunk to remove.
+		 *
+		 * @return Iterator to the chunk following the one removed.
+		 */
+		std::map<ChunkKey, Chunk>::iterator eraseChunk(
+			std::map<ChunkKey, Chunk>::iterator itChunk);
+
+		/// Discard every pre-rendered chunk for a layer, at every zoom level.
+		/**
+		 * @param indexLayer
+		 *   Index of the layer in obj->layers().
+		 */
+		void eraseLayerChunks(unsigned int indexLayer);
+
+		/// Discard any pre-rendered chunks affected by changes to some cells.
+		/**
+		 * @param indexLayer
+		 *   Index of the layer in obj->layers().
+		 *
+		 * @param cells
+		 *   Area that has changed, in units of cells.
+		 */
+		void invalidateChunks(unsigned int indexLayer,
+			const camoto::gamegraphics::Rect& cells);
+
+		/// Draw some of a layer's items.
+		/**
+		 * Items whose images haven't been decoded yet are drawn as a placeholder.
+		 *
+		 * @param cr
+		 *   Cairo context to draw onto, with the origin at the top-left of the
+		 *   layer.
+		 *
+		 * @param indexLayer
+		 *   Index of the layer in obj->layers().
+		 *
+		 * @param zoom
+		 *   Zoom level to draw at.  Must not be negative, as zoomed out chunks
+		 *   are shrunk from 1:1 ones instead.
+		 *
+		 * @param indices
+		 *   Indices into layer->items() of the items to draw, as returned by
+		 *   visibleItems().
+		 *
+		 * @param pending
+		 *   If not null, the index of every item drawn as a placeholder is
+		 *   appended to this list.
+		 */
+		void drawItems(const Cairo::RefPtr<Cairo::Context>& cr,
+			unsigned int indexLayer, int zoom,
+			const std::vector<unsigned int>& indices,
+			std::vector<unsigned int> *pending);
+
+		/// Get a tile image enlarged for a zoom level, scaling it if needed.
+		/**
+		 * @param tile
+		 *   Loaded image with non-zero dimensions.
+		 *
+		 * @param zoom
+		 *   Zoom level, which must be above 0.
+		 *
+		 * @return The enlarged image.
+		 */
+		Cairo::RefPtr<Cairo::ImageSurface> getScaledTile(
+			Map2DTileCache::TileImage& tile, int zoom);
+
+		/// Queue background jobs to decode the images used by some items.
+		/**
+		 * Codes that have already been decoded or queued are skipped.
+		 *
+		 * @param indexLayer
+		 *   Index of the layer in obj->layers().
+		 *
+		 * @param indices
+		 *   Indices into layer->items() of the items to decode, or nullptr for
+		 *   every item in the layer.
+		 */
+		void queueDecode(unsigned int indexLayer,
+			const std::vector<unsigned int> *indices);
+
+		/// Decode the images for some items.  Runs in a worker thread.
+		/**
+		 * The images are packed together into a single atlas, so a map with
+		 * thousands of tiles only needs a handful of surfaces.
+		 *
+		 * @param indexLayer
+		 *   Index of the layer in obj->layers().
+		 *
+		 * @param generation
+		 *   Value of Map2DTileCache::generation when the job was queued.
+		 *
+		 * @param items
+		 *   Items to decode, only the code of which is used.
+		 */
+		void decodeTiles(unsigned int indexLayer, unsigned int generation,
+			std::vector<camoto::gamemaps::Map2D::Layer::Item> items);
+
+		/// Move decoded images into the cache and redraw the cells using them.
+		/**
+		 * Called in the main thread via dispatchDecoded.
+		 */
+		void on_tiles_decoded();
+
+		/// Replace placeholders in a chunk with any images that are now decoded.
+		/**
+		 * @param key
+		 *   Location of the chunk.
+		 *
+		 * @param chunk
+		 *   Chunk to update.
+		 */
+		void redrawPending(const ChunkKey& key, Chunk& chunk);
+
+		/// Draw a number in hex, centred in a cell.
+		/**
+		 * The digits are painted straight from the digit images, so no surface
+		 * is needed for each number.
+		 *
+		 * @param cr
+		 *   Context to draw onto, with the cell's top-left corner at 0,0.
+		 *
+		 * @param patDigits
+		 *   Pattern holding all 16 digit images side by side.  Its matrix is
+		 *   changed as each digit is drawn.
+		 *
+		 * @param digitDims
+		 *   Size of each digit image, including the padding pixel on the right.
+		 *
+		 * @param digit
+		 *   Number to draw.
+		 *
+		 * @param cellSize
+		 *   Size of the cell, in pixels.
+		 */
+		static void drawHexDigits(const Cairo::RefPtr<Cairo::Context>& cr,
+			const Cairo::RefPtr<Cairo::SurfacePattern>& patDigits,
+			const camoto::gamegraphics::Point& digitDims, unsigned int digit,
+			const camoto::gamegraphics::Point& cellSize);
+
+		/// Draw a number in hex, reusing an earlier rendering if possible.
+		/**
+		 * Labels are cached until MAP2D_LABEL_CACHE_LIMIT is reached, after which
+		 * new numbers are drawn with drawHexDigits() each time instead.
+		 *
+		 * @param cr
+		 *   Context to draw onto, with the cell's top-left corner at 0,0.
+		 *
+		 * @param digit
+		 *   Number to draw.
+		 *
+		 * @param cellSize
+		 *   Size of the cell, in pixels.
+		 */
+		void drawHexLabel(const Cairo::RefPtr<Cairo::Context>& cr,
+			unsigned int digit, const camoto::gamegraphics::Point& cellSize);
+
+		camoto::gamegraphics::Point hexDigitDims; ///< Size of one digit image
+		Cairo::RefPtr<Cairo::ImageSurface> imgDigits; ///< All 16 digit images
+		Cairo::RefPtr<Cairo::SurfacePattern> patDigits; ///< Pattern for imgDigits
+		uint32_t hexDigitAverage; ///< Colour shown in the overview for numbers
+
+		/// Cached label images, by number then cell size.
+		std::map<std::pair<unsigned int, std::pair<long, long>>,
+			Cairo::RefPtr<Cairo::ImageSurface>> hexLabels;
+		unsigned long hexLabelBytes; ///< Memory used by hexLabels
+		Cairo::RefPtr<Cairo::ImageSurface> imgUnknown; ///< Placeholder image
+		Cairo::RefPtr<Cairo::SurfacePattern> patUnknown; ///< Pattern for imgUnknown
 
 		std::shared_ptr<camoto::gamemaps::Map2D> obj;
 		camoto::gamemaps::TilesetCollection allTilesets;
 
-		struct TileImage {
-			bool loaded;
-			camoto::gamegraphics::Point dims;
-			Cairo::RefPtr<Cairo::SurfacePattern> surfacePattern;
-		};
-		std::map<
-			decltype(camoto::gamemaps::Map2D::Layer::Item::code),
-			TileImage
-		> imgCache;
+		/// Locks for shared tilesets, sorted so they are always taken in the same
+		/// order and two canvases can't each end up holding one the other needs.
+		std::vector<std::shared_ptr<std::mutex>> tilesetLocks;
+
+		int zoom; ///< Current zoom level, see setZoom()
+
+		/// Tile images for each layer.  Codes are looked up through each layer's
+		/// own tileset, so the same code can have a different image in each layer.
+		std::vector<Map2DTileCache> imgCache;
+
+		/// Spatial index over a single layer's items.
+		struct LayerIndex {
+			camoto::gamegraphics::Point layerSize; ///< Layer size, in cells
+			camoto::gamegraphics::Point tileSize;  ///< Cell size, in pixels
+			camoto::gamegraphics::Point buckets;   ///< Bucket count across and down
+
+			/// Furthest any image extends beyond the right/bottom of its cell.
+			/**
+			 * Images larger than a cell (e.g. sprites) are drawn from the top-left
+			 * of their cell, so they can be visible even though their cell is off
+			 * screen.  This is how many cells to look past the top-left of the
+			 * visible area to catch them.  It grows as images are loaded.
+			 */
+			camoto::gamegraphics::Point overhang;
+
+			unsigned long numItems; ///< Number of items when last indexed
+
+			/// Indices into layer->items() for each bucket, row by row.
+			std::vector<std::vector<unsigned int>> bucketItems;
+		};
+		std::vector<LayerIndex> layerIndex; ///< One entry per map layer
+
+		/// Location of a pre-rendered chunk.
+		struct ChunkKey {
+			unsigned int layer; ///< Index of the layer in obj->layers()
+			int zoom;           ///< Zoom level the chunk was rendered at
+			long y;             ///< Chunk row
+			long x;             ///< Chunk column
+
+			bool operator< (const ChunkKey& b) const
+			{
+				if (this->layer != b.layer) return this->layer < b.layer;
+				if (this->zoom != b.zoom) return this->zoom < b.zoom;
+				if (this->y != b.y) return this->y < b.y;
+				return this->x < b.x;
+			}
+		};
+
+		/// A square block of cells drawn in advance, chunkCells() along each edge.
+		struct Chunk {
+			Cairo::RefPtr<Cairo::ImageSurface> surface; ///< Null if chunk is empty
+			unsigned long bytes;                        ///< Memory used by surface
+			std::list<ChunkKey>::iterator lru;          ///< Position in chunkLRU
+			std::vector<unsigned int> pending; ///< Items drawn as placeholders
+		};
+		std::map<ChunkKey, Chunk> chunks;  ///< Pre-rendered chunks for all layers
+		std::list<ChunkKey> chunkLRU;      ///< Chunks, most recently used first
+		unsigned long chunkBytes;          ///< Total memory used by chunks
+		unsigned long scaledBytes;         ///< Memory used by enlarged tiles
+
+		/// One item to draw in a chunk being rendered by paintChunk().
+		struct ChunkOp {
+			enum class Type {
+				Image,       ///< Draw part of source
+				HexDigit,    ///< Draw digit as a number
+				Placeholder, ///< Image not decoded yet
+			} type;
+			long x;                  ///< Left edge within the chunk, at 1:1
+			long y;                  ///< Top edge within the chunk, at 1:1
+			cairo_surface_t *source; ///< Atlas page, for Image type
+			long srcX;               ///< Image's left edge within source
+			long srcY;               ///< Image's top edge within source
+			long width;              ///< Image width, or cell width if no image
+			long height;             ///< Image height, or cell height if no image
+			unsigned int digit;      ///< Number to draw, for HexDigit type
+		};
+
+		/// A chunk handed to a worker thread by renderChunks().
+		struct ChunkJob {
+			cairo_surface_t *target;    ///< Chunk surface to draw onto
+			long scale;                 ///< Pixels per image pixel
+			std::vector<ChunkOp> ops;   ///< Items to draw, in order
+			cairo_surface_t *digits;    ///< Hex digit images, see patDigits
+			camoto::gamegraphics::Point digitDims; ///< See hexDigitDims
+			cairo_surface_t *unknown;   ///< Placeholder image, see patUnknown
+		};
+
+		/// An image decoded by a worker thread.
+		struct DecodedTile {
+			Map2DTileCache::Code code;  ///< Item::code the image is for
+			camoto::gamemaps::Map2D::Layer::ImageFromCodeInfo::ImageType type;
+			unsigned int digit;         ///< Number to draw, for HexDigit type
+		};
+
+		/// Images decoded by one background job, waiting to go into imgCache.
+		struct DecodedBatch {
+			unsigned int layer;             ///< Index of the layer in obj->layers()
+			unsigned int generation;        ///< Map2DTileCache::generation at queue
+			std::vector<DecodedTile> tiles; ///< Codes decoded
+			TileAtlas atlas;                ///< Images, one entry per tiles item
+			double decodeTime;              ///< Time taken to decode, in seconds
+		};
+		std::vector<DecodedBatch> decoded; ///< Decoded images, guarded by mtxDecoded
+		std::mutex mtxDecoded;            ///< Lock for decoded
+		Glib::Dispatcher dispatchDecoded; ///< Signals main thread to read decoded
+		sigc::signal<void> sigTilesLoaded; ///< See signal_tiles_loaded()
+
+		/// See signal_cells_invalidated()
+		sigc::signal<void, unsigned int, const camoto::gamegraphics::Rect&>
+			sigCellsInvalidated;
+
+		/// Areas passed to invalidateCells() not yet redrawn, for each layer.
+		std::vector<std::vector<camoto::gamegraphics::Rect>> dirtyCells;
+		bool flushPending; ///< true if on_flush_dirty() has been scheduled
+
+		/// Thread decoding images in the background.  Images are decoded one at a
+		/// time as the tileset streams cannot be read by two threads at once, and
+		/// tilesets shared with other tabs are locked while each batch is read.
+		/// Declared after everything its jobs use, so it is destroyed first.
+		WorkerPool decoder;
+
+		/// Threads drawing chunks for renderChunks(), one per CPU core, shared
+		/// with other canvases.  The main thread waits for these, so they never
+		/// run while on_draw() isn't.
+		std::shared_ptr<WorkerPool> renderer;
 };
 
 #endif // STUDIO_CT_MAP2D_CANVAS_HPP_
@@ -0,0 +1,305 @@
+/**
+ * @file  ct-map2d-overview.cpp
+ * @brief GTK DrawingArea widget showing a whole Map2D at a small size.
+ *
+ * Copyright (C) 2013-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <gtkmm.h>
+#include <camoto/gamemaps/util.hpp>
+#include "ct-map2d-overview.hpp"
+
+using namespace camoto::gamegraphics;
+using namespace camoto::gamemaps;
+
+/// How long to wait for more tiles to load before updating the colours, in
+/// milliseconds.
+#define OVERVIEW_REFRESH_DELAY 250
+
+DrawingArea_Map2DOverview::DrawingArea_Map2DOverview(BaseObjectType *obj,
+	const Glib::RefPtr<Gtk::Builder>& refBuilder)
+	:	Gtk::DrawingArea(obj),
+		canvas(nullptr),
+		refreshPending(false)
+{
+	this->add_events(Gdk::BUTTON_PRESS_MASK | Gdk::BUTTON1_MOTION_MASK);
+}
+
+void DrawingArea_Map2DOverview::content(std::shared_ptr<Map2D> obj,
+	DrawingArea_Map2D *canvas, Glib::RefPtr<Gtk::Adjustment> hadj,
+	Glib::RefPtr<Gtk::Adjustment> vadj)
+{
+	this->obj = obj;
+	this->canvas = canvas;
+	this->hadj = hadj;
+	this->vadj = vadj;
+
+	// Each overview pixel covers one cell of the layer with the largest cells,
+	// so the background is one pixel per tile and smaller items share pixels.
+	auto& layers = this->obj->layers();
+	this->layerCodes.clear();
+	this->layerCodes.resize(layers.size());
+	this->pixelSize = {1, 1};
+	Point mapSize = {0, 0};
+	unsigned int indexLayer = 0;
+	for (auto& layer : layers) {
+		auto& lc = this->layerCodes[indexLayer++];
+		Point layerSize;
+		getLayerDims(*this->obj, *layer, &layerSize, &lc.tileSize);
+		this->pixelSize.x = std::max(this->pixelSize.x, lc.tileSize.x);
+		this->pixelSize.y = std::max(this->pixelSize.y, lc.tileSize.y);
+		mapSize.x = std::max(mapSize.x, layerSize.x * lc.tileSize.x);
+		mapSize.y = std::max(mapSize.y, layerSize.y * lc.tileSize.y);
+	}
+	this->dims.x = std::max(1L,
+		((long)mapSize.x + this->pixelSize.x - 1) / this->pixelSize.x);
+	this->dims.y = std::max(1L,
+		((long)mapSize.y + this->pixelSize.y - 1) / this->pixelSize.y);
+	this->surface = Cairo::ImageSurface::create(Cairo::FORMAT_ARGB32,
+		this->dims.x, this->dims.y);
+
+	Rect all = {0, 0, this->dims.x, this->dims.y};
+	for (indexLayer = 0; indexLayer < layers.size(); indexLayer++) {
+		auto& lc = this->layerCodes[indexLayer];
+		lc.codes.assign(this->dims.x * this->dims.y, 0);
+		lc.present.assign(this->dims.x * this->dims.y, false);
+		this->fillCodes(indexLayer, all);
+	}
+	this->blendColours(all);
+
+	// Tiles that haven't been decoded yet have no colour, so fill them in as the
+	// canvas decodes them.
+	this->connTilesLoaded.disconnect();
+	this->connTilesLoaded = this->canvas->signal_tiles_loaded().connect(
+		sigc::mem_fun(this, &DrawingArea_Map2DOverview::on_tiles_loaded));
+
+	// Follow any changes made to the map through the canvas
+	this->connCellsInvalidated.disconnect();
+	this->connCellsInvalidated = this->canvas->signal_cells_invalidated().connect(
+		sigc::mem_fun(this, &DrawingArea_Map2DOverview::invalidateCells));
+
+	// Move the outline of the visible area when the main canvas scrolls or zooms
+	auto redraw = sigc::mem_fun(this, &DrawingArea_Map2DOverview::queue_draw);
+	this->connHScroll.disconnect();
+	this->connHChanged.disconnect();
+	this->connVScroll.disconnect();
+	this->connVChanged.disconnect();
+	this->connHScroll = this->hadj->signal_value_changed().connect(redraw);
+	this->connHChanged = this->hadj->signal_changed().connect(redraw);
+	this->connVScroll = this->vadj->signal_value_changed().connect(redraw);
+	this->connVChanged = this->vadj->signal_changed().connect(redraw);
+
+	this->queue_draw();
+	return;
+}
+
+void DrawingArea_Map2DOverview::invalidateCells(unsigned int indexLayer,
+	const Rect& cells)
+{
+	if (!this->surface) return;
+	auto& tileSize = this->layerCodes[indexLayer].tileSize;
+
+	// Convert the cells into the overview pixels they fall within
+	long x1 = std::max(0L, (long)cells.x * tileSize.x / this->pixelSize.x);
+	long y1 = std::max(0L, (long)cells.y * tileSize.y / this->pixelSize.y);
+	long x2 = std::min((long)this->dims.x,
+		((long)cells.x + cells.width) * tileSize.x / this->pixelSize.x + 1);
+	long y2 = std::min((long)this->dims.y,
+		((long)cells.y + cells.height) * tileSize.y / this->pixelSize.y + 1);
+	if ((x2 <= x1) || (y2 <= y1)) return;
+
+	Rect area = {x1, y1, x2 - x1, y2 - y1};
+	this->fillCodes(indexLayer, area);
+	this->blendColours(area);
+	this->queue_draw();
+	return;
+}
+
+bool DrawingArea_Map2DOverview::on_draw(const Cairo::RefPtr<Cairo::Context>& cr)
+{
+	if (!this->surface) return false; // map2d instance not set yet
+
+	double scale, offsetX, offsetY;
+	this->getLayout(&scale, &offsetX, &offsetY);
+
+	auto pattern = Cairo::SurfacePattern::create(this->surface);
+	if (scale * this->pixelSize.x >= 1) {
+		// Keep each tile a solid block rather than blurring them together
+		pattern->set_filter(Cairo::FILTER_NEAREST);
+	}
+	cr->save();
+	cr->translate(offsetX, offsetY);
+	cr->scale(scale * this->pixelSize.x, scale * this->pixelSize.y);
+	cr->rectangle(0, 0, this->dims.x, this->dims.y);
+	cr->set_source(pattern);
+	cr->fill();
+	cr->restore();
+
+	// Outline the part of the map visible in the main canvas
+	double canvasScale = std::ldexp(1.0, this->canvas->getZoom());
+	double viewScale = scale / canvasScale;
+	cr->rectangle(
+		std::floor(offsetX + this->hadj->get_value() * viewScale) + 0.5,
+		std::floor(offsetY + this->vadj->get_value() * viewScale) + 0.5,
+		std::max(1.0, std::floor(this->hadj->get_page_size() * viewScale) - 1),
+		std::max(1.0, std::floor(this->vadj->get_page_size() * viewScale) - 1)
+	);
+	cr->set_line_width(1);
+	cr->set_source_rgb(1, 1, 1);
+	cr->stroke();
+	return true;
+}
+
+bool DrawingArea_Map2DOverview::on_button_press_event(GdkEventButton *event)
+{
+	if (!this->surface) return false;
+	if (event->button != 1) return false;
+	this->scrollTo(event->x, event->y);
+	return true;
+}
+
+bool DrawingArea_Map2DOverview::on_motion_notify_event(GdkEventMotion *event)
+{
+	if (!this->surface) return false;
+	if (!(event->state & GDK_BUTTON1_MASK)) return false;
+	this->scrollTo(event->x, event->y);
+	return true;
+}
+
+void DrawingArea_Map2DOverview::on_tiles_loaded()
+{
+	// Tiles arrive in many small batches, so wait for a few to arrive rather
+	// than going over the whole map each time.
+	if (this->refreshPending) return;
+	this->refreshPending = true;
+	Glib::signal_timeout().connect(
+		sigc::mem_fun(this, &DrawingArea_Map2DOverview::on_refresh),
+		OVERVIEW_REFRESH_DELAY);
+	return;
+}
+
+bool DrawingArea_Map2DOverview::on_refresh()
+{
+	this->refreshPending = false;
+	this->blendColours({0, 0, this->dims.x, this->dims.y});
+	this->queue_draw();
+	return false; // don't run again
+}
+
+void DrawingArea_Map2DOverview::fillCodes(unsigned int indexLayer,
+	const Rect& area)
+{
+	auto& lc = this->layerCodes[indexLayer];
+	auto& tileSize = lc.tileSize;
+	if ((tileSize.x <= 0) || (tileSize.y <= 0)) return;
+
+	for (long y = area.y; y < (long)area.y + area.height; y++) {
+		for (long x = area.x; x < (long)area.x + area.width; x++) {
+			lc.present[y * this->dims.x + x] = false;
+		}
+	}
+
+	// Find every cell that falls within these pixels
+	Rect cells;
+	cells.x = (long)area.x * this->pixelSize.x / tileSize.x;
+	cells.y = (long)area.y * this->pixelSize.y / tileSize.y;
+	cells.width = ((long)area.x + area.width) * this->pixelSize.x
+		/ tileSize.x - cells.x;
+	cells.height = ((long)area.y + area.height) * this->pixelSize.y
+		/ tileSize.y - cells.y;
+
+	std::vector<unsigned int> found;
+	this->canvas->visibleItems(indexLayer, cells, &found);
+
+	// Items come back in layer order, so the one drawn on top wins
+	auto& items = this->obj->layers()[indexLayer]->items();
+	for (auto i : found) {
+		auto& t = items[i];
+		long x = (long)t.pos.x * tileSize.x / this->pixelSize.x;
+		long y = (long)t.pos.y * tileSize.y / this->pixelSize.y;
+		if ((x < (long)area.x) || (x >= (long)area.x + area.width)) continue;
+		if ((y < (long)area.y) || (y >= (long)area.y + area.height)) continue;
+		unsigned long offset = y * this->dims.x + x;
+		lc.codes[offset] = t.code;
+		lc.present[offset] = true;
+	}
+	return;
+}
+
+void DrawingArea_Map2DOverview::blendColours(const Rect& area)
+{
+	this->surface->flush();
+	auto data = this->surface->get_data();
+	int stride = this->surface->get_stride();
+	unsigned int numLayers = this->layerCodes.size();
+
+	for (long y = area.y; y < (long)area.y + area.height; y++) {
+		uint32_t *out = (uint32_t *)&data[y * stride] + area.x;
+		for (long x = area.x; x < (long)area.x + area.width; x++) {
+			unsigned long offset = y * this->dims.x + x;
+			// Draw each layer's colour over the one below it, as Cairo would
+			uint32_t pix = 0;
+			for (unsigned int l = 0; l < numLayers; l++) {
+				auto& lc = this->layerCodes[l];
+				if (!lc.present[offset]) continue;
+				uint32_t colour;
+				if (!this->canvas->tileColour(l, lc.codes[offset], &colour)) continue;
+				unsigned int keep = 255 - (colour >> 24);
+				uint32_t blended = 0;
+				for (int c = 0; c < 4; c++) {
+					unsigned int src = (colour >> (c * 8)) & 0xFF;
+					unsigned int dst = (pix >> (c * 8)) & 0xFF;
+					blended |= std::min(255U, src + dst * keep / 255) << (c * 8);
+				}
+				pix = blended;
+			}
+			*out++ = pix;
+		}
+	}
+	this->surface->mark_dirty(area.x, area.y, area.width, area.height);
+	return;
+}
+
+void DrawingArea_Map2DOverview::scrollTo(double x, double y)
+{
+	double scale, offsetX, offsetY;
+	this->getLayout(&scale, &offsetX, &offsetY);
+
+	// Convert from overview to main canvas coordinates, and centre the view
+	// there.  The adjustments keep the values within range.
+	double canvasScale = std::ldexp(1.0, this->canvas->getZoom());
+	double canvasX = (x - offsetX) / scale * canvasScale;
+	double canvasY = (y - offsetY) / scale * canvasScale;
+	this->hadj->set_value(canvasX - this->hadj->get_page_size() / 2);
+	this->vadj->set_value(canvasY - this->vadj->get_page_size() / 2);
+	return;
+}
+
+void DrawingArea_Map2DOverview::getLayout(double *scale, double *offsetX,
+	double *offsetY)
+{
+	// Fit the whole map into the widget, keeping its shape
+	double mapWidth = (double)this->dims.x * this->pixelSize.x;
+	double mapHeight = (double)this->dims.y * this->pixelSize.y;
+	double width = this->get_allocated_width();
+	double height = this->get_allocated_height();
+	*scale = std::min(width / mapWidth, height / mapHeight);
+	*offsetX = std::floor((width - mapWidth * *scale) / 2);
+	*offsetY = std::floor((height - mapHeight * *scale) / 2);
+	return;
+}
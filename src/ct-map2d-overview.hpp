@@ -0,0 +1,157 @@
+/**
+ * @file  ct-map2d-overview.hpp
+ * @brief GTK DrawingArea widget showing a whole Map2D at a small size.
+ *
+ * Copyright (C) 2013-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STUDIO_CT_MAP2D_OVERVIEW_HPP_
+#define STUDIO_CT_MAP2D_OVERVIEW_HPP_
+
+#include <camoto/gamemaps/map2d.hpp>
+#include <gtkmm/adjustment.h>
+#include <gtkmm/drawingarea.h>
+#include "ct-map2d-canvas.hpp"
+
+/// Overview of an entire map, with each tile drawn as a single pixel.
+/**
+ * Each pixel is the average colour of the tiles in that spot, with the layers
+ * blended together.  The average colours come from the main map canvas as it
+ * decodes each image, so the overview costs little more than one pass over
+ * the map's cells.
+ *
+ * Clicking or dragging in the overview scrolls the main canvas to that spot.
+ */
+class DrawingArea_Map2DOverview: public Gtk::DrawingArea
+{
+	public:
+		DrawingArea_Map2DOverview(BaseObjectType *obj,
+			const Glib::RefPtr<Gtk::Builder>& refBuilder);
+
+		/// Set the map to display.
+		/**
+		 * @param obj
+		 *   Map to display.
+		 *
+		 * @param canvas
+		 *   Main canvas displaying the same map, used to obtain the tile colours
+		 *   and zoom level.
+		 *
+		 * @param hadj
+		 *   Horizontal scroll position of the main canvas.
+		 *
+		 * @param vadj
+		 *   Vertical scroll position of the main canvas.
+		 */
+		void content(std::shared_ptr<camoto::gamemaps::Map2D> obj,
+			DrawingArea_Map2D *canvas, Glib::RefPtr<Gtk::Adjustment> hadj,
+			Glib::RefPtr<Gtk::Adjustment> vadj);
+
+		/// Update the overview after some cells in a layer have changed.
+		/**
+		 * @param indexLayer
+		 *   Index of the layer in obj->layers().
+		 *
+		 * @param cells
+		 *   Area that has changed, in units of the layer's cells.
+		 */
+		void invalidateCells(unsigned int indexLayer,
+			const camoto::gamegraphics::Rect& cells);
+
+	protected:
+		virtual bool on_draw(const Cairo::RefPtr<Cairo::Context>& cr);
+		virtual bool on_button_press_event(GdkEventButton *event);
+		virtual bool on_motion_notify_event(GdkEventMotion *event);
+
+		/// Schedule the colours to be updated once more tiles have been loaded.
+		void on_tiles_loaded();
+
+		/// Recalculate the colour of every pixel.
+		bool on_refresh();
+
+		/// Record which tile code is visible in each pixel for part of a layer.
+		/**
+		 * @param indexLayer
+		 *   Index of the layer in obj->layers().
+		 *
+		 * @param area
+		 *   Area to update, in overview pixels.
+		 */
+		void fillCodes(unsigned int indexLayer,
+			const camoto::gamegraphics::Rect& area);
+
+		/// Work out the colour of some pixels from the codes in each layer.
+		/**
+		 * @param area
+		 *   Area to update, in overview pixels.
+		 */
+		void blendColours(const camoto::gamegraphics::Rect& area);
+
+		/// Scroll the main canvas so a point in the overview is in the middle.
+		/**
+		 * @param x
+		 *   Horizontal position, in widget coordinates.
+		 *
+		 * @param y
+		 *   Vertical position, in widget coordinates.
+		 */
+		void scrollTo(double x, double y);
+
+		/// Get the scale and offset used to draw the overview into the widget.
+		/**
+		 * @param scale
+		 *   On return, the number of screen pixels per map pixel.
+		 *
+		 * @param offsetX
+		 *   On return, the left edge of the overview in widget coordinates.
+		 *
+		 * @param offsetY
+		 *   On return, the top edge of the overview in widget coordinates.
+		 */
+		void getLayout(double *scale, double *offsetX, double *offsetY);
+
+		std::shared_ptr<camoto::gamemaps::Map2D> obj;
+		DrawingArea_Map2D *canvas;
+		Glib::RefPtr<Gtk::Adjustment> hadj;
+		Glib::RefPtr<Gtk::Adjustment> vadj;
+
+		/// Size of the map covered by one overview pixel, in map pixels.
+		camoto::gamegraphics::Point pixelSize;
+
+		/// Size of the overview, in overview pixels.
+		camoto::gamegraphics::Point dims;
+
+		/// Tile code visible in each overview pixel of a layer, row by row.
+		struct LayerCodes {
+			camoto::gamegraphics::Point tileSize;    ///< Cell size, in map pixels
+			std::vector<Map2DTileCache::Code> codes; ///< Code for each pixel
+			std::vector<bool> present;               ///< false if pixel is empty
+		};
+		std::vector<LayerCodes> layerCodes; ///< One entry per map layer
+
+		/// Overview image, one pixel per dims.
+		Cairo::RefPtr<Cairo::ImageSurface> surface;
+
+		bool refreshPending; ///< true if on_refresh() has been scheduled
+		sigc::connection connTilesLoaded;
+		sigc::connection connCellsInvalidated;
+		sigc::connection connHScroll;
+		sigc::connection connHChanged;
+		sigc::connection connVScroll;
+		sigc::connection connVChanged;
+};
+
+#endif // STUDIO_CT_MAP2D_OVERVIEW_HPP_
@@ -0,0 +1,196 @@
+/**
+ * @file  ct-tileset-canvas.cpp
+ * @brief GTK DrawingArea widget showing every tile in a tileset as a grid.
+ *
+ * Copyright (C) 2013-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <gtkmm.h>
+#include "ct-tileset-canvas.hpp"
+
+using namespace camoto::gamegraphics;
+
+DrawingArea_Tileset::DrawingArea_Tileset(BaseObjectType *obj,
+	const Glib::RefPtr<Gtk::Builder>& refBuilder)
+	:	Gtk::DrawingArea(obj),
+		atlas(nullptr),
+		cellSize({0, 0}),
+		columns(1),
+		zoom(0),
+		resizeScheduled(false)
+{
+}
+
+void DrawingArea_Tileset::content(std::shared_ptr<Tileset> tileset,
+	const TileAtlas *atlas)
+{
+	this->tileset = tileset;
+	this->atlas = atlas;
+
+	this->pages.clear();
+	this->cellSize = {0, 0};
+	if (!atlas) {
+		this->set_size_request(-1, -1);
+		this->queue_draw();
+		return;
+	}
+
+	for (auto& p : atlas->pages()) {
+		auto pat = Cairo::SurfacePattern::create(p);
+		pat->set_filter(Cairo::FILTER_NEAREST);
+		this->pages.push_back(pat);
+	}
+
+	// Make every cell big enough for the largest tile, so the grid lines up
+	for (unsigned int i = 0; i < atlas->size(); i++) {
+		auto& e = atlas->entry(i);
+		this->cellSize.x = std::max<long>(this->cellSize.x, e.rect.width);
+		this->cellSize.y = std::max<long>(this->cellSize.y, e.rect.height);
+	}
+
+	this->updateSize();
+	this->queue_draw();
+	return;
+}
+
+void DrawingArea_Tileset::setZoom(int level)
+{
+	level = std::min(std::max(level, TILESET_ZOOM_MIN), TILESET_ZOOM_MAX);
+	if (level == this->zoom) return;
+	this->zoom = level;
+	this->updateSize();
+	this->queue_draw();
+	return;
+}
+
+int DrawingArea_Tileset::getZoom() const
+{
+	return this->zoom;
+}
+
+void DrawingArea_Tileset::on_size_allocate(Gtk::Allocation& allocation)
+{
+	this->Gtk::DrawingArea::on_size_allocate(allocation);
+
+	// Without a preferred layout the number of columns follows the window
+	// width.  Changing the size request here would start another allocation
+	// straight away, and can keep going if it makes a scrollbar come and go, so
+	// wait until GTK has finished laying out the window.
+	if (
+		this->tileset && (this->tileset->layoutWidth() == 0)
+		&& !this->resizeScheduled
+	) {
+		this->resizeScheduled = true;
+		Glib::signal_idle().connect(
+			sigc::mem_fun(this, &DrawingArea_Tileset::on_resize));
+	}
+	return;
+}
+
+bool DrawingArea_Tileset::on_resize()
+{
+	this->resizeScheduled = false;
+	unsigned int oldColumns = this->columns;
+	this->updateSize();
+	if (this->columns != oldColumns) this->queue_draw();
+	return false;
+}
+
+void DrawingArea_Tileset::getPitch(double *x, double *y) const
+{
+	double scale = std::ldexp(1.0, this->zoom);
+	*x = std::ceil(this->cellSize.x * scale) + TILESET_CELL_GAP;
+	*y = std::ceil(this->cellSize.y * scale) + TILESET_CELL_GAP;
+	return;
+}
+
+void DrawingArea_Tileset::updateSize()
+{
+	if (!this->atlas) return;
+
+	double pitchX, pitchY;
+	this->getPitch(&pitchX, &pitchY);
+
+	unsigned int numTiles = this->atlas->size();
+	unsigned int layoutWidth = this->tileset->layoutWidth();
+	int width;
+	if (layoutWidth > 0) {
+		this->columns = layoutWidth;
+		width = (int)(this->columns * pitchX);
+	} else {
+		// Fit as many as will go across, but only ask for one column's width so
+		// the window can still be made narrower.
+		this->columns = std::max(1,
+			(int)((this->get_allocated_width() + TILESET_CELL_GAP) / pitchX));
+		width = (int)pitchX;
+	}
+	unsigned int rows = (numTiles + this->columns - 1) / this->columns;
+	int height = (int)(rows * pitchY);
+
+	// Only ask again if the size has changed, as each request means another
+	// allocation
+	int oldWidth, oldHeight;
+	this->get_size_request(oldWidth, oldHeight);
+	if ((width != oldWidth) || (height != oldHeight)) {
+		this->set_size_request(width, height);
+	}
+	return;
+}
+
+bool DrawingArea_Tileset::on_draw(const Cairo::RefPtr<Cairo::Context>& cr)
+{
+	if (!this->atlas) return false; // tileset not set yet, or not converted
+	if ((this->cellSize.x <= 0) || (this->cellSize.y <= 0)) return true;
+
+	// Only the rows within the exposed area are drawn, so the number of tiles in
+	// the tileset makes no difference to how long this takes.
+	double clipX1, clipY1, clipX2, clipY2;
+	cr->get_clip_extents(clipX1, clipY1, clipX2, clipY2);
+
+	double pitchX, pitchY;
+	this->getPitch(&pitchX, &pitchY);
+	double scale = std::ldexp(1.0, this->zoom);
+
+	unsigned int numTiles = this->atlas->size();
+	unsigned int numRows = (numTiles + this->columns - 1) / this->columns;
+	long row1 = std::max((long)std::floor(clipY1 / pitchY), 0L);
+	long row2 = std::min((long)std::ceil(clipY2 / pitchY), (long)numRows);
+	long col1 = std::max((long)std::floor(clipX1 / pitchX), 0L);
+	long col2 = std::min((long)std::ceil(clipX2 / pitchX), (long)this->columns);
+
+	for (long row = row1; row < row2; row++) {
+		for (long col = col1; col < col2; col++) {
+			unsigned long index = row * this->columns + col;
+			if (index >= numTiles) break;
+			auto& e = this->atlas->entry(index);
+			if ((e.rect.width == 0) || (e.rect.height == 0)) continue; // no image
+
+			// Paint the tile's part of its atlas page, scaled to the zoom level
+			cr->save();
+			cr->translate(col * pitchX, row * pitchY);
+			cr->scale(scale, scale);
+			auto& pat = this->pages[e.page];
+			pat->set_matrix(Cairo::translation_matrix(e.rect.x, e.rect.y));
+			cr->set_source(pat);
+			cr->rectangle(0, 0, e.rect.width, e.rect.height);
+			cr->fill();
+			cr->restore();
+		}
+	}
+	return true;
+}
@@ -0,0 +1,115 @@
+/**
+ * @file  ct-tileset-canvas.hpp
+ * @brief GTK DrawingArea widget showing every tile in a tileset as a grid.
+ *
+ * Copyright (C) 2013-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STUDIO_CT_TILESET_CANVAS_HPP_
+#define STUDIO_CT_TILESET_CANVAS_HPP_
+
+#include <vector>
+#include <camoto/gamegraphics/tileset.hpp>
+#include <cairomm/pattern.h>
+#include <gtkmm/drawingarea.h>
+#include "util-atlas.hpp"
+
+/// Most zoomed out level, as a power of two (-2 is 1/4 size).
+#define TILESET_ZOOM_MIN -2
+
+/// Most zoomed in level, as a power of two (3 is 8 times size).
+#define TILESET_ZOOM_MAX 3
+
+/// Space left between cells in the grid, in screen pixels.
+#define TILESET_CELL_GAP 1
+
+/// Grid showing every tile in a tileset.
+/**
+ * The tiles are drawn straight from the tileset's atlas, so no surfaces are
+ * created for individual tiles.  Only the rows within the exposed area are
+ * drawn, so the cost of a redraw depends on the size of the window rather
+ * than the number of tiles in the tileset.
+ *
+ * All cells are the size of the largest tile, and there are as many columns
+ * as the tileset's layoutWidth(), or as many as will fit in the window if the
+ * tileset has no preferred layout.
+ */
+class DrawingArea_Tileset: public Gtk::DrawingArea
+{
+	public:
+		DrawingArea_Tileset(BaseObjectType *obj,
+			const Glib::RefPtr<Gtk::Builder>& refBuilder);
+
+		/// Set the tileset to display.
+		/**
+		 * @param tileset
+		 *   Tileset to display.
+		 *
+		 * @param atlas
+		 *   Atlas holding every image in tileset, as built by TileAtlas::build().
+		 *   It must remain valid until content() is called again.
+		 *   Pass null to leave the grid empty while the atlas is being built.
+		 */
+		void content(std::shared_ptr<camoto::gamegraphics::Tileset> tileset,
+			const TileAtlas *atlas);
+
+		/// Change the zoom level.
+		/**
+		 * @param level
+		 *   Zoom level as a power of two, so 0 is 1:1, 1 is double size and -1 is
+		 *   half size.  It is clamped to TILESET_ZOOM_MIN and TILESET_ZOOM_MAX.
+		 */
+		void setZoom(int level);
+
+		/// Get the current zoom level, as passed to setZoom().
+		int getZoom() const;
+
+	protected:
+		virtual bool on_draw(const Cairo::RefPtr<Cairo::Context>& cr);
+		virtual void on_size_allocate(Gtk::Allocation& allocation);
+
+		/// Fit the columns to the new width, after on_size_allocate().
+		/**
+		 * @return false, to run once when called from an idle handler.
+		 */
+		bool on_resize();
+
+		/// Work out the number of columns and set the canvas size to suit.
+		void updateSize();
+
+		/// Distance from one cell to the next, in screen pixels.
+		/**
+		 * @param x
+		 *   On return, the horizontal distance between cells.
+		 *
+		 * @param y
+		 *   On return, the vertical distance between cells.
+		 */
+		void getPitch(double *x, double *y) const;
+
+		std::shared_ptr<camoto::gamegraphics::Tileset> tileset;
+		const TileAtlas *atlas;
+
+		/// One pattern for each atlas page, set to keep pixels sharp when scaled.
+		std::vector<Cairo::RefPtr<Cairo::SurfacePattern>> pages;
+
+		camoto::gamegraphics::Point cellSize; ///< Largest tile, in image pixels
+		unsigned int columns; ///< Number of cells across the grid
+		int zoom;             ///< Zoom level, see setZoom()
+		bool resizeScheduled; ///< true if on_resize() is due
+};
+
+#endif // STUDIO_CT_TILESET_CANVAS_HPP_
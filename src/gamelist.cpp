@@ -584,6 +584,12 @@ Game::Game(const itemid_t& id)
 	xmlFreeDoc(xml);
 }
 
+EFormatMismatch::EFormatMismatch(const itemid_t& id, const Glib::ustring& msg)
+	:	EFailure(msg),
+		id(id)
+{
+}
+
 std::unique_ptr<GameObjectInstance> openObjectGeneric(Gtk::Window* win,
 	const GameObject& o, std::unique_ptr<camoto::stream::inout> content,
 	camoto::SuppData& suppData, DepData* depData, Project *proj)
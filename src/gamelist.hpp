@@ -23,6 +23,8 @@
 
 #include <vector>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <glibmm/i18n.h>
 #include <glibmm/ustring.h>
 #include <gtkmm/messagedialog.h>
@@ -299,10 +301,16 @@ class GameObjectInstance
 			Image,
 			Tileset,
 			Map2D,
+			Palette,
 		};
 
 		Type type;
 
+		/// Lock to hold while using the instance, if it is shared with other
+		/// users that may be on other threads.  Null if the instance is not
+		/// shared.  See Project::openShared().
+		std::shared_ptr<std::mutex> lock;
+
 		virtual ~GameObjectInstance() {};
 
 		template<class T>
@@ -342,6 +350,25 @@ typedef std::map<DepType, std::unique_ptr<GameObjectInstance> > DepData;
 #include <camoto/gamegraphics/manager.hpp>
 #include "project.hpp"
 
+/// Used when an item doesn't appear to be in the format it should be, and
+/// there is no window to ask the user whether to open it anyway.
+class EFormatMismatch: public EFailure
+{
+	public:
+		/// Create the exception.
+		/**
+		 * @param id
+		 *   ID of the item that failed the check.  This may be an archive or
+		 *   dependency of the item being opened rather than the item itself.
+		 *
+		 * @param msg
+		 *   Question to put to the user.
+		 */
+		EFormatMismatch(const itemid_t& id, const Glib::ustring& msg);
+
+		itemid_t id; ///< Item that failed the check
+};
+
 std::unique_ptr<GameObjectInstance> openObjectGeneric(Gtk::Window* win,
 	const GameObject& o, std::unique_ptr<camoto::stream::inout> content,
 	camoto::SuppData& suppData, DepData* depData, Project *proj);
@@ -349,7 +376,10 @@ std::unique_ptr<GameObjectInstance> openObjectGeneric(Gtk::Window* win,
 /// Open a Camoto object
 /**
  * @param win
- *   GTK window to set as parent for warning prompts/questions.
+ *   GTK window to set as parent for warning prompts/questions.  If this is
+ *   null, for example when running on a worker thread, EFormatMismatch is
+ *   thrown instead of asking whether to open a file that doesn't look like
+ *   the right format, unless Project::acceptFormat() has been called for it.
  *
  * @param o
  *   Details about object to open.
@@ -395,15 +425,21 @@ auto openObject(Gtk::Window* win,
 	}
 
 	// Check to see if the file is actually in this format
-	if (fmtHandler->isInstance(*content) < Type::PossiblyYes) {
-		Gtk::MessageDialog dlg(*win,
-			Glib::ustring::compose(
-				_("This file is supposed to be in \"%1\" format, but it seems this may "
-					"not be the case.  You can continue, but you may experience strange "
-					"results.  If Camoto crashes when you proceed, please report it as a "
-					"bug."),
-				fmtHandler->friendlyName().c_str()
-			),
+	if (
+		(fmtHandler->isInstance(*content) < Type::PossiblyYes)
+		&& !(proj && proj->isFormatAccepted(o.id))
+	) {
+		auto msg = Glib::ustring::compose(
+			_("This file is supposed to be in \"%1\" format, but it seems this may "
+				"not be the case.  You can continue, but you may experience strange "
+				"results.  If Camoto crashes when you proceed, please report it as a "
+				"bug."),
+			fmtHandler->friendlyName().c_str()
+		);
+		// Nobody to ask, so leave it to the caller to ask on the main thread
+		if (!win) throw EFormatMismatch(o.id, msg);
+
+		Gtk::MessageDialog dlg(*win, msg,
 			false, Gtk::MESSAGE_WARNING, Gtk::BUTTONS_OK_CANCEL, true);
 		dlg.set_title(_("Warning"));
 		if (dlg.run() != Gtk::RESPONSE_OK) return nullptr;
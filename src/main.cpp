@@ -29,6 +29,7 @@
 
 #include <iostream>
 #include <cassert>
+#include <mutex>
 #include <gtkmm.h>
 #include <glibmm/i18n.h>
 #include <camoto/util.hpp> // make_unique
@@ -40,6 +41,7 @@
 #include "tab-newproject.hpp"
 #include "tab-openfile.hpp"
 #include "tab-project.hpp"
+#include "util-export.hpp"
 
 using namespace camoto;
 using namespace camoto::gamegraphics;
@@ -50,7 +52,8 @@ config_data config;
 
 Studio::Studio(BaseObjectType *obj, const Glib::RefPtr<Gtk::Builder>& refBuilder)
 	:	Gtk::Window(obj),
-		refBuilder(refBuilder)
+		refBuilder(refBuilder),
+		opener(1)
 {
 	Glib::RefPtr<Gio::SimpleActionGroup> refActionGroup =
 		Gio::SimpleActionGroup::create();
@@ -68,6 +71,8 @@ Studio::Studio(BaseObjectType *obj, const Glib::RefPtr<Gtk::Builder>& refBuilder
 
 	ctInfo->signal_response().connect(sigc::mem_fun(this, &Studio::on_infobar_button));
 
+	this->dispatchOpened.connect(sigc::mem_fun(this, &Studio::on_item_opened));
+
 	// Load the standard icons
 	this->mapName["folder"] = Icon::Folder;
 	this->mapName["generic"] = Icon::Generic;
@@ -224,6 +229,197 @@ void Studio::openItem(const GameObject& item,
 		return;
 	}
 
+	this->showNoEditor(item);
+	return;
+}
+
+void Studio::openProjectItem(const GameObject& item, Project *proj)
+{
+	if (
+		(item.editor.compare("image") != 0)
+		&& (item.editor.compare("palette") != 0)
+		&& (item.editor.compare("tileset") != 0)
+		&& (item.editor.compare("map2d") != 0)
+	) {
+		// No point loading it in the background only to find it can't be edited
+		this->showNoEditor(item);
+		return;
+	}
+
+	auto tab = this->openTab<Tab_Opening>(item.friendlyName);
+	if (!tab) return; // GUI error
+
+	auto job = std::make_shared<OpenJob>();
+	job->item = item;
+	job->proj = proj;
+	job->cancelled = false;
+	tab->content(job);
+	this->opener.add(std::bind(&Studio::runOpenJob, this, job));
+	return;
+}
+
+void Studio::runOpenJob(std::shared_ptr<OpenJob> job)
+{
+	// Every path ends up handing the job back below, even if cancelled, so the
+	// main thread always hears about it.
+	try {
+		if (!job->cancelled && (job->item.editor.compare("tileset") == 0)) {
+			// Shared with any map using the same tileset, so they both use the
+			// same lock.  No window is passed, for the same reason as below.
+			job->inst = job->proj->openShared(nullptr, job->item);
+		} else if (!job->cancelled) {
+			// No window is passed, because only the main thread can show dialogs.
+			// Any question about the file format is thrown back as
+			// EFormatMismatch instead, to be asked by on_item_opened().
+			auto content = job->proj->openFile(nullptr, job->item, true);
+			if (!content) {
+				throw EFailure(_("The archive holding this item could not be "
+					"opened."));
+			}
+
+			SuppData suppData;
+			if (!job->cancelled) {
+				job->proj->openSuppsByObj(nullptr, &suppData, job->item);
+			}
+			if (!job->cancelled) {
+				job->inst = openObjectGeneric(nullptr, job->item, std::move(content),
+					suppData, &job->depData, job->proj);
+			}
+		}
+	} catch (const EFormatMismatch& e) {
+		job->idQuestion = e.id;
+		job->question = e.getMessage();
+	} catch (const EFailure& e) {
+		job->error = e.getMessage();
+	} catch (const stream::error& e) {
+		job->error = Glib::ustring::compose(_("Camoto library exception: %1"),
+			e.what());
+	} catch (const std::exception& e) {
+		job->error = Glib::ustring::compose(_("Unexpected error: %1"), e.what());
+	} catch (...) {
+		job->error = _("Unknown error.");
+	}
+	{
+		std::lock_guard<std::mutex> lock(this->mtxOpened);
+		this->opened.push_back(job);
+	}
+	this->dispatchOpened.emit();
+	return;
+}
+
+void Studio::on_item_opened()
+{
+	std::vector<std::shared_ptr<OpenJob>> jobs;
+	{
+		std::lock_guard<std::mutex> lock(this->mtxOpened);
+		jobs.swap(this->opened);
+	}
+	for (auto& job : jobs) {
+		if (job->cancelled) continue; // placeholder tab has been closed
+
+		if (!job->question.empty()) {
+			Gtk::MessageDialog dlg(*this, job->question, false,
+				Gtk::MESSAGE_WARNING, Gtk::BUTTONS_OK_CANCEL, true);
+			dlg.set_title(_("Warning"));
+			if (dlg.run() == Gtk::RESPONSE_OK) {
+				// Start again, this time skipping the check that failed
+				job->proj->acceptFormat(job->idQuestion);
+				job->idQuestion.clear();
+				job->question.clear();
+				job->depData.clear();
+				this->opener.add(std::bind(&Studio::runOpenJob, this, job));
+			} else {
+				job->cancelled = true;
+				this->closeTab(job->tab);
+			}
+			continue;
+		}
+		this->openInstance(job);
+	}
+	return;
+}
+
+void Studio::openInstance(std::shared_ptr<OpenJob> job)
+{
+	Gtk::Notebook* tabs = 0;
+	this->refBuilder->get_widget("tabs", tabs);
+	assert(tabs);
+
+	// Put the new tab where the placeholder was, and don't take the focus away
+	// from another tab if the user has moved on to something else.
+	int pos = tabs->page_num(*job->tab);
+	Gtk::Widget *prevTab = nullptr;
+	if (tabs->get_current_page() != pos) {
+		prevTab = tabs->get_nth_page(tabs->get_current_page());
+	}
+	job->cancelled = true; // the placeholder is finished with
+	this->closeTab(job->tab);
+	job->tab = nullptr;
+
+	const GameObject& item = job->item;
+	Gtk::Box *tab = nullptr;
+	try {
+		if (!job->error.empty()) throw EFailure(job->error);
+
+		switch (job->inst ? job->inst->type : GameObjectInstance::Type::Invalid) {
+			case GameObjectInstance::Type::Image: {
+				auto t = this->openTab<Tab_Graphics>(item.friendlyName);
+				if (!t) return; // GUI error
+				t->content(job->inst->get_unique<Image>());
+				tab = t;
+				break;
+			}
+			case GameObjectInstance::Type::Tileset: {
+				auto t = this->openTab<Tab_Graphics>(item.friendlyName);
+				if (!t) return; // GUI error
+				t->content(job->inst->get_shared<Tileset>(), job->inst->lock);
+				tab = t;
+				break;
+			}
+			case GameObjectInstance::Type::Map2D: {
+				auto map2d = job->inst->get_unique<Map2D>();
+				if (!map2d) {
+					throw EFailure(
+						Glib::ustring::compose(
+							_("Successfully opened a map object, but the \"%1\" editor was "
+								"specified and this map does not provide that interface.  If "
+								"you are adding a new game to Camoto, try specifying a "
+								"different map editor."),
+							"map2d"
+						));
+				}
+				auto t = this->openTab<Tab_Map2D>(item.friendlyName);
+				if (!t) return; // GUI error
+				t->content(std::move(map2d), job->depData);
+				tab = t;
+				break;
+			}
+			default:
+				this->showNoEditor(item);
+				return;
+		}
+	} catch (const EFailure& e) {
+		Gtk::MessageDialog dlg(*this,
+			Glib::ustring::compose(
+				// Translators: %1 is the XML ID of the item being opened, and %2 is
+				// the reason why the item could not be opened.
+				_("This item (\"%1\") could not be opened for the following reason:\n\n%2"),
+				item.id,
+				e.getMessage()
+			),
+			false, Gtk::MESSAGE_ERROR, Gtk::BUTTONS_OK, true);
+		dlg.set_title(_("Open failure"));
+		dlg.run();
+		return;
+	}
+
+	if (pos >= 0) tabs->reorder_child(*tab, pos);
+	if (prevTab) tabs->set_current_page(tabs->page_num(*prevTab));
+	return;
+}
+
+void Studio::showNoEditor(const GameObject& item)
+{
 	Gtk::MessageDialog dlg(*this,
 		Glib::ustring::compose(
 			"%1\n\n[%2]",
@@ -311,13 +507,61 @@ Glib::RefPtr<Gdk::Pixbuf> Studio::getIcon(Icon icon)
 	return this->icons[icon];
 }
 
-int main(int argc, char *argv[])
+/// Export every image and tileset in a project without opening any windows.
+/**
+ * @param projPath
+ *   Folder containing the project to export.
+ *
+ * @param targetPath
+ *   Existing folder to write the .png files into.
+ *
+ * @return Exit code for main(), nonzero if anything could not be exported.
+ */
+int exportGraphics(const std::string& projPath, const std::string& targetPath)
 {
-	Glib::RefPtr<Gtk::Application> app = Gtk::Application::create(argc, argv,
-		"net.shikadi.camoto");
-	// Translators: "Camoto" should not be translated but "Studio" should be
-	Glib::set_application_name(_("Camoto Studio"));
+	if (!Glib::file_test(::path.dataRoot, Glib::FILE_TEST_IS_DIR)) {
+		std::cerr << Glib::ustring::compose(
+			_("Cannot find Camoto Studio data directory: %1"), ::path.dataRoot)
+			<< std::endl;
+		return 1;
+	}
+	if (!Glib::file_test(targetPath, Glib::FILE_TEST_IS_DIR)) {
+		std::cerr << Glib::ustring::compose(
+			// Translators: %1 is the folder given on the command line
+			_("Export folder %1 does not exist"), targetPath) << std::endl;
+		return 1;
+	}
 
+	std::unique_ptr<Project> proj;
+	try {
+		proj = std::make_unique<Project>(projPath);
+	} catch (const EProjectOpenFailure& e) {
+		std::cerr << Glib::ustring::compose(
+			_("Unable to open project %1: %2"), projPath, e.what()) << std::endl;
+		return 1;
+	}
+
+	GraphicsExporter exporter(proj.get(), targetPath);
+	std::mutex mtxOutput;
+	exporter.start([&exporter, &mtxOutput]() {
+		std::lock_guard<std::mutex> lock(mtxOutput);
+		std::cout << "[export] " << exporter.getDone() << "/"
+			<< exporter.getTotal() << " done" << std::endl;
+	});
+	exporter.wait();
+
+	auto failures = exporter.getFailures();
+	for (auto& f : failures) {
+		std::cerr << "[export] " << f.id << ": " << f.error << std::endl;
+	}
+	std::cout << Glib::ustring::compose(
+		_("Exported %1 images and tilesets to %2"),
+		exporter.getTotal() - failures.size(), targetPath) << std::endl;
+	return failures.empty() ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
 	// Set all the standard paths
 #ifdef WIN32
 	// Use the 'data' subdir in the executable's dir
@@ -326,6 +570,22 @@ int main(int argc, char *argv[])
 	// Use the value given to the configure script by --datadir
 	::path.dataRoot = DATA_PATH;
 #endif
+	::path.gameData = Glib::build_filename(::path.dataRoot, "games");
+	::path.gameScreenshots = Glib::build_filename(::path.gameData, "screenshots");
+	::path.gameIcons = Glib::build_filename(::path.gameData, "icons");
+	::path.guiIcons = Glib::build_filename(::path.dataRoot, "icons");
+	::path.miscImages = Glib::build_filename(::path.dataRoot, "images");
+
+	// Batch mode, run before GTK is started so no display is needed
+	if ((argc == 4) && (std::string(argv[1]).compare("--export-graphics") == 0)) {
+		return exportGraphics(argv[2], argv[3]);
+	}
+
+	Glib::RefPtr<Gtk::Application> app = Gtk::Application::create(argc, argv,
+		"net.shikadi.camoto");
+	// Translators: "Camoto" should not be translated but "Studio" should be
+	Glib::set_application_name(_("Camoto Studio"));
+
 	std::cout << "[init] Data root is " << ::path.dataRoot << "\n";
 
 	if (!Glib::file_test(::path.dataRoot, Glib::FILE_TEST_IS_DIR)) {
@@ -337,11 +597,6 @@ int main(int argc, char *argv[])
 		dlg.run();
 		return 1;
 	}
-	::path.gameData = Glib::build_filename(::path.dataRoot, "games");
-	::path.gameScreenshots = Glib::build_filename(::path.gameData, "screenshots");
-	::path.gameIcons = Glib::build_filename(::path.gameData, "icons");
-	::path.guiIcons = Glib::build_filename(::path.dataRoot, "icons");
-	::path.miscImages = Glib::build_filename(::path.dataRoot, "images");
 
 	// Display the main window
 	Glib::RefPtr<Gtk::Builder> refBuilder = Gtk::Builder::create();
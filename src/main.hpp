@@ -31,9 +31,13 @@
 	"redistribute it under certain conditions; see \n" \
 	"<http://www.gnu.org/licenses/> for details.\n"
 
+#include <mutex>
+#include <vector>
 #include <gtkmm.h>
 #include "gamelist.hpp"
 #include "project.hpp"
+#include "tab-opening.hpp"
+#include "util-worker.hpp"
 
 /// File paths
 struct paths
@@ -103,6 +107,23 @@ class Studio: public Gtk::Window
 			camoto::SuppData& suppData,
 			Project *proj);
 
+		/// Open an item from a project in a new tab, without blocking the GUI.
+		/**
+		 * A placeholder tab is shown straight away, while the item's file,
+		 * supplementary files and dependencies are opened and decoded on a
+		 * background thread.  Once done, the placeholder is replaced with an
+		 * editor tab, or closed with an error message if the item could not be
+		 * opened.  Closing the placeholder cancels the open.
+		 *
+		 * @param item
+		 *   Item to open.
+		 *
+		 * @param proj
+		 *   Project the item belongs to.  It must remain valid until the item
+		 *   has finished opening.
+		 */
+		void openProjectItem(const GameObject& item, Project *proj);
+
 		void closeTab(Gtk::Box *tab);
 
 		/// Display a message in the main window's infobar
@@ -129,10 +150,40 @@ class Studio: public Gtk::Window
 		template <class T>
 		T* openTab(const Glib::ustring& title);
 
+		/// Tell the user there is no editor for this type of item.
+		void showNoEditor(const GameObject& item);
+
+		/// Open an item on a worker thread, for openProjectItem().
+		/**
+		 * @param job
+		 *   Item to open.  Once finished, it is passed to on_item_opened() on the
+		 *   main thread, unless it was cancelled.
+		 */
+		void runOpenJob(std::shared_ptr<OpenJob> job);
+
+		/// Deal with the jobs finished by runOpenJob().
+		void on_item_opened();
+
+		/// Swap a finished job's placeholder tab for an editor tab.
+		/**
+		 * @param job
+		 *   Job that has finished, successfully or not.
+		 */
+		void openInstance(std::shared_ptr<OpenJob> job);
+
 	protected:
 		Glib::RefPtr<Gtk::Builder> refBuilder;
 		std::map<std::string, Icon> mapName;
 		std::map<Icon, Glib::RefPtr<Gdk::Pixbuf>> icons;
+
+		std::vector<std::shared_ptr<OpenJob>> opened; ///< Finished jobs
+		std::mutex mtxOpened;             ///< Lock for opened
+		Glib::Dispatcher dispatchOpened;  ///< Signals main thread to read opened
+
+		/// Thread opening items for openProjectItem().  One is enough, as each
+		/// item's dependencies are opened in parallel by Project::openDeps().
+		/// Declared last so it is destroyed before anything its jobs use.
+		WorkerPool opener;
 };
 
 #endif // _MAIN_HPP_
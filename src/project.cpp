@@ -19,6 +19,7 @@
  */
 
 #include <cassert>
+#include <exception>
 #include <iostream>
 #include <glibmm/fileutils.h>
 #include <glibmm/i18n.h>
@@ -27,11 +28,15 @@
 #include <giomm/file.h>
 #include <camoto/util.hpp> // make_unique
 #include <camoto/stream_file.hpp>
+#include <camoto/gamearchive/fatarchive.hpp>
 #include <camoto/gamearchive/fixedarchive.hpp>
 #include <camoto/gamearchive/manager.hpp>
 #include <camoto/gamearchive/util.hpp>
 #include "gamelist.hpp"
 #include "project.hpp"
+#include "util-mmap.hpp"
+#include "util-stream.hpp"
+#include "util-worker.hpp"
 
 using namespace camoto;
 using namespace camoto::gamearchive;
@@ -41,6 +46,20 @@ void noopTruncate()
 	return;
 }
 
+/// Get the modification time of a file, in microseconds, or 0 on error.
+uint64_t getModTime(const std::string& filename)
+{
+	auto file = Gio::File::create_for_path(filename);
+	try {
+		auto info = file->query_info(G_FILE_ATTRIBUTE_TIME_MODIFIED ","
+			G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC);
+		auto mtime = info->modification_time();
+		return (uint64_t)mtime.tv_sec * 1000000 + mtime.tv_usec;
+	} catch (const Gio::Error& e) {
+		return 0;
+	}
+}
+
 EProjectOpenFailure::EProjectOpenFailure(const std::string& msg)
 	:	EFailure(msg)
 {
@@ -93,7 +112,8 @@ std::unique_ptr<Project> Project::create(const std::string& targetPath,
 }
 
 Project::Project(const std::string& path, bool create)
-	:	path(path)
+	:	path(path),
+		filterCache(Glib::build_filename(path, PROJECT_CACHE))
 {
 	if (create) {
 		this->cfg_projrevision = 0;
@@ -250,8 +270,12 @@ std::unique_ptr<stream::inout> Project::openFile(Gtk::Window* win,
 				fn
 			));
 		}
+		std::shared_ptr<MappedFile> dataFile;
 		try {
-			s = std::make_unique<stream::file>(fn, false/*no create*/);
+			// Mapped, so archives can read their file lists and files straight
+			// from memory.  Changes are kept in memory until they are flushed.
+			dataFile = this->getDataFile(fn);
+			s = std::make_unique<MappedStream>(dataFile);
 		} catch (stream::open_error& e) {
 			throw EFailure(Glib::ustring::compose(
 				_("Unable to open file \"%1\": %2"),
@@ -271,9 +295,29 @@ std::unique_ptr<stream::inout> Project::openFile(Gtk::Window* win,
 					o.filter
 				));
 			}
+			FilterCache::Key key;
+			key.source = o.filename;
+			key.offset = 0;
+			key.size = s->size();
+			// Unsaved changes aren't in the file on disk yet, see
+			// openFileFromArchive()
+			key.mtime = dataFile->isChanged() ? 0 : getModTime(fn);
+			key.filter = o.filter;
+			// The cache reads the file again if it needs to decode it.  This goes
+			// through the same mapping as everything else using the file, so when
+			// the decoded item is flushed the encoded data replaces the file
+			// through MappedFile::saveToFile() rather than being written into the
+			// mapped file in place.
+			s.reset();
 			try {
-				std::cout << "[project] Applying filter " << o.filter << "\n";
-				s = pFilterType->apply(std::move(s), std::bind<void>(&noopTruncate));
+				auto idFilter = o.filter;
+				s = this->filterCache.open(key, [dataFile, pFilterType, idFilter]() {
+					std::cout << "[project] Applying filter " << idFilter << "\n";
+					std::unique_ptr<stream::inout> raw =
+						std::make_unique<MappedStream>(dataFile);
+					return pFilterType->apply(std::move(raw),
+						std::bind<void>(&noopTruncate));
+				});
 			} catch (const camoto::filter_error& e) {
 				throw EFailure(Glib::ustring::compose(
 					// Translators: %1 is the item ID, %2 is the filter ID, %3 is the
@@ -360,27 +404,167 @@ void Project::openSuppsByFilename(Gtk::Window* win, SuppData *suppOut,
 void Project::openDeps(Gtk::Window* win, const GameObject& o,
 	camoto::SuppData& suppData, DepData* depData)
 {
-	for (auto& d : o.dep) {
-
-		// We have to give each dep item a different set of SuppData elements,
-		// because they can't be shared.  Otherwise if they both need a palette,
-		// the first one will std::move() the stream out, and the second one
-		// will get an apparently valid SuppData item but with a null pointer left
-		// in it, which is not allowed.
-		SuppData d_suppData;
-
-		auto d_gameObj = this->findItem(d.second);
-		auto d_content = this->openFile(win, d_gameObj, true);
-		auto d_inst = openObjectGeneric(win, d_gameObj, std::move(d_content),
-			d_suppData, nullptr, this);
-		(*depData)[d.first] = std::move(d_inst);
+	if (o.dep.empty()) return;
+
+	/// Outcome of opening one dependency.
+	struct DepResult {
+		DepType type;
+		itemid_t id;
+		std::unique_ptr<GameObjectInstance> inst;
+		bool formatMismatch;      ///< true if it failed the format check
+		std::exception_ptr error; ///< Any other failure
+	};
+	std::vector<DepResult> results(o.dep.size());
+
+	{
+		// One thread per dependency, so opening them all takes about as long as
+		// the slowest one.  The pool is local to this call, so a dependency can
+		// open its own dependencies without waiting on a busy thread.
+		WorkerPool loader(o.dep.size());
+		unsigned int i = 0;
+		for (auto& d : o.dep) {
+			DepResult& r = results[i++];
+			r.type = d.first;
+			r.id = d.second;
+			r.formatMismatch = false;
+			loader.add([this, &r]() {
+				try {
+					// No window, as dialogs can only be shown by the main thread
+					r.inst = this->openShared(nullptr, this->findItem(r.id));
+				} catch (const EFormatMismatch& e) {
+					r.formatMismatch = true;
+					r.error = std::current_exception();
+				} catch (...) {
+					r.error = std::current_exception();
+				}
+			});
+		}
+		loader.wait();
+	}
+
+	for (auto& r : results) {
+		if (r.formatMismatch && win) {
+			// Open it again here, where the user can be asked about it
+			r.inst = this->openShared(win, this->findItem(r.id));
+		} else if (r.error) {
+			std::rethrow_exception(r.error);
+		}
+		(*depData)[r.type] = std::move(r.inst);
 	}
 	return;
 }
 
+std::unique_ptr<GameObjectInstance> Project::openShared(Gtk::Window* win,
+	const GameObject& o)
+{
+	auto revision = this->getRevision(o);
+
+	std::unique_lock<std::mutex> lock(this->mtxShared);
+
+	// If another thread is opening this item, wait for it to finish
+	this->cvShared.wait(lock, [this, &o]() {
+		return this->sharedOpening.find(o.id) == this->sharedOpening.end();
+	});
+
+	// See if the item is already open and nothing has changed since
+	auto itShared = this->sharedObjects.find(o.id);
+	if (
+		revision
+		&& (itShared != this->sharedObjects.end())
+		&& (itShared->second.revision == revision)
+	) {
+		auto& so = itShared->second;
+		auto tileset = so.tileset.lock();
+		if (tileset) {
+			std::cout << "[project] Reusing open tileset " << o.id << "\n";
+			auto i = std::make_unique<GOI_Shared<gamegraphics::Tileset>>();
+			i->type = GameObjectInstance::Type::Tileset;
+			i->lock = so.lock;
+			i->val_s = tileset;
+			return i;
+		}
+		auto pal = so.palette.lock();
+		if (pal) {
+			std::cout << "[project] Reusing open palette " << o.id << "\n";
+			auto i = std::make_unique<GOI_Shared<const gamegraphics::Palette>>();
+			i->type = GameObjectInstance::Type::Palette;
+			i->val_s = pal;
+			return i;
+		}
+	}
+
+	// Open it without holding the lock, so other items can be opened in the
+	// meantime, but mark it so nobody else tries to open it at the same time.
+	this->sharedOpening.insert(o.id);
+	lock.unlock();
+	std::unique_ptr<GameObjectInstance> inst;
+	try {
+		// We have to give each item a different set of SuppData elements,
+		// because they can't be shared.  Otherwise if two items both need a
+		// palette, the first one will std::move() the stream out, and the second
+		// one will get an apparently valid SuppData item but with a null pointer
+		// left in it, which is not allowed.
+		SuppData suppData;
+		auto content = this->openFile(win, o, true);
+		this->openSuppsByObj(win, &suppData, o);
+		inst = openObjectGeneric(win, o, std::move(content), suppData, nullptr,
+			this);
+
+		if (
+			inst
+			&& (inst->type == GameObjectInstance::Type::Image)
+			&& (o.editor.compare("palette") == 0)
+		) {
+			// Only the palette is shared, so the image can be closed again
+			auto img = inst->get_unique<gamegraphics::Image>();
+			auto i = std::make_unique<GOI_Shared<const gamegraphics::Palette>>();
+			i->type = GameObjectInstance::Type::Palette;
+			if (img) i->val_s = img->palette();
+			inst = std::move(i);
+		} else if (inst && (inst->type == GameObjectInstance::Type::Tileset)) {
+			inst->lock = std::make_shared<std::mutex>();
+		}
+	} catch (...) {
+		lock.lock();
+		this->sharedOpening.erase(o.id);
+		this->cvShared.notify_all();
+		throw;
+	}
+	lock.lock();
+	this->sharedOpening.erase(o.id);
+	if (inst && revision) {
+		// Remember the instance for next time, unless the user cancelled or
+		// there's no telling whether it will still be up to date
+		SharedObject so;
+		so.revision = revision;
+		switch (inst->type) {
+			case GameObjectInstance::Type::Tileset:
+				so.tileset = inst->get_shared<gamegraphics::Tileset>();
+				so.lock = inst->lock;
+				if (!so.tileset.expired()) this->sharedObjects[o.id] = so;
+				break;
+			case GameObjectInstance::Type::Palette:
+				so.palette = inst->get_shared<const gamegraphics::Palette>();
+				if (!so.palette.expired()) this->sharedObjects[o.id] = so;
+				break;
+			default:
+				break;
+		}
+	}
+	this->cvShared.notify_all();
+	return inst;
+}
+
 std::shared_ptr<Archive> Project::getArchive(Gtk::Window* win,
 	const itemid_t& idArchive)
 {
+	std::unique_lock<std::mutex> lock(this->mtxArchives);
+
+	// If another thread is opening this archive, wait for it to finish
+	this->cvArchives.wait(lock, [this, &idArchive]() {
+		return this->archivesOpening.find(idArchive) == this->archivesOpening.end();
+	});
+
 	// See if idArchive is open
 	auto itArch = this->archives.find(idArchive);
 	if (itArch != this->archives.end()) return itArch->second;
@@ -398,17 +582,44 @@ std::shared_ptr<Archive> Project::getArchive(Gtk::Window* win,
 		));
 	}
 
-	auto content = this->openFile(win, *o, true);
+	// Open it without holding the lock, so other archives can be used in the
+	// meantime, but mark it so nobody else tries to open it at the same time.
+	this->archivesOpening.insert(idArchive);
+	lock.unlock();
+	std::shared_ptr<Archive> arch;
+	try {
+		arch = this->openArchive(win, *o);
+	} catch (...) {
+		lock.lock();
+		this->archivesOpening.erase(idArchive);
+		this->cvArchives.notify_all();
+		throw;
+	}
+	lock.lock();
+	this->archivesOpening.erase(idArchive);
+	if (arch && (o->format.compare(ARCHTYPE_MINOR_FIXED) != 0)) {
+		// Cache for future access
+		this->archives[idArchive] = arch;
+	}
+	this->cvArchives.notify_all();
+	return arch; // may be nullptr
+}
+
+std::shared_ptr<Archive> Project::openArchive(Gtk::Window* win,
+	const GameObject& o)
+{
+	const itemid_t& idArchive = o.id;
+	auto content = this->openFile(win, o, true);
 	assert(content);
 	SuppData suppData;
-	this->openSuppsByObj(win, &suppData, *o);
+	this->openSuppsByObj(win, &suppData, o);
 
 	// Now the archive file is open, so create an Archive object around it
 
 	std::shared_ptr<Archive> arch;
 
 	// No need to check if idArchive is valid, as openObject() just did that
-	if (o->format.compare(ARCHTYPE_MINOR_FIXED) == 0) {
+	if (o.format.compare(ARCHTYPE_MINOR_FIXED) == 0) {
 		// This is a fixed archive, with its files described in the XML
 		std::vector<FixedArchiveFile> items;
 		for (auto& i : this->game->objects) {
@@ -426,12 +637,8 @@ std::shared_ptr<Archive> Project::getArchive(Gtk::Window* win,
 	} else {
 		// Normal archive file
 		DepData depData;
-		arch = ::openObject<ArchiveType>(win, *o, std::move(content), suppData,
+		arch = ::openObject<ArchiveType>(win, o, std::move(content), suppData,
 			&depData, this);
-		if (arch) {
-			// Cache for future access
-			this->archives[idArchive] = arch;
-		}
 	}
 
 	return arch; // may be nullptr
@@ -445,6 +652,11 @@ std::unique_ptr<stream::inout> Project::openFileFromArchive(Gtk::Window* win,
 	// not be in the right format) we'll get null here, so just return silently.
 	if (!arch) return nullptr;
 
+	// Reading the archive's file list or the file itself uses the archive's
+	// stream, so it can't happen while another thread is using the same archive
+	auto mtxArch = this->getArchiveLock(idArchive);
+	std::unique_lock<std::mutex> lockArch(*mtxArch);
+
 	// Now we have the archive containing our file, so find and open it
 	Archive::FileHandle f;
 	gamearchive::findFile(&arch, &f, filename);
@@ -459,8 +671,120 @@ std::unique_ptr<stream::inout> Project::openFileFromArchive(Gtk::Window* win,
 		));
 	}
 
+	if (useFilters && !f->filter.empty()) {
+		// Use the decoded copy in the cache if there is one.  This is keyed on
+		// the file in the data folder, as that's what changes on disk when
+		// anything in the archive does.
+		auto o = this->game->findObjectById(idArchive);
+		auto dataFile = o ? this->findDataFile(*o) : nullptr;
+		if (dataFile && !dataFile->filename.empty()) {
+			auto fn = Glib::build_filename(this->getDataPath(), dataFile->filename);
+			FilterCache::Key key;
+			key.source = Glib::ustring::compose("%1:%2:%3", dataFile->filename,
+				idArchive, filename);
+			auto fat = dynamic_cast<const FATArchive::FATEntry *>(f.get());
+			key.offset = fat ? fat->iOffset : 0;
+			key.size = f->storedSize;
+			// Changes to the archive that haven't been saved yet aren't in the
+			// file on disk, so its modification time can't tell the cached copy
+			// is out of date.  Skip the cache until they are saved.
+			key.mtime = this->isDataFileChanged(fn) ? 0 : getModTime(fn);
+			key.filter = f->filter;
+			lockArch.unlock();
+			return this->filterCache.open(key, [arch, f, mtxArch]() {
+				std::lock_guard<std::mutex> lockArch(*mtxArch);
+				auto file = arch->open(f, true);
+				assert(file);
+				std::unique_ptr<stream::inout> locked =
+					std::make_unique<LockedStream>(std::move(file), mtxArch);
+				return locked;
+			});
+		}
+	}
+
 	// Open the file
 	auto file = arch->open(f, useFilters);
 	assert(file);
+	return std::make_unique<LockedStream>(std::move(file), mtxArch);
+}
+
+void Project::acceptFormat(const itemid_t& id)
+{
+	std::lock_guard<std::mutex> lock(this->mtxArchives);
+	this->formatAccepted.insert(id);
+	return;
+}
+
+bool Project::isFormatAccepted(const itemid_t& id)
+{
+	std::lock_guard<std::mutex> lock(this->mtxArchives);
+	return this->formatAccepted.find(id) != this->formatAccepted.end();
+}
+
+uint64_t Project::getRevision(const GameObject& o)
+{
+	// Collect the item and its supplementary items, then find the file in the
+	// data folder holding each one.
+	std::vector<const GameObject *> items;
+	items.push_back(&o);
+	for (auto& s : o.supp) {
+		auto so = this->game->findObjectById(s.second);
+		if (so) items.push_back(so);
+	}
+
+	uint64_t revision = 0;
+	for (auto i : items) {
+		auto file = this->findDataFile(*i);
+		// A missing file will be reported by openFile()
+		if (!file || file->filename.empty()) continue;
+
+		auto fn = Glib::build_filename(this->getDataPath(), file->filename);
+		// Unsaved changes don't show up in the modification time, so there's no
+		// telling which version an instance opened earlier has
+		if (this->isDataFileChanged(fn)) return 0;
+		uint64_t t = getModTime(fn);
+		if (t > revision) revision = t;
+	}
+	return revision;
+}
+
+const GameObject *Project::findDataFile(const GameObject& o)
+{
+	const GameObject *file = &o;
+	while (file && !file->idParent.empty()) {
+		file = this->game->findObjectById(file->idParent);
+	}
 	return file;
 }
+
+std::shared_ptr<std::mutex> Project::getArchiveLock(const itemid_t& idArchive)
+{
+	std::lock_guard<std::mutex> lock(this->mtxArchives);
+	auto& mtx = this->archiveLocks[idArchive];
+	if (!mtx) mtx = std::make_shared<std::mutex>();
+	return mtx;
+}
+
+std::shared_ptr<MappedFile> Project::getDataFile(const std::string& filename)
+{
+	std::lock_guard<std::mutex> lock(this->mtxArchives);
+	auto& weak = this->dataFiles[filename];
+	auto file = weak.lock();
+	if (!file) {
+		file = std::make_shared<MappedFile>(filename,
+			MappedFile::saveToFile(filename));
+		weak = file;
+	}
+	return file;
+}
+
+bool Project::isDataFileChanged(const std::string& filename)
+{
+	std::shared_ptr<MappedFile> file;
+	{
+		std::lock_guard<std::mutex> lock(this->mtxArchives);
+		auto it = this->dataFiles.find(filename);
+		if (it != this->dataFiles.end()) file = it->second.lock();
+	}
+	return file && file->isChanged();
+}
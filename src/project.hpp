@@ -21,9 +21,17 @@
 #ifndef _PROJECT_HPP_
 #define _PROJECT_HPP_
 
+#include <condition_variable>
+#include <cstdint>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <camoto/gamegraphics/palette.hpp>
+#include <camoto/gamegraphics/tileset.hpp>
 #include "exceptions.hpp"
 #include "gamelist.hpp"
+#include "util-filtercache.hpp"
+#include "util-mmap.hpp"
 
 /// Name of subfolder inside project dir storing the game files to be edited
 #define PROJECT_GAME_DATA  "data"
@@ -31,6 +39,10 @@
 /// Name of the .ini file storing project settings, inside the project dir
 #define PROJECT_FILENAME   "project.camoto"
 
+/// Name of subfolder inside project dir storing decoded copies of filtered
+/// items, which can be deleted at any time
+#define PROJECT_CACHE      "cache"
+
 /// Value to use in the config file version.  Projects with a newer version
 /// than this will not be opened.
 #define CONFIG_FILE_VERSION 1
@@ -120,6 +132,8 @@ class Project
 		 *
 		 * @param useFilters
 		 *   Set to true to apply any filters to the stream before returning.
+		 *   Decoded items are kept in the project's cache folder, and opened
+		 *   from there next time unless the file holding them has changed.
 		 *
 		 * @return A stream to the item's data files.
 		 *
@@ -143,20 +157,103 @@ class Project
 		void openSuppsByFilename(Gtk::Window* win, camoto::SuppData *suppOut,
 			const camoto::SuppFilenames& suppItem);
 
+		/// Open every dependency of an item.
+		/**
+		 * The dependencies don't rely on each other, so they are all opened at
+		 * the same time, each on its own thread.  They are opened with
+		 * openShared(), so any already in use by another item are reused.
+		 *
+		 * @param win
+		 *   Parent window for any prompts.  The worker threads can't show
+		 *   dialogs, so if this is not null, any dependency that fails its
+		 *   format check is opened again on the calling thread so the user can
+		 *   be asked about it.  If it is null, EFormatMismatch is thrown.
+		 *
+		 * @param o
+		 *   Item whose dependencies are to be opened.
+		 *
+		 * @param suppData
+		 *   Supplementary data of the item.  Not currently used.
+		 *
+		 * @param depData
+		 *   On return, the opened dependencies.
+		 *
+		 * @throw EFailure if a dependency could not be opened.  If more than
+		 *   one failed, the first one listed is reported.
+		 */
 		void openDeps(Gtk::Window* win, const GameObject& o,
 			camoto::SuppData& suppData, DepData* depData);
 
+		/// Open an item used by other items, such as a map's tileset.
+		/**
+		 * Tilesets and palettes are remembered for as long as something is still
+		 * using them, so opening ten maps that share a tileset only opens the
+		 * tileset once.  If the files holding the item have changed on disk
+		 * since then, it is opened again and the old instance is left with
+		 * whoever is still using it.  Nothing is shared while those files have
+		 * changes that haven't been saved yet, as there's no telling whether an
+		 * earlier instance has seen them.
+		 *
+		 * This is safe to call from any thread.  If two threads ask for the same
+		 * item at once, the second waits for the first to open it.
+		 *
+		 * @param win
+		 *   Parent window for any prompts, as for openFile().
+		 *
+		 * @param o
+		 *   Item to open.
+		 *
+		 * @return The item.  Tilesets are returned as a GOI_Shared<Tileset> with
+		 *   its lock set, and palettes as a GOI_Shared<const Palette>.  Anything
+		 *   else is opened as per openObjectGeneric() and not shared.
+		 *
+		 * @throw EFailure if the item could not be opened.
+		 */
+		std::unique_ptr<GameObjectInstance> openShared(Gtk::Window* win,
+			const GameObject& o);
+
+		/// Get an archive, opening it if it isn't open already.
+		/**
+		 * This is safe to call from any thread.  If two threads ask for the same
+		 * archive at once, the second waits for the first to open it.
+		 *
+		 * @param win
+		 *   Parent window for any prompts, as for openFile().
+		 *
+		 * @param idArchive
+		 *   ID of the archive.
+		 *
+		 * @return The archive, or nullptr if the user cancelled.
+		 */
 		std::shared_ptr<camoto::gamearchive::Archive> getArchive(Gtk::Window* win,
 			const itemid_t& idArchive);
 
 		/// Open a file by filename from within an archive identified by ID.
 		/**
+		 * The file is wrapped in a LockedStream, so it can be used on one
+		 * thread while other files from the same archive are used on others.
+		 * Filtered files are opened through the cache as for openFile().
+		 *
 		 * @return Stream of opened file, or nullptr if the operation was cancelled
 		 *   by the user (in which case no messages need be displayed.)
 		 */
 		std::unique_ptr<camoto::stream::inout> openFileFromArchive(Gtk::Window* win,
 			const itemid_t& idArchive, const std::string& filename, bool useFilters);
 
+		/// Open an item even if it doesn't look like it's in the right format.
+		/**
+		 * Once called, openObject() skips its format check for this item for
+		 * the rest of the session.  This is used after the user has answered
+		 * the question carried by EFormatMismatch.
+		 *
+		 * @param id
+		 *   ID of the item to accept.
+		 */
+		void acceptFormat(const itemid_t& id);
+
+		/// Has acceptFormat() been called for this item?
+		bool isFormatAccepted(const itemid_t& id);
+
 		// Saved config items
 		std::string cfg_game;      ///< ID of the game being edited
 		std::string cfg_orig_game; ///< Path to the original game files
@@ -171,11 +268,130 @@ class Project
 		std::unique_ptr<Game> game; ///< Game instance for this project
 
 	protected:
+		/// Open an archive that isn't in the list of open archives yet.
+		/**
+		 * @param win
+		 *   Parent window for any prompts, as for openFile().
+		 *
+		 * @param o
+		 *   GameObject of the archive to open.
+		 *
+		 * @return The archive, or nullptr if the user cancelled.
+		 */
+		std::shared_ptr<camoto::gamearchive::Archive> openArchive(
+			Gtk::Window* win, const GameObject& o);
+
 		std::string path;
 
+		/// Decoded copies of filtered items, so they don't have to be decoded
+		/// every time they are opened.
+		FilterCache filterCache;
+
+		/// Find the file in the data folder holding an item.
+		/**
+		 * @param o
+		 *   Item to look for.
+		 *
+		 * @return The item itself if it is a file in the data folder, otherwise
+		 *   the outermost archive containing it.  Null if one of the archives
+		 *   is missing from the game description XML.
+		 */
+		const GameObject *findDataFile(const GameObject& o);
+
+		/// Get the lock shared by every file opened from an archive.
+		/**
+		 * @param idArchive
+		 *   ID of the archive.
+		 *
+		 * @return Lock for the archive, created the first time it's asked for.
+		 */
+		std::shared_ptr<std::mutex> getArchiveLock(const itemid_t& idArchive);
+
+		/// Get the mapping of a file in the data folder.
+		/**
+		 * Everything that opens the same file shares one MappedFile, so they
+		 * all see each other's changes, and saving from one can't replace the
+		 * file with another's out of date copy.
+		 *
+		 * @param filename
+		 *   Full path of the file.
+		 *
+		 * @return The file, mapped the first time it's asked for.  It is saved
+		 *   back to disk when any stream over it is flushed.
+		 *
+		 * @throw stream::open_error if the file could not be mapped.
+		 */
+		std::shared_ptr<MappedFile> getDataFile(const std::string& filename);
+
+		/// Have changes been made to a file in the data folder but not saved?
+		/**
+		 * @param filename
+		 *   Full path of the file.
+		 *
+		 * @return true if the file is open and has changes that haven't been
+		 *   flushed to disk yet.
+		 */
+		bool isDataFileChanged(const std::string& filename);
+
 		/// List of currently open archives
 		std::map<itemid_t, std::shared_ptr<camoto::gamearchive::Archive>> archives;
 
+		/// Archives being opened by one thread, that other threads must wait for.
+		std::set<itemid_t> archivesOpening;
+
+		/// Lock for each archive, held while reading or writing any file inside
+		/// it.  See LockedStream.
+		std::map<itemid_t, std::shared_ptr<std::mutex>> archiveLocks;
+
+		/// Items to open despite failing the format check, see acceptFormat().
+		std::set<itemid_t> formatAccepted;
+
+		/// Files in the data folder that are open, see getDataFile().
+		std::map<std::string, std::weak_ptr<MappedFile>> dataFiles;
+
+		/// Protects archives, archivesOpening, archiveLocks, formatAccepted and
+		/// dataFiles.
+		/// Only held briefly, never while a file is being read.
+		std::mutex mtxArchives;
+
+		/// Signalled when an archive has finished opening.
+		std::condition_variable cvArchives;
+
+		/// Work out which version of an item is on disk.
+		/**
+		 * @param o
+		 *   Item to check.
+		 *
+		 * @return The latest modification time of the files in the data folder
+		 *   holding the item and its supplementary items, in microseconds.  This
+		 *   is 0 if none of them could be found, or if any of them has changes
+		 *   that haven't been saved yet, in which case the item must not be
+		 *   shared.
+		 */
+		uint64_t getRevision(const GameObject& o);
+
+		/// An instance handed out by openShared().
+		struct SharedObject {
+			uint64_t revision; ///< getRevision() when the item was opened
+			std::weak_ptr<camoto::gamegraphics::Tileset> tileset;
+			std::weak_ptr<const camoto::gamegraphics::Palette> palette;
+			std::shared_ptr<std::mutex> lock; ///< Held while using tileset
+		};
+
+		/// Instances opened by openShared(), some of which may since have been
+		/// released by everything that was using them.
+		std::map<itemid_t, SharedObject> sharedObjects;
+
+		/// Items being opened by openShared() that other threads must wait for.
+		std::set<itemid_t> sharedOpening;
+
+		/// Protects sharedObjects and sharedOpening.  Never held while an item is
+		/// being opened.
+		std::mutex mtxShared;
+
+		/// Signalled when openShared() has finished opening an item.
+		std::condition_variable cvShared;
+
 		unsigned int cfg_projrevision;
 };
 
@@ -18,11 +18,15 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <cassert>
+#include <iostream>
 #include <gtkmm.h>
 #include <glibmm/i18n.h>
 #include "main.hpp"
+#include "exceptions.hpp"
 #include "util-gfx.hpp"
+#include "util-png.hpp"
 #include "tab-graphics.hpp"
 
 using namespace camoto::gamegraphics;
@@ -35,13 +39,18 @@ Tab_Graphics::ModelTilesetColumns::ModelTilesetColumns()
 	this->add(this->icon);
 	this->add(this->tileset);
 	this->add(this->index);
+	this->add(this->placeholder);
 }
 
 Tab_Graphics::Tab_Graphics(BaseObjectType *obj,
 	const Glib::RefPtr<Gtk::Builder>& refBuilder)
 	:	Gtk::Box(obj),
 		refBuilder(refBuilder),
-		agItems(Gio::SimpleActionGroup::create())
+		agItems(Gio::SimpleActionGroup::create()),
+		thumbsScheduled(false),
+		mtxTileset(std::make_shared<std::mutex>()),
+		atlasBuilder(1),
+		thumbnailer(1, true)
 {
 	this->agItems->add_action("tileset_add", sigc::mem_fun(this, &Tab_Graphics::on_tileset_add));
 	this->agItems->add_action("tileset_remove", sigc::mem_fun(this, &Tab_Graphics::on_tileset_remove));
@@ -52,6 +61,9 @@ Tab_Graphics::Tab_Graphics(BaseObjectType *obj,
 
 	this->agItems->add_action("undo", sigc::mem_fun(this, &Tab_Graphics::on_undo));
 	this->agItems->add_action("redo", sigc::mem_fun(this, &Tab_Graphics::on_redo));
+	this->agItems->add_action("zoom_in", sigc::mem_fun(this, &Tab_Graphics::on_zoom_in));
+	this->agItems->add_action("zoom_normal", sigc::mem_fun(this, &Tab_Graphics::on_zoom_normal));
+	this->agItems->add_action("zoom_out", sigc::mem_fun(this, &Tab_Graphics::on_zoom_out));
 	this->agItems->add_action("palette_import", sigc::mem_fun(this, &Tab_Graphics::on_palette_import));
 	this->agItems->add_action("palette_export", sigc::mem_fun(this, &Tab_Graphics::on_palette_export));
 	this->agItems->add_action("image_import", sigc::mem_fun(this, &Tab_Graphics::on_image_import));
@@ -65,21 +77,43 @@ Tab_Graphics::Tab_Graphics(BaseObjectType *obj,
 	this->ctItems = Gtk::TreeStore::create(this->cols);
 	this->ctTileset->set_model(this->ctItems);
 
+	this->refBuilder->get_widget_derived("canvasTileset", this->ctGrid);
+
 	auto tvsel = this->ctTileset->get_selection();
 	tvsel->signal_changed().connect(sigc::mem_fun(this, &Tab_Graphics::on_item_selected));
 
 	this->ctTileset->signal_row_activated().connect(sigc::mem_fun(this, &Tab_Graphics::on_row_activated));
+	this->ctTileset->signal_test_expand_row().connect(sigc::mem_fun(this, &Tab_Graphics::on_test_expand_row), false);
+
+	// Thumbnails are only made for rows on screen, so look again whenever
+	// different rows come into view.
+	this->ctTileset->signal_row_expanded().connect(
+		[this](const Gtk::TreeModel::iterator&, const Gtk::TreeModel::Path&) {
+			this->scheduleThumbnails();
+		});
+	this->ctTileset->get_vadjustment()->signal_value_changed().connect(
+		sigc::mem_fun(this, &Tab_Graphics::scheduleThumbnails));
+	this->ctTileset->get_vadjustment()->signal_changed().connect(
+		sigc::mem_fun(this, &Tab_Graphics::scheduleThumbnails));
+	this->dispatchThumbs.connect(
+		sigc::mem_fun(this, &Tab_Graphics::on_thumbnails_ready));
+	this->dispatchAtlases.connect(
+		sigc::mem_fun(this, &Tab_Graphics::on_atlases_ready));
 }
 
-void Tab_Graphics::content(std::shared_ptr<Tileset> obj)
+void Tab_Graphics::content(std::shared_ptr<Tileset> obj,
+	std::shared_ptr<std::mutex> lock)
 {
 	assert(obj);
 	this->obj_tileset = obj;
+	if (lock) this->mtxTileset = lock;
 
 	auto studio = static_cast<Studio *>(this->get_toplevel());
 
-	// Populate tree view with items
-	auto row = *(this->ctItems->append());
+	// Populate tree view with items.  Only the top level is listed now, and
+	// each folder is read when it is first expanded.
+	auto itRoot = this->ctItems->append();
+	auto row = *itRoot;
 	row[this->cols.name] = "0";
 	try {
 		row[this->cols.icon] = studio->getIcon(Studio::Icon::Folder);
@@ -88,9 +122,9 @@ void Tab_Graphics::content(std::shared_ptr<Tileset> obj)
 	}
 	row[this->cols.tileset] = obj;
 	row[this->cols.index] = -1;
+	this->appendPlaceholder(row, obj, -1);
 
-	this->appendChildren("0", obj, row);
-	this->ctTileset->expand_all();
+	this->ctTileset->expand_row(this->ctItems->get_path(itRoot), false);
 	return;
 }
 
@@ -149,13 +183,12 @@ void Tab_Graphics::appendChildren(const Glib::ustring& prefix,
 			row[this->cols.tileset] = tileset;
 			row[this->cols.index] = index;
 		} else if (i->fAttr & Tileset::File::Attribute::Folder) {
-			// This is a folder
+			// This is a folder, which won't be opened until it is expanded
 			row[this->cols.name] = name;
 			row[this->cols.icon] = studio->getIcon(Studio::Icon::Folder);
-			auto tsChild = tileset->openTileset(i);
-			row[this->cols.tileset] = tsChild;
+			row[this->cols.tileset] = std::shared_ptr<Tileset>();
 			row[this->cols.index] = -1;
-			this->appendChildren(name, tsChild, row);
+			this->appendPlaceholder(row, tileset, index);
 		} else {
 			// This is a tile
 			auto nextPrefix = Glib::ustring::compose("%1.%2", prefix, index);
@@ -169,19 +202,338 @@ void Tab_Graphics::appendChildren(const Glib::ustring& prefix,
 	return;
 }
 
+void Tab_Graphics::appendPlaceholder(Gtk::TreeModel::Row& row,
+	std::shared_ptr<Tileset> tileset, int index)
+{
+	auto child = *(this->ctItems->append(row->children()));
+	child[this->cols.tileset] = tileset;
+	child[this->cols.index] = index;
+	child[this->cols.placeholder] = true;
+	return;
+}
+
+bool Tab_Graphics::on_test_expand_row(const Gtk::TreeModel::iterator& iter,
+	const Gtk::TreeModel::Path& path)
+{
+	auto row = *iter;
+	auto itChild = row->children().begin();
+	if (itChild == row->children().end()) return false;
+	if (!(*itChild)[this->cols.placeholder]) return false; // already populated
+
+	std::shared_ptr<Tileset> tileset = (*itChild)[this->cols.tileset];
+	int index = (*itChild)[this->cols.index];
+	this->ctItems->erase(itChild);
+
+	std::lock_guard<std::mutex> lock(*this->mtxTileset);
+	try {
+		if (index >= 0) {
+			// Open the sub-tileset now that its contents are needed
+			tileset = tileset->openTileset(tileset->files()[index]);
+			row[this->cols.tileset] = tileset;
+		}
+		Glib::ustring name = row[this->cols.name];
+		this->appendChildren(name, tileset, row);
+	} catch (const std::exception& e) {
+		std::cerr << "[tab-graphics] Unable to open tileset folder: " << e.what()
+			<< std::endl;
+	}
+
+	// Allow the row to expand
+	return false;
+}
+
+void Tab_Graphics::scheduleThumbnails()
+{
+	if (this->thumbsScheduled) return;
+	this->thumbsScheduled = true;
+	// Default idle priority runs after GTK has laid out the tree, so the
+	// visible range is up to date by then.
+	Glib::signal_idle().connect(
+		sigc::mem_fun(this, &Tab_Graphics::on_queue_thumbnails));
+	return;
+}
+
+bool Tab_Graphics::on_queue_thumbnails()
+{
+	this->thumbsScheduled = false;
+
+	Gtk::TreeModel::Path start, end;
+	if (!this->ctTileset->get_visible_range(start, end)) return false;
+
+	// Forget about rows that were queued but may no longer be on screen.  Any
+	// still visible are queued again below.
+	this->thumbnailer.cancel();
+	this->thumbRows.clear();
+
+	auto iter = this->ctItems->get_iter(start);
+	for (unsigned int n = 0; iter && (n < GRAPHICS_THUMB_MAX_ROWS); n++) {
+		this->queueThumbnail(iter);
+		auto path = this->ctItems->get_path(iter);
+		if (path == end) break;
+
+		// Step to the next row on screen, which is the first child if this row
+		// is expanded, otherwise the next sibling of this row or of the nearest
+		// parent that has one.
+		if (!iter->children().empty() && this->ctTileset->row_expanded(path)) {
+			iter = iter->children().begin();
+			continue;
+		}
+		for (;;) {
+			auto next = iter;
+			++next;
+			if (next) {
+				iter = next;
+				break;
+			}
+			iter = iter->parent();
+			if (!iter) break;
+		}
+	}
+	return false;
+}
+
+void Tab_Graphics::queueThumbnail(const Gtk::TreeModel::iterator& iter)
+{
+	auto row = *iter;
+	if (row[this->cols.placeholder]) return;
+	int index = row[this->cols.index];
+	if (index < 0) return; // folder
+	std::shared_ptr<Tileset> tileset = row[this->cols.tileset];
+	if (!tileset) return;
+	if (tileset->files()[index]->fAttr & Tileset::File::Attribute::Vacant) return;
+
+	ThumbKey key(tileset.get(), index);
+	if (this->thumbDone.count(key) || this->thumbRows.count(key)) return;
+	this->thumbRows.emplace(key,
+		Gtk::TreeRowReference(this->ctItems, this->ctItems->get_path(iter)));
+	this->thumbnailer.add([this, tileset, index]() {
+		this->makeThumbnail(tileset, index);
+	});
+	return;
+}
+
+void Tab_Graphics::makeThumbnail(std::shared_ptr<Tileset> tileset, int index)
+{
+	// Only the reading is done with the tileset locked.  This thread runs at a
+	// low priority and the main thread waits on the same lock, so converting
+	// and shrinking the tile are left until it has been released.
+	Point dims;
+	Pixels pixels, mask;
+	std::shared_ptr<const Palette> pal;
+	{
+		std::lock_guard<std::mutex> lock(*this->mtxTileset);
+		auto img = tileset->openImage(tileset->files()[index]);
+		dims = img->dimensions();
+		if ((dims.x <= 0) || (dims.y <= 0)) return;
+		pixels = img->convert();
+		mask = img->convert_mask();
+		pal = getImagePalette(img.get(), tileset.get());
+	}
+	std::vector<uint32_t> full((unsigned long)dims.x * dims.y);
+	auto lut = getPaletteLUT(pal);
+	expandIndexedPixels(&pixels[0], &mask[0], dims, *lut,
+		(unsigned char *)full.data(), dims.x * 4);
+
+	// Shrink to fit, keeping the shape, but never enlarge.  Nearest neighbour
+	// keeps the pixels sharp, which suits small game graphics.
+	long largest = std::max((long)dims.x, (long)dims.y);
+	long width = dims.x, height = dims.y;
+	if (largest > GRAPHICS_THUMB_SIZE) {
+		width = std::max(1L, (long)dims.x * GRAPHICS_THUMB_SIZE / largest);
+		height = std::max(1L, (long)dims.y * GRAPHICS_THUMB_SIZE / largest);
+	}
+
+	Thumbnail thumb;
+	thumb.key = ThumbKey(tileset.get(), index);
+	thumb.dims = {width, height};
+	thumb.pixels.resize(width * height);
+	for (long y = 0; y < height; y++) {
+		const uint32_t *in = &full[(y * dims.y / height) * dims.x];
+		for (long x = 0; x < width; x++) {
+			thumb.pixels[y * width + x] = in[x * dims.x / width];
+		}
+	}
+
+	// Only signal the main thread for the first thumbnail in a batch, as it
+	// will collect any others that finish before it gets around to it.
+	bool first;
+	{
+		std::lock_guard<std::mutex> lock(this->mtxThumbs);
+		first = this->thumbs.empty();
+		this->thumbs.push_back(std::move(thumb));
+	}
+	if (first) this->dispatchThumbs.emit();
+	return;
+}
+
+void Tab_Graphics::on_thumbnails_ready()
+{
+	std::vector<Thumbnail> ready;
+	{
+		std::lock_guard<std::mutex> lock(this->mtxThumbs);
+		std::swap(ready, this->thumbs);
+	}
+
+	for (auto& t : ready) {
+		auto itRow = this->thumbRows.find(t.key);
+		if (itRow == this->thumbRows.end()) continue; // no longer wanted
+		auto rowRef = itRow->second;
+		this->thumbRows.erase(itRow);
+		if (!rowRef.is_valid()) continue; // row has gone
+
+		auto surface = Cairo::ImageSurface::create(Cairo::FORMAT_ARGB32,
+			t.dims.x, t.dims.y);
+		surface->flush();
+		auto data = surface->get_data();
+		int stride = surface->get_stride();
+		for (long y = 0; y < (long)t.dims.y; y++) {
+			std::copy(&t.pixels[y * t.dims.x], &t.pixels[(y + 1) * t.dims.x],
+				(uint32_t *)&data[y * stride]);
+		}
+		surface->mark_dirty();
+
+		auto row = *this->ctItems->get_iter(rowRef.get_path());
+		row[this->cols.icon] = Gdk::Pixbuf::create(surface, 0, 0, t.dims.x,
+			t.dims.y);
+		this->thumbDone.insert(t.key);
+	}
+	return;
+}
+
 void Tab_Graphics::setImage(std::unique_ptr<Image> img)
 {
 	assert(img);
 
 	// Create a Cairo Surface from the libgamegraphics image
-	auto cimg = createCairoSurface(img.get(), this->obj_tileset.get());
+	auto tileset = this->imgTileset ? this->imgTileset : this->obj_tileset;
+	auto cimg = createCairoSurface(img.get(), tileset.get());
+	this->setImage(std::move(img), cimg);
+	return;
+}
+
+void Tab_Graphics::setImage(std::unique_ptr<Image> img,
+	const Cairo::RefPtr<Cairo::Surface>& surface)
+{
+	assert(img);
 
 	auto ctImage = Glib::RefPtr<Gtk::Image>::cast_dynamic(
 		this->refBuilder->get_object("ctImage"));
 	assert(ctImage);
-	ctImage->set(cimg);
+	ctImage->set(surface);
+	ctImage->show();
+
+	auto scrolledTileset = Glib::RefPtr<Gtk::ScrolledWindow>::cast_dynamic(
+		this->refBuilder->get_object("scrolledTileset"));
+	assert(scrolledTileset);
+	scrolledTileset->hide();
 
 	this->obj_image = std::move(img);
+	this->gridTileset.reset();
+	return;
+}
+
+void Tab_Graphics::setTileset(std::shared_ptr<Tileset> tileset)
+{
+	// The grid draws straight from the atlas, so no surfaces are needed for the
+	// individual tiles.  If the atlas isn't ready the grid is left empty, and
+	// on_atlases_ready() fills it in.
+	this->ctGrid->content(tileset, this->requestAtlas(tileset));
+
+	auto ctImage = Glib::RefPtr<Gtk::Image>::cast_dynamic(
+		this->refBuilder->get_object("ctImage"));
+	assert(ctImage);
+	ctImage->hide();
+
+	auto scrolledTileset = Glib::RefPtr<Gtk::ScrolledWindow>::cast_dynamic(
+		this->refBuilder->get_object("scrolledTileset"));
+	assert(scrolledTileset);
+	scrolledTileset->show();
+
+	this->gridTileset = tileset;
+	return;
+}
+
+const TileAtlas *Tab_Graphics::requestAtlas(
+	const std::shared_ptr<Tileset>& tileset)
+{
+	auto it = this->atlases.find(tileset);
+	if (it != this->atlases.end()) return &it->second;
+
+	if (this->atlasesPending.insert(tileset).second) {
+		this->atlasBuilder.add([this, tileset]() {
+			this->buildAtlas(tileset);
+		});
+	}
+	return nullptr;
+}
+
+void Tab_Graphics::buildAtlas(std::shared_ptr<Tileset> tileset)
+{
+	ReadyAtlas ready;
+	ready.tileset = tileset;
+	try {
+		ready.atlas.build(*tileset, this->mtxTileset.get());
+	} catch (const std::exception& e) {
+		// Still hand back the empty atlas, so the tileset isn't left pending
+		std::cerr << "[tab-graphics] Unable to build atlas: " << e.what()
+			<< std::endl;
+	}
+
+	// Only signal the main thread for the first atlas in a batch, as it will
+	// collect any others that finish before it gets around to it.
+	bool first;
+	{
+		std::lock_guard<std::mutex> lock(this->mtxAtlases);
+		first = this->atlasesReady.empty();
+		this->atlasesReady.push_back(std::move(ready));
+	}
+	if (first) this->dispatchAtlases.emit();
+	return;
+}
+
+void Tab_Graphics::on_atlases_ready()
+{
+	std::vector<ReadyAtlas> ready;
+	{
+		std::lock_guard<std::mutex> lock(this->mtxAtlases);
+		std::swap(ready, this->atlasesReady);
+	}
+
+	for (auto& r : ready) {
+		this->atlasesPending.erase(r.tileset);
+
+		// Replace any existing atlas in place, so anything pointing to it remains
+		// valid
+		auto& atlas = this->atlases[r.tileset];
+		atlas = std::move(r.atlas);
+		if (this->gridTileset == r.tileset) {
+			this->ctGrid->content(r.tileset, &atlas);
+		}
+	}
+	return;
+}
+
+void Tab_Graphics::refreshTileset(const std::shared_ptr<Tileset>& tileset)
+{
+	// Build the atlas again, even if a build is already under way as it may
+	// have read some of the old tiles.  on_atlases_ready() swaps it in and
+	// redraws the grid.
+	if (this->atlases.count(tileset) || this->atlasesPending.count(tileset)) {
+		this->atlasesPending.insert(tileset);
+		this->atlasBuilder.add([this, tileset]() {
+			this->buildAtlas(tileset);
+		});
+	}
+
+	// Make the thumbnails again the next time they are on screen
+	for (auto it = this->thumbDone.begin(); it != this->thumbDone.end(); ) {
+		if (it->first == tileset.get()) {
+			it = this->thumbDone.erase(it);
+		} else {
+			++it;
+		}
+	}
+	this->scheduleThumbnails();
 	return;
 }
 
@@ -193,13 +545,27 @@ void Tab_Graphics::on_row_activated(const Gtk::TreeModel::Path& path,
 	int index = row[this->cols.index];
 
 	if (index < 0) {
-		// This is a tileset, rather than a single tile
+		// This is a tileset, rather than a single tile.  Folders that haven't
+		// been expanded yet have no tileset until they are opened.
+		if (!tileset) return;
+		this->setTileset(tileset);
 	} else {
-		// This is a single tile
+		// This is a single tile.  Once the tileset's atlas has been built the
+		// tile is displayed from it, but it is still opened so it can be edited.
+		// Until then only this tile is converted, and the rest of the atlas is
+		// built in the background.
 		auto& tiles = tileset->files();
-		this->setImage(
-			tileset->openImage(tiles[index])
-		);
+		auto atlas = this->requestAtlas(tileset);
+		Cairo::RefPtr<Cairo::Surface> surface;
+		if (atlas) surface = atlas->surface(index);
+		std::lock_guard<std::mutex> lock(*this->mtxTileset);
+		auto img = tileset->openImage(tiles[index]);
+		this->imgTileset = tileset;
+		if (surface) {
+			this->setImage(std::move(img), surface);
+		} else {
+			this->setImage(std::move(img));
+		}
 	}
 	return;
 }
@@ -214,6 +580,24 @@ void Tab_Graphics::on_redo()
 	return;
 }
 
+void Tab_Graphics::on_zoom_in()
+{
+	this->ctGrid->setZoom(this->ctGrid->getZoom() + 1);
+	return;
+}
+
+void Tab_Graphics::on_zoom_normal()
+{
+	this->ctGrid->setZoom(0);
+	return;
+}
+
+void Tab_Graphics::on_zoom_out()
+{
+	this->ctGrid->setZoom(this->ctGrid->getZoom() - 1);
+	return;
+}
+
 void Tab_Graphics::on_tileset_add()
 {
 	return;
@@ -226,11 +610,72 @@ void Tab_Graphics::on_tileset_remove()
 
 void Tab_Graphics::on_image_import()
 {
+	if (!this->gridTileset && !this->obj_image) return; // nothing to import into
+
+	Gtk::FileChooserDialog dlg(_("Import image"), Gtk::FILE_CHOOSER_ACTION_OPEN);
+	dlg.set_transient_for(*static_cast<Gtk::Window *>(this->get_toplevel()));
+	dlg.add_button("_Cancel", Gtk::RESPONSE_CANCEL);
+	dlg.add_button("_Open", Gtk::RESPONSE_OK);
+	auto filter = Gtk::FileFilter::create();
+	filter->set_name(_("PNG images"));
+	filter->add_mime_type("image/png");
+	dlg.add_filter(filter);
+	if (dlg.run() != Gtk::RESPONSE_OK) return;
+	dlg.hide();
+
+	auto studio = static_cast<Studio *>(this->get_toplevel());
+	std::lock_guard<std::mutex> lock(*this->mtxTileset);
+	try {
+		if (this->gridTileset) {
+			importTilesetPNG(dlg.get_filename(), *this->gridTileset);
+			this->refreshTileset(this->gridTileset);
+		} else {
+			importImagePNG(dlg.get_filename(), this->obj_image.get(),
+				this->imgTileset.get());
+			if (this->imgTileset) this->refreshTileset(this->imgTileset);
+			auto img = std::move(this->obj_image);
+			this->setImage(std::move(img));
+		}
+	} catch (const EFailure& e) {
+		studio->infobar(e.getMessage());
+	} catch (const std::exception& e) {
+		studio->infobar(Glib::ustring::compose(_("Unable to import image: %1"),
+			e.what()));
+	}
 	return;
 }
 
 void Tab_Graphics::on_image_export()
 {
+	if (!this->gridTileset && !this->obj_image) return; // nothing to export
+
+	Gtk::FileChooserDialog dlg(_("Export image"), Gtk::FILE_CHOOSER_ACTION_SAVE);
+	dlg.set_transient_for(*static_cast<Gtk::Window *>(this->get_toplevel()));
+	dlg.add_button("_Cancel", Gtk::RESPONSE_CANCEL);
+	dlg.add_button("_Save", Gtk::RESPONSE_OK);
+	dlg.set_do_overwrite_confirmation(true);
+	auto filter = Gtk::FileFilter::create();
+	filter->set_name(_("PNG images"));
+	filter->add_mime_type("image/png");
+	dlg.add_filter(filter);
+	if (dlg.run() != Gtk::RESPONSE_OK) return;
+	dlg.hide();
+
+	auto studio = static_cast<Studio *>(this->get_toplevel());
+	std::lock_guard<std::mutex> lock(*this->mtxTileset);
+	try {
+		if (this->gridTileset) {
+			exportTilesetPNG(dlg.get_filename(), *this->gridTileset);
+		} else {
+			exportImagePNG(dlg.get_filename(), *this->obj_image,
+				this->imgTileset.get());
+		}
+	} catch (const EFailure& e) {
+		studio->infobar(e.getMessage());
+	} catch (const std::exception& e) {
+		studio->infobar(Glib::ustring::compose(_("Unable to export image: %1"),
+			e.what()));
+	}
 	return;
 }
 
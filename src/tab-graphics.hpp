@@ -21,9 +21,21 @@
 #ifndef STUDIO_TAB_GRAPHICS_HPP_
 #define STUDIO_TAB_GRAPHICS_HPP_
 
+#include <map>
+#include <mutex>
+#include <set>
 #include <gtkmm.h>
 #include <camoto/gamegraphics/image.hpp>
 #include <camoto/gamegraphics/tileset.hpp>
+#include "ct-tileset-canvas.hpp"
+#include "util-atlas.hpp"
+#include "util-worker.hpp"
+
+/// Largest width or height of the tile thumbnails in the tileset tree.
+#define GRAPHICS_THUMB_SIZE 32
+
+/// Most rows to look at when finding which ones are on screen.
+#define GRAPHICS_THUMB_MAX_ROWS 512
 
 class Tab_Graphics: public Gtk::Box
 {
@@ -32,7 +44,17 @@ class Tab_Graphics: public Gtk::Box
 			const Glib::RefPtr<Gtk::Builder>& refBuilder);
 
 		/// Set a tileset to display in this tab.
-		void content(std::shared_ptr<camoto::gamegraphics::Tileset> obj);
+		/**
+		 * @param obj
+		 *   Tileset to display.
+		 *
+		 * @param lock
+		 *   Lock to hold while reading from the tileset, if it is shared with
+		 *   other tabs (see GameObjectInstance::lock).  If null the tab uses a
+		 *   lock of its own.
+		 */
+		void content(std::shared_ptr<camoto::gamegraphics::Tileset> obj,
+			std::shared_ptr<std::mutex> lock = nullptr);
 
 		/// Set an image to display in this tab.
 		void content(std::unique_ptr<camoto::gamegraphics::Image> obj);
@@ -52,17 +74,145 @@ class Tab_Graphics: public Gtk::Box
 				Gtk::TreeModelColumn<Glib::RefPtr<Gdk::Pixbuf>> icon;
 				Gtk::TreeModelColumn<std::shared_ptr<camoto::gamegraphics::Tileset>> tileset;
 				Gtk::TreeModelColumn<int> index;
+
+				/// true for the dummy child row given to each folder until it is first
+				/// expanded.  The row's tileset and index are then those of the folder
+				/// within its parent, or index is -1 if the tileset is already open.
+				Gtk::TreeModelColumn<bool> placeholder;
 		};
 
+		/// Add a dummy child row, so a folder can be expanded before its contents
+		/// have been read.
+		/**
+		 * @param row
+		 *   Folder row.
+		 *
+		 * @param tileset
+		 *   Tileset the folder is in, or the folder itself if already opened.
+		 *
+		 * @param index
+		 *   Index of the folder within tileset->files(), or -1 if tileset is the
+		 *   folder itself.
+		 */
+		void appendPlaceholder(Gtk::TreeModel::Row& row,
+			std::shared_ptr<camoto::gamegraphics::Tileset> tileset, int index);
+
+		/// Identifies a tile by its tileset and index in the tileset's files().
+		typedef std::pair<const camoto::gamegraphics::Tileset *, int> ThumbKey;
+
+		/// Queue thumbnails for any tile rows currently on screen.
+		/**
+		 * Rows queued earlier that have since scrolled out of view are dropped
+		 * from the queue, so the rows being looked at are always done first.
+		 *
+		 * @return false, to run once when called from an idle handler.
+		 */
+		bool on_queue_thumbnails();
+
+		/// Schedule on_queue_thumbnails() after the tree has been redrawn.
+		void scheduleThumbnails();
+
+		/// Queue a thumbnail for one row, unless it already has one.
+		/**
+		 * @param iter
+		 *   Row to check.
+		 */
+		void queueThumbnail(const Gtk::TreeModel::iterator& iter);
+
+		/// Decode one tile and shrink it to a thumbnail.  Runs in a worker thread.
+		/**
+		 * @param tileset
+		 *   Tileset holding the tile.
+		 *
+		 * @param index
+		 *   Index of the tile within tileset->files().
+		 */
+		void makeThumbnail(std::shared_ptr<camoto::gamegraphics::Tileset> tileset,
+			int index);
+
+		/// Put finished thumbnails into the tree.
+		/**
+		 * Called in the main thread via dispatchThumbs.
+		 */
+		void on_thumbnails_ready();
+
+		/// Fill in a folder's contents just before it is expanded for the first
+		/// time.
+		bool on_test_expand_row(const Gtk::TreeModel::iterator& iter,
+			const Gtk::TreeModel::Path& path);
+
 		void appendChildren(const Glib::ustring& prefix,
 			std::shared_ptr<camoto::gamegraphics::Tileset> tileset,
 			Gtk::TreeModel::Row& root);
 		void setImage(std::unique_ptr<camoto::gamegraphics::Image> img);
 
+		/// Display an image already converted for Cairo.
+		/**
+		 * @param img
+		 *   Image to edit.
+		 *
+		 * @param surface
+		 *   Image to display, which must match img.
+		 */
+		void setImage(std::unique_ptr<camoto::gamegraphics::Image> img,
+			const Cairo::RefPtr<Cairo::Surface>& surface);
+
+		/// Show every tile in a tileset as a grid, in place of a single image.
+		/**
+		 * The grid is empty until the tileset's atlas has been built.
+		 *
+		 * @param tileset
+		 *   Tileset to display.
+		 */
+		void setTileset(std::shared_ptr<camoto::gamegraphics::Tileset> tileset);
+
+		/// Get the atlas for a tileset if it has been built.
+		/**
+		 * If it hasn't, it is built by atlasBuilder and on_atlases_ready() puts
+		 * it into atlases.
+		 *
+		 * @param tileset
+		 *   Tileset to look up.
+		 *
+		 * @return The atlas, or null if it isn't ready yet.
+		 */
+		const TileAtlas *requestAtlas(
+			const std::shared_ptr<camoto::gamegraphics::Tileset>& tileset);
+
+		/// Build the atlas for a tileset.  Runs in a worker thread.
+		/**
+		 * mtxTileset is only held while each tile is read, so the main thread
+		 * can still open tiles in the meantime.
+		 *
+		 * @param tileset
+		 *   Tileset to convert.
+		 */
+		void buildAtlas(std::shared_ptr<camoto::gamegraphics::Tileset> tileset);
+
+		/// Put finished atlases into atlases.
+		/**
+		 * Called in the main thread via dispatchAtlases.
+		 */
+		void on_atlases_ready();
+
+		/// Redraw everything showing a tileset after its tiles have been changed.
+		/**
+		 * The tileset's atlas is built again in the background, and its
+		 * thumbnails are made again.  The old atlas is shown until then.
+		 *
+		 * @param tileset
+		 *   Tileset that has changed.
+		 */
+		void refreshTileset(
+			const std::shared_ptr<camoto::gamegraphics::Tileset>& tileset);
+
 		void on_row_activated(const Gtk::TreeModel::Path& path,
 			Gtk::TreeViewColumn* column);
 		void on_undo();
 		void on_redo();
+		void on_zoom_in();
+		void on_zoom_normal();
+		void on_zoom_out();
 		void on_tileset_add();
 		void on_tileset_remove();
 		void on_image_import();
@@ -76,9 +226,59 @@ class Tab_Graphics: public Gtk::Box
 		Glib::RefPtr<Gtk::TreeStore> ctItems;
 		Glib::RefPtr<Gio::SimpleActionGroup> agItems;
 		ModelTilesetColumns cols;
+		DrawingArea_Tileset *ctGrid;
 		std::unique_ptr<camoto::gamegraphics::Image> obj_image;
 		std::shared_ptr<camoto::gamegraphics::Tileset> obj_tileset;
+
+		/// Tileset obj_image came from, or null if it is a standalone image.
+		std::shared_ptr<camoto::gamegraphics::Tileset> imgTileset;
+
+		/// Tileset shown in the grid, or null if obj_image is being shown instead.
+		std::shared_ptr<camoto::gamegraphics::Tileset> gridTileset;
 		std::unique_ptr<camoto::gamegraphics::Palette> obj_palette;
+
+		/// Converted images for every tileset opened in the tree.
+		std::map<std::shared_ptr<camoto::gamegraphics::Tileset>, TileAtlas> atlases;
+
+		/// A thumbnail made by a worker thread, waiting to go into the tree.
+		struct Thumbnail {
+			ThumbKey key;                 ///< Tile the thumbnail is for
+			camoto::gamegraphics::Point dims; ///< Thumbnail size, in pixels
+			std::vector<uint32_t> pixels; ///< Cairo ARGB32, row by row
+		};
+
+		/// Rows waiting for a thumbnail.
+		std::map<ThumbKey, Gtk::TreeRowReference> thumbRows;
+		std::set<ThumbKey> thumbDone;   ///< Rows that have a thumbnail
+		bool thumbsScheduled;           ///< true if on_queue_thumbnails() is due
+		std::vector<Thumbnail> thumbs;  ///< Finished thumbnails, see mtxThumbs
+		std::mutex mtxThumbs;           ///< Lock for thumbs
+		Glib::Dispatcher dispatchThumbs; ///< Signals main thread to read thumbs
+
+		/// An atlas built by a worker thread, waiting to go into atlases.
+		struct ReadyAtlas {
+			std::shared_ptr<camoto::gamegraphics::Tileset> tileset;
+			TileAtlas atlas;
+		};
+
+		/// Tilesets whose atlas is being built by atlasBuilder.
+		std::set<std::shared_ptr<camoto::gamegraphics::Tileset>> atlasesPending;
+		std::vector<ReadyAtlas> atlasesReady; ///< Finished, see mtxAtlases
+		std::mutex mtxAtlases;                ///< Lock for atlasesReady
+		Glib::Dispatcher dispatchAtlases;     ///< Signals main thread to read them
+
+		/// Lock held while reading from any tileset, as the tileset streams can't
+		/// be read by two threads at once.  Shared with anything else using
+		/// obj_tileset, such as a map, see Project::openShared().
+		std::shared_ptr<std::mutex> mtxTileset;
+
+		/// Thread building atlases, so large tilesets don't hold up the GUI.
+		/// Declared after everything its jobs use so it is destroyed first.
+		WorkerPool atlasBuilder;
+
+		/// Low priority thread making thumbnails.  Declared last so it is
+		/// destroyed before anything its jobs use.
+		WorkerPool thumbnailer;
 };
 
 #endif // STUDIO_TAB_GRAPHICS_HPP_
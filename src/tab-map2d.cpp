@@ -47,6 +47,9 @@ Tab_Map2D::Tab_Map2D(BaseObjectType *obj,
 	this->agItems->add_action("undo", sigc::mem_fun(this, &Tab_Map2D::on_undo));
 	this->agItems->add_action("redo", sigc::mem_fun(this, &Tab_Map2D::on_redo));
 	this->agItems->add_action("save", sigc::mem_fun(this, &Tab_Map2D::on_save));
+	this->agItems->add_action("zoom_in", sigc::mem_fun(this, &Tab_Map2D::on_zoom_in));
+	this->agItems->add_action("zoom_normal", sigc::mem_fun(this, &Tab_Map2D::on_zoom_normal));
+	this->agItems->add_action("zoom_out", sigc::mem_fun(this, &Tab_Map2D::on_zoom_out));
 	this->insert_action_group("doc", this->agItems);
 
 	auto tvLayers = Glib::RefPtr<Gtk::TreeView>::cast_dynamic(
@@ -55,6 +58,7 @@ Tab_Map2D::Tab_Map2D(BaseObjectType *obj,
 	tvLayers->set_model(this->ctItems);
 
 	this->refBuilder->get_widget_derived("canvasMain", this->ctCanvas);
+	this->refBuilder->get_widget_derived("canvasOverview", this->ctOverview);
 }
 
 void Tab_Map2D::content(std::unique_ptr<Map2D> obj, DepData& depData)
@@ -64,6 +68,7 @@ void Tab_Map2D::content(std::unique_ptr<Map2D> obj, DepData& depData)
 
 	// Read all the depData objects and build a TilesetCollection from them
 	TilesetCollection allTilesets;
+	std::vector<std::shared_ptr<std::mutex>> tilesetLocks;
 
 	for (auto& d : depData) {
 		auto& depType = d.first;
@@ -71,8 +76,16 @@ void Tab_Map2D::content(std::unique_ptr<Map2D> obj, DepData& depData)
 		if (objInst->type != GameObjectInstance::Type::Tileset) continue;
 		ImagePurpose purpose = dep2purpose(depType);
 		allTilesets[purpose] = objInst->get_shared<Tileset>();
+		// Shared tilesets may be in use by other tabs at the same time
+		if (objInst->lock) tilesetLocks.push_back(objInst->lock);
 	}
-	this->ctCanvas->content(this->obj, allTilesets);
+	this->ctCanvas->content(this->obj, allTilesets, tilesetLocks);
+
+	auto scrolledMain = Glib::RefPtr<Gtk::ScrolledWindow>::cast_dynamic(
+		this->refBuilder->get_object("scrolledMain"));
+	assert(scrolledMain);
+	this->ctOverview->content(this->obj, this->ctCanvas,
+		scrolledMain->get_hadjustment(), scrolledMain->get_vadjustment());
 	return;
 }
 
@@ -90,3 +103,21 @@ void Tab_Map2D::on_save()
 {
 	return;
 }
+
+void Tab_Map2D::on_zoom_in()
+{
+	this->ctCanvas->setZoom(this->ctCanvas->getZoom() + 1);
+	return;
+}
+
+void Tab_Map2D::on_zoom_normal()
+{
+	this->ctCanvas->setZoom(0);
+	return;
+}
+
+void Tab_Map2D::on_zoom_out()
+{
+	this->ctCanvas->setZoom(this->ctCanvas->getZoom() - 1);
+	return;
+}
@@ -24,6 +24,7 @@
 #include <gtkmm.h>
 #include <camoto/gamemaps/map2d.hpp>
 #include "ct-map2d-canvas.hpp"
+#include "ct-map2d-overview.hpp"
 
 class Tab_Map2D: public Gtk::Box
 {
@@ -52,11 +53,15 @@ class Tab_Map2D: public Gtk::Box
 		void on_undo();
 		void on_redo();
 		void on_save();
+		void on_zoom_in();
+		void on_zoom_normal();
+		void on_zoom_out();
 
 		Glib::RefPtr<Gtk::Builder> refBuilder;
 		Glib::RefPtr<Gtk::TreeStore> ctItems;
 		Glib::RefPtr<Gio::SimpleActionGroup> agItems;
 		DrawingArea_Map2D *ctCanvas;
+		DrawingArea_Map2DOverview *ctOverview;
 		ModelTilesetColumns cols;
 		std::shared_ptr<camoto::gamemaps::Map2D> obj;
 };
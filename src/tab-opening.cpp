@@ -0,0 +1,65 @@
+/**
+ * @file  tab-opening.cpp
+ * @brief Placeholder tab shown while an item is opened in the background.
+ *
+ * Copyright (C) 2013-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cassert>
+#include <gtkmm.h>
+#include <glibmm/i18n.h>
+#include "main.hpp"
+#include "tab-opening.hpp"
+
+const std::string Tab_Opening::tab_id = "tab-opening";
+
+Tab_Opening::Tab_Opening(BaseObjectType *obj,
+	const Glib::RefPtr<Gtk::Builder>& refBuilder)
+	:	Gtk::Box(obj),
+		refBuilder(refBuilder)
+{
+	auto ctCancel = Glib::RefPtr<Gtk::Button>::cast_dynamic(
+		this->refBuilder->get_object("btnCancel"));
+	assert(ctCancel);
+	ctCancel->signal_clicked().connect(sigc::mem_fun(this, &Tab_Opening::on_cancel));
+}
+
+Tab_Opening::~Tab_Opening()
+{
+	if (this->job) this->job->cancelled = true;
+}
+
+void Tab_Opening::content(std::shared_ptr<OpenJob> job)
+{
+	this->job = job;
+	this->job->tab = this;
+
+	auto ctLabel = Glib::RefPtr<Gtk::Label>::cast_dynamic(
+		this->refBuilder->get_object("lblOpening"));
+	assert(ctLabel);
+	ctLabel->set_text(Glib::ustring::compose(
+		// Translators: %1 is the name of the item being opened
+		_("Opening %1..."), job->item.friendlyName));
+	return;
+}
+
+void Tab_Opening::on_cancel()
+{
+	if (this->job) this->job->cancelled = true;
+	auto studio = static_cast<Studio *>(this->get_toplevel());
+	studio->closeTab(this);
+	return;
+}
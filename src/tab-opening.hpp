@@ -0,0 +1,84 @@
+/**
+ * @file  tab-opening.hpp
+ * @brief Placeholder tab shown while an item is opened in the background.
+ *
+ * Copyright (C) 2013-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STUDIO_TAB_OPENING_HPP_
+#define STUDIO_TAB_OPENING_HPP_
+
+#include <atomic>
+#include <memory>
+#include <gtkmm.h>
+#include "gamelist.hpp"
+#include "project.hpp"
+
+class Tab_Opening;
+
+/// An item being opened by a worker thread, see Studio::openProjectItem().
+/**
+ * The worker fills in the result fields then hands the job back to the main
+ * thread, which is the only one to touch it after that.
+ */
+struct OpenJob
+{
+	GameObject item;           ///< Item being opened
+	Project *proj;             ///< Project the item belongs to
+	Tab_Opening *tab;          ///< Placeholder tab, only valid if !cancelled
+
+	/// Set by the main thread when the placeholder tab is closed.  The worker
+	/// stops at the next step, and the result is thrown away.
+	std::atomic<bool> cancelled;
+
+	// Results
+	std::unique_ptr<GameObjectInstance> inst; ///< Opened item, or null
+	DepData depData;           ///< Dependencies opened along with the item
+	Glib::ustring error;       ///< Reason for failure, empty on success
+	itemid_t idQuestion;       ///< Item that failed the format check, if any
+	Glib::ustring question;    ///< Question to ask about idQuestion
+};
+
+/// Placeholder tab shown while an item is opened in the background.
+/**
+ * Closing this tab, or clicking its cancel button, cancels the job.
+ */
+class Tab_Opening: public Gtk::Box
+{
+	public:
+		Tab_Opening(BaseObjectType *obj,
+			const Glib::RefPtr<Gtk::Builder>& refBuilder);
+
+		/// Cancel the job if it hasn't finished yet.
+		virtual ~Tab_Opening();
+
+		/// Set the job this tab is waiting on.
+		/**
+		 * @param job
+		 *   Job opening the item.  job->tab is set to this tab.
+		 */
+		void content(std::shared_ptr<OpenJob> job);
+
+		static const std::string tab_id;
+
+	protected:
+		void on_cancel();
+
+		Glib::RefPtr<Gtk::Builder> refBuilder;
+		std::shared_ptr<OpenJob> job;
+};
+
+#endif // STUDIO_TAB_OPENING_HPP_
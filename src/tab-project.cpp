@@ -21,6 +21,7 @@
 #include <cassert>
 #include <gtkmm.h>
 #include <glibmm/i18n.h>
+#include <camoto/util.hpp> // make_unique
 #include "gamelist.hpp"
 #include "main.hpp"
 #include "project.hpp"
@@ -41,7 +42,8 @@ Tab_Project::Tab_Project(BaseObjectType *obj,
 	const Glib::RefPtr<Gtk::Builder>& refBuilder)
 	:	Gtk::Box(obj),
 		refBuilder(refBuilder),
-		agItems(Gio::SimpleActionGroup::create())
+		agItems(Gio::SimpleActionGroup::create()),
+		agProject(Gio::SimpleActionGroup::create())
 {
 	this->agItems->add_action("open", sigc::mem_fun(this, &Tab_Project::on_open_item));
 	this->agItems->add_action("extract_again", sigc::mem_fun(this, &Tab_Project::on_extract_again));
@@ -51,6 +53,9 @@ Tab_Project::Tab_Project(BaseObjectType *obj,
 	this->agItems->add_action("replace_raw", sigc::mem_fun(this, &Tab_Project::on_replace_raw));
 	this->agItems->add_action("replace_decoded", sigc::mem_fun(this, &Tab_Project::on_replace_decoded));
 
+	this->agProject->add_action("export_graphics", sigc::mem_fun(this, &Tab_Project::on_export_graphics));
+	this->insert_action_group("project", this->agProject);
+
 	this->ctTree = Glib::RefPtr<Gtk::TreeView>::cast_dynamic(
 		this->refBuilder->get_object("tvItems"));
 	assert(this->ctTree);
@@ -63,6 +68,13 @@ Tab_Project::Tab_Project(BaseObjectType *obj,
 	tvsel->signal_changed().connect(sigc::mem_fun(this, &Tab_Project::on_item_selected));
 
 	this->ctTree->signal_row_activated().connect(sigc::mem_fun(this, &Tab_Project::on_row_activated));
+
+	auto ctExportCancel = Glib::RefPtr<Gtk::Button>::cast_dynamic(
+		this->refBuilder->get_object("btnExportCancel"));
+	assert(ctExportCancel);
+	ctExportCancel->signal_clicked().connect(sigc::mem_fun(this, &Tab_Project::on_export_cancel));
+
+	this->dispExport.connect(sigc::mem_fun(this, &Tab_Project::on_export_progress));
 }
 
 void Tab_Project::content(std::unique_ptr<Project> obj)
@@ -213,28 +225,126 @@ void Tab_Project::on_replace_decoded()
 	return;
 }
 
-void Tab_Project::openItemById(const itemid_t& idItem)
+void Tab_Project::on_export_graphics()
 {
-	Gtk::Window *win = dynamic_cast<Gtk::Window *>(this->get_toplevel());
-	if (!win) {
-		Gtk::MessageDialog dlg("Can't find parent window!", false,
-			Gtk::MESSAGE_WARNING, Gtk::BUTTONS_OK_CANCEL, true);
-		dlg.set_title(_("Open failure"));
-		dlg.run();
+	if (this->exporter) return; // already running
+
+	Gtk::FileChooserDialog dlg(_("Select a folder to export graphics into"),
+		Gtk::FILE_CHOOSER_ACTION_SELECT_FOLDER);
+	Gtk::Window *parent = dynamic_cast<Gtk::Window *>(this->get_toplevel());
+	if (parent) dlg.set_transient_for(*parent);
+	dlg.add_button("_Cancel", Gtk::RESPONSE_CANCEL);
+	dlg.add_button("_Export", Gtk::RESPONSE_OK);
+	if (dlg.run() != Gtk::RESPONSE_OK) return;
+	this->exportPath = dlg.get_filename();
+	dlg.hide();
+
+	this->exporter = std::make_unique<GraphicsExporter>(this->proj.get(),
+		this->exportPath);
+	auto total = this->exporter->start([this]() {
+		this->dispExport.emit();
+	});
+	if (total == 0) {
+		this->exporter.reset();
+		auto studio = static_cast<Studio *>(this->get_toplevel());
+		studio->infobar(_("This game has no images or tilesets to export."));
 		return;
 	}
 
+	auto action = Glib::RefPtr<Gio::SimpleAction>::cast_static(
+		this->agProject->lookup("export_graphics"));
+	action->set_enabled(false);
+
+	auto ctExportCancel = Glib::RefPtr<Gtk::Button>::cast_dynamic(
+		this->refBuilder->get_object("btnExportCancel"));
+	assert(ctExportCancel);
+	ctExportCancel->set_sensitive(true);
+
+	auto ctExport = Glib::RefPtr<Gtk::Box>::cast_dynamic(
+		this->refBuilder->get_object("boxExport"));
+	assert(ctExport);
+	ctExport->show();
+
+	this->on_export_progress();
+	return;
+}
+
+void Tab_Project::on_export_progress()
+{
+	if (!this->exporter) return; // leftover signal from a finished export
+
+	auto ctProgress = Glib::RefPtr<Gtk::ProgressBar>::cast_dynamic(
+		this->refBuilder->get_object("pbExport"));
+	assert(ctProgress);
+
+	unsigned int done = this->exporter->getDone();
+	unsigned int total = this->exporter->getTotal();
+	ctProgress->set_fraction((double)done / total);
+	ctProgress->set_text(Glib::ustring::compose(
+		// Translators: %1 is the number of items exported so far, %2 is the total
+		_("Exporting graphics: %1 of %2"), done, total));
+	if (done < total) return;
+
+	// All finished
+	this->exporter->wait();
+	auto failures = this->exporter->getFailures();
+	bool cancelled = this->exporter->isCancelled();
+	this->exporter.reset();
+
+	auto ctExport = Glib::RefPtr<Gtk::Box>::cast_dynamic(
+		this->refBuilder->get_object("boxExport"));
+	assert(ctExport);
+	ctExport->hide();
+
+	auto action = Glib::RefPtr<Gio::SimpleAction>::cast_static(
+		this->agProject->lookup("export_graphics"));
+	action->set_enabled(true);
+
+	auto studio = static_cast<Studio *>(this->get_toplevel());
+	if (cancelled) {
+		studio->infobar(_("Graphics export cancelled."));
+	} else {
+		studio->infobar(Glib::ustring::compose(
+			// Translators: %1 is the number of files written, %2 is the folder
+			_("Exported %1 images and tilesets to %2"),
+			total - failures.size(), this->exportPath));
+	}
+
+	if (!failures.empty()) {
+		Glib::ustring msg = _("These items could not be exported:");
+		msg += "\n";
+		for (auto& f : failures) {
+			msg += Glib::ustring::compose("\n%1: %2", f.id, f.error);
+		}
+		Gtk::MessageDialog dlg(msg, false, Gtk::MESSAGE_WARNING,
+			Gtk::BUTTONS_OK, true);
+		dlg.set_title(_("Export graphics"));
+		Gtk::Window *parent = dynamic_cast<Gtk::Window *>(this->get_toplevel());
+		if (parent) dlg.set_transient_for(*parent);
+		dlg.run();
+	}
+	return;
+}
+
+void Tab_Project::on_export_cancel()
+{
+	if (!this->exporter) return;
+	this->exporter->cancel();
+
+	// The progress bar carries on until the items being written are finished
+	auto ctExportCancel = Glib::RefPtr<Gtk::Button>::cast_dynamic(
+		this->refBuilder->get_object("btnExportCancel"));
+	assert(ctExportCancel);
+	ctExportCancel->set_sensitive(false);
+	return;
+}
+
+void Tab_Project::openItemById(const itemid_t& idItem)
+{
 	try {
 		auto gameObj = this->proj->findItem(idItem);
-		auto content = this->proj->openFile(win, gameObj, true);
-		if (!content) {
-			// File could not be opened, and the user has already been told why.
-			return;
-		}
-		SuppData suppData;
-		this->proj->openSuppsByObj(win, &suppData, gameObj);
 		auto studio = static_cast<Studio *>(this->get_toplevel());
-		studio->openItem(gameObj, std::move(content), suppData, this->proj.get());
+		studio->openProjectItem(gameObj, this->proj.get());
 	} catch (const EFailure& e) {
 		Gtk::MessageDialog dlg(
 			Glib::ustring::compose(
@@ -24,6 +24,7 @@
 #include <map>
 #include <gtkmm.h>
 #include "project.hpp"
+#include "util-export.hpp"
 
 class Tab_Project: public Gtk::Box
 {
@@ -59,6 +60,9 @@ class Tab_Project: public Gtk::Box
 		void on_replace_again();
 		void on_replace_raw();
 		void on_replace_decoded();
+		void on_export_graphics();
+		void on_export_progress();
+		void on_export_cancel();
 		void openItemById(const itemid_t& idItem);
 		void promptExtract(bool applyFilters);
 		void promptReplace(bool applyFilters);
@@ -71,9 +75,17 @@ class Tab_Project: public Gtk::Box
 		Glib::RefPtr<Gtk::TreeView> ctTree;
 		Glib::RefPtr<Gtk::TreeStore> ctItems;
 		Glib::RefPtr<Gio::SimpleActionGroup> agItems;
+		Glib::RefPtr<Gio::SimpleActionGroup> agProject;
 		ModelItemColumns cols;
 		std::unique_ptr<Project> proj;
 		Glib::ustring loadErrors; ///< List of errors encountered when loading project
+
+		/// Signalled from the export threads each time an item is finished.
+		Glib::Dispatcher dispExport;
+
+		/// Export currently running, or null.  Must be destroyed before proj.
+		std::unique_ptr<GraphicsExporter> exporter;
+		std::string exportPath; ///< Folder the current export is writing to
 };
 
 #endif // STUDIO_TAB_PROJECT_HPP_
@@ -0,0 +1,216 @@
+/**
+ * @file  util-atlas.cpp
+ * @brief Packs many small images into a few large Cairo surfaces.
+ *
+ * Copyright (C) 2013-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cassert>
+#include <iostream>
+#include "util-gfx.hpp"
+#include "util-atlas.hpp"
+
+using namespace camoto::gamegraphics;
+
+TileAtlas::TileAtlas()
+{
+}
+
+void TileAtlas::build(Tileset& tileset, std::mutex *mtx)
+{
+	// Open every image first, so they can all be packed in one go
+	std::vector<std::unique_ptr<Image>> opened;
+	std::vector<const Image *> images;
+	for (auto& i : tileset.files()) {
+		std::unique_ptr<Image> img;
+		if (
+			!(i->fAttr & Tileset::File::Attribute::Vacant)
+			&& !(i->fAttr & Tileset::File::Attribute::Folder)
+		) {
+			try {
+				std::unique_lock<std::mutex> lock;
+				if (mtx) lock = std::unique_lock<std::mutex>(*mtx);
+				img = tileset.openImage(i);
+			} catch (const std::exception& e) {
+				std::cerr << "[atlas] Unable to open tile: " << e.what() << std::endl;
+			}
+		}
+		images.push_back(img.get());
+		opened.push_back(std::move(img));
+	}
+	this->build(images, &tileset, mtx);
+
+	// Closing the images may use the tileset too
+	std::unique_lock<std::mutex> lock;
+	if (mtx) lock = std::unique_lock<std::mutex>(*mtx);
+	opened.clear();
+	return;
+}
+
+void TileAtlas::build(const std::vector<const Image *>& images,
+	const Tileset *tileset, std::mutex *mtx)
+{
+	std::vector<Point> dims;
+	dims.reserve(images.size());
+	for (auto& img : images) {
+		if (img) {
+			std::unique_lock<std::mutex> lock;
+			if (mtx) lock = std::unique_lock<std::mutex>(*mtx);
+			dims.push_back(img->dimensions());
+		} else {
+			dims.push_back({0, 0});
+		}
+	}
+	this->pack(dims);
+
+	for (auto& s : this->surfaces) s->flush();
+
+	unsigned int index = 0;
+	for (auto& img : images) {
+		auto& ent = this->entries[index++];
+		if ((ent.rect.width == 0) || (ent.rect.height == 0)) continue;
+		auto& page = this->surfaces[ent.page];
+		int stride = page->get_stride();
+		auto dst = page->get_data() + ent.rect.y * stride + ent.rect.x * 4;
+		try {
+			std::unique_lock<std::mutex> lock;
+			if (mtx) lock = std::unique_lock<std::mutex>(*mtx);
+			ent.opaque = copyToCairoSurface(img, tileset, dst, stride);
+		} catch (const std::exception& e) {
+			std::cerr << "[atlas] Unable to convert tile: " << e.what() << std::endl;
+		}
+	}
+
+	for (auto& s : this->surfaces) s->mark_dirty();
+	return;
+}
+
+void TileAtlas::clear()
+{
+	this->entries.clear();
+	this->surfaces.clear();
+	return;
+}
+
+unsigned int TileAtlas::size() const
+{
+	return this->entries.size();
+}
+
+const TileAtlas::Entry& TileAtlas::entry(unsigned int index) const
+{
+	assert(index < this->entries.size());
+	return this->entries[index];
+}
+
+const std::vector<Cairo::RefPtr<Cairo::ImageSurface>>& TileAtlas::pages() const
+{
+	return this->surfaces;
+}
+
+void TileAtlas::draw(const Cairo::RefPtr<Cairo::Context>& cr,
+	unsigned int index, double x, double y) const
+{
+	auto& e = this->entry(index);
+	if ((e.rect.width == 0) || (e.rect.height == 0)) return;
+	cr->set_source(this->surfaces[e.page], x - e.rect.x, y - e.rect.y);
+	cr->rectangle(x, y, e.rect.width, e.rect.height);
+	cr->fill();
+	return;
+}
+
+Cairo::RefPtr<Cairo::Surface> TileAtlas::surface(unsigned int index) const
+{
+	auto& e = this->entry(index);
+	if ((e.rect.width == 0) || (e.rect.height == 0)) {
+		return Cairo::RefPtr<Cairo::Surface>();
+	}
+	return Cairo::Surface::create(this->surfaces[e.page],
+		e.rect.x, e.rect.y, e.rect.width, e.rect.height);
+}
+
+unsigned long TileAtlas::bytes() const
+{
+	unsigned long total = 0;
+	for (auto& s : this->surfaces) {
+		total += (unsigned long)s->get_stride() * s->get_height();
+	}
+	return total;
+}
+
+void TileAtlas::pack(const std::vector<Point>& dims)
+{
+	this->clear();
+	this->entries.resize(dims.size());
+
+	// Place the tallest images first, so each shelf wastes as little space as
+	// possible.  Most tilesets have all their images the same size anyway.
+	std::vector<unsigned int> order;
+	order.reserve(dims.size());
+	for (unsigned int i = 0; i < dims.size(); i++) {
+		this->entries[i] = {0, {0, 0, 0, 0}, false};
+		if ((dims[i].x == 0) || (dims[i].y == 0)) continue;
+		order.push_back(i);
+	}
+	std::stable_sort(order.begin(), order.end(),
+		[&dims](unsigned int a, unsigned int b) {
+			return dims[a].y > dims[b].y;
+		}
+	);
+
+	// Size of each page needed to hold the images placed on it
+	std::vector<Point> pageDims;
+	long shelfX = 0, shelfY = 0, shelfHeight = 0;
+	for (auto i : order) {
+		long width = dims[i].x + ATLAS_PADDING;
+		long height = dims[i].y + ATLAS_PADDING;
+
+		if (pageDims.empty()) pageDims.push_back({0, 0});
+		if ((shelfX > 0) && (shelfX + width > ATLAS_PAGE_WIDTH)) {
+			// Start a new shelf underneath the current one
+			shelfY += shelfHeight;
+			shelfX = 0;
+			shelfHeight = 0;
+		}
+		if ((shelfY > 0) && (shelfY + height > ATLAS_PAGE_HEIGHT)) {
+			// Page is full, start a new one
+			pageDims.push_back({0, 0});
+			shelfX = 0;
+			shelfY = 0;
+			shelfHeight = 0;
+		}
+
+		auto& e = this->entries[i];
+		e.page = pageDims.size() - 1;
+		e.rect = {shelfX, shelfY, dims[i].x, dims[i].y};
+
+		auto& page = pageDims.back();
+		page.x = std::max((long)page.x, shelfX + width);
+		page.y = std::max((long)page.y, shelfY + height);
+		shelfX += width;
+		shelfHeight = std::max(shelfHeight, height);
+	}
+
+	// Surfaces are created cleared to transparent, which takes care of the
+	// padding.
+	for (auto& p : pageDims) {
+		this->surfaces.push_back(
+			Cairo::ImageSurface::create(Cairo::FORMAT_ARGB32, p.x, p.y)
+		);
+	}
+	return;
+}
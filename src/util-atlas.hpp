@@ -0,0 +1,161 @@
+/**
+ * @file  util-atlas.hpp
+ * @brief Packs many small images into a few large Cairo surfaces.
+ *
+ * Copyright (C) 2013-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STUDIO_UTIL_ATLAS_HPP_
+#define STUDIO_UTIL_ATLAS_HPP_
+
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <cairomm/context.h>
+#include <cairomm/surface.h>
+#include <camoto/gamegraphics/image.hpp>
+#include <camoto/gamegraphics/tileset.hpp>
+
+/// Width of each atlas page, unless an image is wider than this.
+#define ATLAS_PAGE_WIDTH 1024
+
+/// Height at which a new atlas page is started.
+#define ATLAS_PAGE_HEIGHT 2048
+
+/// Blank pixels left between images, so scaled images don't pick up their
+/// neighbours' edges.
+#define ATLAS_PADDING 1
+
+/// A set of images packed into a few large surfaces.
+/**
+ * Drawing thousands of small tiles from their own surfaces means thousands of
+ * allocations and a change of source surface for every tile.  Packing them
+ * into one or two large surfaces avoids both, and each image is drawn by
+ * painting part of its page instead.
+ *
+ * An atlas is not thread safe, but it can be built in a worker thread and
+ * then moved to the main thread, as long as the worker keeps no copies of the
+ * pages.
+ */
+class TileAtlas
+{
+	public:
+		/// Location of one image within the atlas.
+		struct Entry {
+			unsigned int page;               ///< Index into pages()
+			camoto::gamegraphics::Rect rect; ///< Area of the page, 0x0 if no image
+			bool opaque;                     ///< true if no pixels are transparent
+		};
+
+		TileAtlas();
+
+		/// Pack every image in a tileset.
+		/**
+		 * All the images are opened and measured first, so the pages can be
+		 * allocated once at their final size and each image converted straight
+		 * into place.  Entries for vacant slots and sub-tilesets have no image.
+		 *
+		 * @param tileset
+		 *   Tileset to pack.  Sub-tilesets are not included.
+		 *
+		 * @param mtx
+		 *   Optional lock to hold while reading each image from the tileset.  It
+		 *   is released in between, so other threads can use the tileset while
+		 *   a large atlas is being built.
+		 *
+		 * @post Any previous content is discarded.  There is one entry for each
+		 *   item in tileset->files(), in the same order.
+		 */
+		void build(camoto::gamegraphics::Tileset& tileset,
+			std::mutex *mtx = nullptr);
+
+		/// Pack a list of images.
+		/**
+		 * @param images
+		 *   Images to pack.  Null entries are permitted and get an entry with no
+		 *   image.
+		 *
+		 * @param tileset
+		 *   Optional tileset to take the palette from, as for
+		 *   createCairoSurface().
+		 *
+		 * @param mtx
+		 *   Optional lock to hold while reading each image, as for the other
+		 *   build().
+		 *
+		 * @post Any previous content is discarded.  There is one entry for each
+		 *   item in images, in the same order.
+		 */
+		void build(const std::vector<const camoto::gamegraphics::Image *>& images,
+			const camoto::gamegraphics::Tileset *tileset, std::mutex *mtx = nullptr);
+
+		/// Remove all images and pages.
+		void clear();
+
+		/// Number of entries in the atlas.
+		unsigned int size() const;
+
+		/// Get the location of an image.
+		const Entry& entry(unsigned int index) const;
+
+		/// Get the surfaces the images have been packed into.
+		const std::vector<Cairo::RefPtr<Cairo::ImageSurface>>& pages() const;
+
+		/// Paint one image.
+		/**
+		 * @param cr
+		 *   Context to draw onto.
+		 *
+		 * @param index
+		 *   Entry to draw.
+		 *
+		 * @param x
+		 *   Position of the image's left edge, in cr's user space.
+		 *
+		 * @param y
+		 *   Position of the image's top edge, in cr's user space.
+		 */
+		void draw(const Cairo::RefPtr<Cairo::Context>& cr, unsigned int index,
+			double x, double y) const;
+
+		/// Get a surface that refers to just one image.
+		/**
+		 * The surface shares the page's memory rather than copying it.
+		 *
+		 * @param index
+		 *   Entry to return.
+		 *
+		 * @return A surface of the image's size, or a null pointer if the entry
+		 *   has no image.
+		 */
+		Cairo::RefPtr<Cairo::Surface> surface(unsigned int index) const;
+
+		/// Memory used by all pages, in bytes.
+		unsigned long bytes() const;
+
+	protected:
+		/// Decide where each image will go and allocate pages to suit.
+		/**
+		 * @param dims
+		 *   Size of each image, with 0x0 for entries without an image.
+		 */
+		void pack(const std::vector<camoto::gamegraphics::Point>& dims);
+
+		std::vector<Entry> entries;
+		std::vector<Cairo::RefPtr<Cairo::ImageSurface>> surfaces;
+};
+
+#endif // STUDIO_UTIL_ATLAS_HPP_
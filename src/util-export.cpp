@@ -0,0 +1,179 @@
+/**
+ * @file  util-export.cpp
+ * @brief Export every image and tileset in a project to .png files.
+ *
+ * Copyright (C) 2013-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <glibmm/i18n.h>
+#include <glibmm/miscutils.h>
+#include "gamelist.hpp"
+#include "util-export.hpp"
+#include "util-png.hpp"
+
+using namespace camoto;
+using namespace camoto::gamegraphics;
+
+GraphicsExporter::GraphicsExporter(Project *proj,
+	const std::string& targetPath, unsigned int numThreads)
+	:	proj(proj),
+		targetPath(targetPath),
+		total(0),
+		done(0),
+		cancelled(false),
+		pool(numThreads)
+{
+}
+
+GraphicsExporter::~GraphicsExporter()
+{
+	this->cancel();
+	this->wait();
+}
+
+unsigned int GraphicsExporter::start(fn_progress onProgress)
+{
+	this->onProgress = onProgress;
+
+	// Count everything first, so the total is known before any job finishes
+	std::vector<const GameObject *> items;
+	for (auto& i : this->proj->game->objects) {
+		const GameObject& o = i.second;
+		if (
+			(o.editor.compare("image") == 0)
+			|| (o.editor.compare("tileset") == 0)
+		) {
+			items.push_back(&o);
+		}
+	}
+	this->total = items.size();
+
+	for (auto pItem : items) {
+		const GameObject& o = *pItem;
+		this->pool.add([this, &o]() {
+			// Skipped items still count as done, so the caller can tell when the
+			// last item has finished without having to wait().
+			if (!this->cancelled) {
+				try {
+					this->exportItem(o);
+				} catch (const EFailure& e) {
+					std::lock_guard<std::mutex> lock(this->mtxFailures);
+					this->failures.push_back({o.id, e.getMessage()});
+				} catch (const stream::error& e) {
+					std::lock_guard<std::mutex> lock(this->mtxFailures);
+					this->failures.push_back({o.id, Glib::ustring::compose(
+						_("Camoto library exception: %1"), e.what())});
+				} catch (const std::exception& e) {
+					std::lock_guard<std::mutex> lock(this->mtxFailures);
+					this->failures.push_back({o.id, Glib::ustring::compose(
+						_("Unexpected error: %1"), e.what())});
+				} catch (...) {
+					// Anything escaping would skip the progress update below, and
+					// the caller would wait forever for the last item
+					std::lock_guard<std::mutex> lock(this->mtxFailures);
+					this->failures.push_back({o.id, _("Unknown error.")});
+				}
+			}
+			this->done++;
+			if (this->onProgress) this->onProgress();
+		});
+	}
+	return this->total;
+}
+
+void GraphicsExporter::cancel()
+{
+	this->cancelled = true;
+	return;
+}
+
+void GraphicsExporter::wait()
+{
+	this->pool.wait();
+	return;
+}
+
+unsigned int GraphicsExporter::getTotal() const
+{
+	return this->total;
+}
+
+unsigned int GraphicsExporter::getDone() const
+{
+	return this->done;
+}
+
+bool GraphicsExporter::isCancelled() const
+{
+	return this->cancelled;
+}
+
+std::vector<GraphicsExporter::Failure> GraphicsExporter::getFailures() const
+{
+	std::lock_guard<std::mutex> lock(this->mtxFailures);
+	return this->failures;
+}
+
+void GraphicsExporter::exportItem(const GameObject& o)
+{
+	// No window, so a file that fails the format check throws EFormatMismatch
+	// and is reported as a failure
+	auto content = this->proj->openFile(nullptr, o, true);
+	if (!content) {
+		throw EFailure(_("The archive holding this item could not be opened."));
+	}
+	SuppData suppData;
+	DepData depData;
+	this->proj->openSuppsByObj(nullptr, &suppData, o);
+	auto inst = openObjectGeneric(nullptr, o, std::move(content), suppData,
+		&depData, this->proj);
+
+	auto fn = this->getFilename(o.id);
+	std::cout << "[export] Writing " << o.id << " to " << fn << std::endl;
+	switch (inst ? inst->type : GameObjectInstance::Type::Invalid) {
+		case GameObjectInstance::Type::Image: {
+			auto img = inst->get_unique<Image>();
+			if (!img) break;
+			exportImagePNG(fn, *img, nullptr);
+			return;
+		}
+		case GameObjectInstance::Type::Tileset: {
+			auto tileset = inst->get_shared<Tileset>();
+			if (!tileset) break;
+			exportTilesetPNG(fn, *tileset);
+			return;
+		}
+		default:
+			break;
+	}
+	throw EFailure(Glib::ustring::compose(
+		_("This item does not appear to be in \"%1\" format."), o.format));
+}
+
+std::string GraphicsExporter::getFilename(const itemid_t& id) const
+{
+	std::string name = id;
+	for (auto& c : name) {
+		switch (c) {
+			case '/': case '\\': case ':': case '*': case '?': case '"':
+			case '<': case '>': case '|':
+				c = '_';
+				break;
+		}
+	}
+	return Glib::build_filename(this->targetPath, name + ".png");
+}
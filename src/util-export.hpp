@@ -0,0 +1,134 @@
+/**
+ * @file  util-export.hpp
+ * @brief Export every image and tileset in a project to .png files.
+ *
+ * Copyright (C) 2013-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STUDIO_UTIL_EXPORT_HPP_
+#define STUDIO_UTIL_EXPORT_HPP_
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <glibmm/ustring.h>
+#include "project.hpp"
+#include "util-worker.hpp"
+
+/// Writes every image and tileset in a project out to .png files.
+/**
+ * Each item is opened, converted and written by a WorkerPool job, so several
+ * items are exported at once.  Items inside the same archive take turns to
+ * read from it (see LockedStream), but the slow part, decoding the pixels and
+ * compressing the .png, runs on every core.
+ *
+ * Each item is written to a file named after its ID, with any characters that
+ * aren't allowed in filenames replaced with underscores.  Tilesets are written
+ * as a single sprite sheet as per exportTilesetPNG().
+ */
+class GraphicsExporter
+{
+	public:
+		/// Error encountered while exporting one item.
+		struct Failure {
+			itemid_t id;         ///< ID of the item that could not be exported
+			Glib::ustring error; ///< Reason why
+		};
+
+		/// Called from a worker thread each time an item is finished.
+		/**
+		 * This must not touch any GTK widgets; use a Glib::Dispatcher to get
+		 * back to the main thread.
+		 */
+		typedef std::function<void()> fn_progress;
+
+		/// Prepare to export a project.
+		/**
+		 * @param proj
+		 *   Project to export from.  It must remain valid until wait() returns.
+		 *
+		 * @param targetPath
+		 *   Existing folder to write the .png files into.  Files already there
+		 *   are overwritten.
+		 *
+		 * @param numThreads
+		 *   Number of items to export at once, or 0 for one per CPU core.
+		 */
+		GraphicsExporter(Project *proj, const std::string& targetPath,
+			unsigned int numThreads = 0);
+
+		/// Cancel any items not yet started and wait for the rest.
+		~GraphicsExporter();
+
+		/// Queue every image and tileset in the project for export.
+		/**
+		 * @param onProgress
+		 *   Optional function to call after each item.
+		 *
+		 * @return Number of items queued, also available from getTotal().
+		 */
+		unsigned int start(fn_progress onProgress);
+
+		/// Skip any items that have not been started yet.
+		/**
+		 * Items already being written are allowed to finish, so no partial
+		 * files are left behind.  Skipped items still count towards getDone(),
+		 * so it reaches getTotal() once the last running item has finished.
+		 */
+		void cancel();
+
+		/// Block until every queued item has been exported or skipped.
+		void wait();
+
+		/// Number of items queued by start().
+		unsigned int getTotal() const;
+
+		/// Number of items finished so far, whether they worked or not.
+		unsigned int getDone() const;
+
+		/// true if cancel() was called.
+		bool isCancelled() const;
+
+		/// Get a copy of the errors so far.
+		std::vector<Failure> getFailures() const;
+
+	protected:
+		/// Open one item and write it to a .png file.
+		/**
+		 * @param o
+		 *   Item to export.  Its editor must be "image" or "tileset".
+		 *
+		 * @throw EFailure if the item could not be opened or written.
+		 */
+		void exportItem(const GameObject& o);
+
+		/// Work out the filename for an item.
+		std::string getFilename(const itemid_t& id) const;
+
+		Project *proj;
+		std::string targetPath;
+		fn_progress onProgress;
+		unsigned int total;              ///< Number of items queued
+		std::atomic<unsigned int> done;  ///< Number of items finished
+		std::atomic<bool> cancelled;     ///< true to skip remaining items
+		mutable std::mutex mtxFailures;  ///< Protects failures
+		std::vector<Failure> failures;   ///< Items that could not be exported
+		WorkerPool pool;                 ///< Declared last so it stops first
+};
+
+#endif // STUDIO_UTIL_EXPORT_HPP_
@@ -0,0 +1,186 @@
+/**
+ * @file  util-filtercache.cpp
+ * @brief Cache of decompressed/decrypted items stored in the project folder.
+ *
+ * Copyright (C) 2013-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <glibmm/checksum.h>
+#include <glibmm/miscutils.h>
+#include <giomm/file.h>
+#include <camoto/stream_file.hpp>
+#include <camoto/util.hpp> // make_unique
+#include "util-filtercache.hpp"
+#include "util-mmap.hpp"
+
+using namespace camoto;
+
+/// Number of bytes at the end of a cache file holding the length of the key.
+#define FILTERCACHE_KEYLEN_SIZE 4
+
+FilterCache::FilterCache(const std::string& path)
+	:	path(path)
+{
+}
+
+std::unique_ptr<stream::inout> FilterCache::open(const Key& key,
+	fn_open openFiltered)
+{
+	// Without a modification time there is no way to tell whether a cached copy
+	// is out of date.
+	if (key.mtime == 0) return openFiltered();
+
+	auto filename = this->getFilename(key);
+	auto keyString = keyToString(key);
+
+	// Changes to a cached copy have to go back through the filter to reach the
+	// item itself.  The cache file is out of date after that, and the item may
+	// not have reached the disk yet (e.g. if it's in an archive that hasn't
+	// been saved), so the file's modification time can't be relied on to tell.
+	// Remove the cache file instead, so it gets decoded again next time.
+	auto commit = [openFiltered, filename](const uint8_t *data,
+		stream::len len) {
+		auto s = openFiltered();
+		s->truncate(len);
+		s->seekp(0, stream::start);
+		s->write(data, len);
+		s->flush();
+		std::remove(filename.c_str());
+	};
+
+	// Each cache file is the decoded content, followed by the key it was made
+	// from and then the length of the key.
+	try {
+		auto cached = std::make_unique<MappedStream>(filename, commit);
+		stream::len lenFile = cached->size();
+		if (lenFile >= FILTERCACHE_KEYLEN_SIZE) {
+			uint8_t lenKeyBytes[FILTERCACHE_KEYLEN_SIZE];
+			cached->seekg(lenFile - FILTERCACHE_KEYLEN_SIZE, stream::start);
+			cached->read(lenKeyBytes, FILTERCACHE_KEYLEN_SIZE);
+			stream::len lenKey = lenKeyBytes[0] | (lenKeyBytes[1] << 8)
+				| (lenKeyBytes[2] << 16) | ((uint32_t)lenKeyBytes[3] << 24);
+			if (
+				(lenKey == keyString.length())
+				&& (lenKey <= lenFile - FILTERCACHE_KEYLEN_SIZE)
+			) {
+				stream::len lenContent = lenFile - FILTERCACHE_KEYLEN_SIZE - lenKey;
+				std::string fileKey(lenKey, '\0');
+				cached->seekg(lenContent, stream::start);
+				cached->read((uint8_t *)&fileKey[0], lenKey);
+				if (fileKey.compare(keyString) == 0) {
+					std::cout << "[cache] Using decoded copy of " << key.source << "\n";
+					cached->setRange(0, lenContent);
+					return cached;
+				}
+			}
+		}
+		std::cout << "[cache] Decoded copy of " << key.source
+			<< " is out of date\n";
+	} catch (const stream::error& e) {
+		// Not cached yet, or the cache file can't be read
+	}
+
+	auto content = openFiltered();
+	if (this->store(key, *content)) {
+		std::cout << "[cache] Stored decoded copy of " << key.source << "\n";
+	}
+	content->seekg(0, stream::start);
+	return content;
+}
+
+std::string FilterCache::getFilename(const Key& key) const
+{
+	return Glib::build_filename(this->path,
+		Glib::Checksum::compute_checksum(Glib::Checksum::CHECKSUM_SHA1,
+			key.source + "\n" + key.filter));
+}
+
+std::string FilterCache::keyToString(const Key& key)
+{
+	std::ostringstream ss;
+	ss << key.source << "\n" << key.offset << "\n" << key.size << "\n"
+		<< key.mtime << "\n" << key.filter;
+	return ss.str();
+}
+
+bool FilterCache::store(const Key& key, stream::inout& content)
+{
+	auto dir = Gio::File::create_for_path(this->path);
+	try {
+		if (!dir->query_exists()) dir->make_directory_with_parents();
+	} catch (const Gio::Error& e) {
+		// Another thread may have just created it
+		if (!dir->query_exists()) {
+			std::cerr << "[cache] Unable to create " << this->path << ": "
+				<< e.what() << std::endl;
+			return false;
+		}
+	}
+
+	// Write to a temporary file first, so a half written file is never picked
+	// up by another thread, and streams still using the old file keep working.
+	auto filename = this->getFilename(key);
+	std::ostringstream ssTemp;
+	ssTemp << filename << ".tmp" << std::this_thread::get_id();
+	auto filenameTemp = ssTemp.str();
+
+	auto keyString = keyToString(key);
+	uint32_t lenKey = keyString.length();
+	uint8_t lenKeyBytes[FILTERCACHE_KEYLEN_SIZE] = {
+		(uint8_t)lenKey,
+		(uint8_t)(lenKey >> 8),
+		(uint8_t)(lenKey >> 16),
+		(uint8_t)(lenKey >> 24),
+	};
+	try {
+		stream::output_file out(filenameTemp, true);
+		content.seekg(0, stream::start);
+		stream::copy(out, content);
+		out.write(keyString);
+		out.write(lenKeyBytes, FILTERCACHE_KEYLEN_SIZE);
+		out.flush();
+	} catch (const stream::error& e) {
+		std::cerr << "[cache] Unable to write " << filenameTemp << ": "
+			<< e.what() << std::endl;
+		std::remove(filenameTemp.c_str());
+		return false;
+	}
+#ifdef WIN32
+	// Windows won't rename over an existing file, so an out of date copy has to
+	// go first.  It may not exist yet.
+	if ((std::remove(filename.c_str()) != 0) && (errno != ENOENT)) {
+		int e = errno;
+		std::cerr << "[cache] Unable to replace " << filename << ": "
+			<< strerror(e) << std::endl;
+		std::remove(filenameTemp.c_str());
+		return false;
+	}
+#endif
+	if (std::rename(filenameTemp.c_str(), filename.c_str()) != 0) {
+		int e = errno;
+		std::cerr << "[cache] Unable to rename " << filenameTemp << " to "
+			<< filename << ": " << strerror(e) << std::endl;
+		std::remove(filenameTemp.c_str());
+		return false;
+	}
+	return true;
+}
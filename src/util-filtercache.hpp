@@ -0,0 +1,126 @@
+/**
+ * @file  util-filtercache.hpp
+ * @brief Cache of decompressed/decrypted items stored in the project folder.
+ *
+ * Copyright (C) 2013-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STUDIO_UTIL_FILTERCACHE_HPP_
+#define STUDIO_UTIL_FILTERCACHE_HPP_
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <camoto/stream.hpp>
+
+/// Keeps the decoded content of filtered items in files on disk.
+/**
+ * Items that are compressed or encrypted have to be decoded in full each time
+ * they are opened.  Once decoded, the content is written to a file in the
+ * cache folder, and the next time the item is opened the file is mapped
+ * instead, so it costs a read from the page cache rather than decoding it all
+ * again.
+ *
+ * Each item has its own cache file, which records where the item came from,
+ * its size and the modification time of the file holding it.  If any of these
+ * no longer match, the item has changed and is decoded again, replacing the
+ * old cache file.  Callers must pass an mtime of 0 while the source has
+ * changes that aren't on disk yet, as its modification time won't show them.
+ *
+ * This is safe to use from any thread.  Cache files are written under a
+ * temporary name and then renamed, so a file is never seen half written, and
+ * replacing one doesn't affect streams already reading it.
+ */
+class FilterCache
+{
+	public:
+		/// Identifies one filtered item, and the version of it on disk.
+		struct Key {
+			std::string source;         ///< Data file, plus archive member if any
+			camoto::stream::pos offset; ///< Offset of the item within source
+			camoto::stream::len size;   ///< Size of the item before decoding
+			uint64_t mtime;             ///< Modification time of source, in us
+			std::string filter;         ///< ID of the filter used to decode it
+		};
+
+		/// Open an item with its filter applied.
+		/**
+		 * @return The decoded item, which may be written to and flushed to save
+		 *   changes back to the item.
+		 *
+		 * @throw filter_error or stream::error if the item could not be decoded.
+		 */
+		typedef std::function<std::unique_ptr<camoto::stream::inout>()> fn_open;
+
+		/// Use a cache folder.
+		/**
+		 * @param path
+		 *   Folder to store the cache files in.  It is created the first time a
+		 *   file is added to the cache.
+		 */
+		FilterCache(const std::string& path);
+
+		/// Open a filtered item, from the cache if possible.
+		/**
+		 * @param key
+		 *   Item to open.  If mtime is 0, the cache is not used.
+		 *
+		 * @param openFiltered
+		 *   Function to decode the item if it isn't cached.  It is also used when
+		 *   changes to a cached item are flushed, to write them back through the
+		 *   filter.  It may be called from whichever thread does the flush, long
+		 *   after this call has returned.  The cache file is removed once the
+		 *   changes have been written.
+		 *
+		 * @return The decoded item.  If it was already cached this is a
+		 *   MappedStream over the cache file, otherwise it is the stream returned
+		 *   by openFiltered.
+		 *
+		 * @throw Anything thrown by openFiltered.
+		 */
+		std::unique_ptr<camoto::stream::inout> open(const Key& key,
+			fn_open openFiltered);
+
+	protected:
+		/// Work out the name of the cache file for an item.
+		/**
+		 * The name depends only on where the item is and which filter it uses,
+		 * so a newer version of an item replaces the older one.
+		 */
+		std::string getFilename(const Key& key) const;
+
+		/// Turn the parts of a key that must match into a string.
+		static std::string keyToString(const Key& key);
+
+		/// Write a decoded item to the cache.
+		/**
+		 * @param key
+		 *   Item being written.
+		 *
+		 * @param content
+		 *   Decoded item.  The position is left at the end.
+		 *
+		 * @return true if the item was written, false if the cache could not be
+		 *   used.  Errors are logged but not fatal, as the item can still be
+		 *   opened without the cache.
+		 */
+		bool store(const Key& key, camoto::stream::inout& content);
+
+		std::string path;
+};
+
+#endif // STUDIO_UTIL_FILTERCACHE_HPP_
@@ -18,69 +18,345 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <cassert>
 #include <iostream>
+#include <map>
+#include <mutex>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "main.hpp"
 #include "util-gfx.hpp"
 
 using namespace camoto::gamegraphics;
 
+/// Print a warning if an image uses colours past the end of its palette.
+/**
+ * @param maxIndex
+ *   Largest palette index in the image.
+ *
+ * @param pal
+ *   Palette the image was converted with.
+ */
+static void checkPaletteRange(uint8_t maxIndex,
+	const std::shared_ptr<const Palette>& pal)
+{
+	unsigned long palSize = pal ? pal->size() : 0;
+	if (maxIndex >= palSize) {
+		std::cerr << "Tried to load image with palette index " << (int)maxIndex
+			<< " but the palette only has " << palSize << " entries!" << std::endl;
+	}
+	return;
+}
+
+/// An image's pixels as read from libgamegraphics, ready to be converted.
+struct DecodedImage {
+	Point dims;                          ///< Image size, in pixels
+	Pixels pixels;                       ///< Palette indices, row by row
+	Pixels mask;                         ///< Image::Mask values, row by row
+	std::shared_ptr<const Palette> pal;  ///< Palette to draw the image with
+	std::shared_ptr<const PaletteLUT> lut; ///< Lookup table for pal
+};
+
+/// Read an image's pixels and work out which palette to draw them with.
+/**
+ * libgamegraphics only offers the pixels as new buffers, so these two
+ * allocations can't be avoided.  Everything after this writes straight into
+ * the destination.
+ */
+static DecodedImage decodeImage(const Image *ggimg, const Tileset *ggtileset)
+{
+	DecodedImage d;
+	d.dims = ggimg->dimensions();
+	d.pixels = ggimg->convert();
+	d.mask = ggimg->convert_mask();
+	d.pal = getImagePalette(ggimg, ggtileset);
+	d.lut = getPaletteLUT(d.pal);
+	return d;
+}
+
+/// Convert a decoded image into Cairo pixel memory, as for
+/// copyToCairoSurface().
+static void writeDecoded(const DecodedImage& d, unsigned char *dst,
+	int stride)
+{
+	uint8_t maxIndex = expandIndexedPixels(&d.pixels[0], &d.mask[0], d.dims,
+		*d.lut, dst, stride);
+	checkPaletteRange(maxIndex, d.pal);
+	return;
+}
+
+/// Find out whether every pixel of a decoded image is fully opaque.
+static bool isDecodedOpaque(const DecodedImage& d)
+{
+	return isIndexedOpaque(&d.pixels[0], &d.mask[0],
+		(unsigned long)d.dims.x * d.dims.y, *d.lut);
+}
+
 Cairo::RefPtr<Cairo::ImageSurface> createCairoSurface(const Image *ggimg,
 	const Tileset *ggtileset)
 {
-	auto rawimg = ggimg->convert();
-	auto rawmask = ggimg->convert_mask();
-	std::shared_ptr<const Palette> ggpal;
+	auto d = decodeImage(ggimg, ggtileset);
+
+	// Cairo can skip blending for images without any transparency.  Both
+	// formats use four bytes per pixel, so the pixels are written the same way.
+	auto cimg = Cairo::ImageSurface::create(
+		isDecodedOpaque(d) ? Cairo::FORMAT_RGB24 : Cairo::FORMAT_ARGB32,
+		d.dims.x, d.dims.y);
+	cimg->flush();
+	writeDecoded(d, cimg->get_data(), cimg->get_stride());
+	cimg->mark_dirty();
+	return cimg;
+}
+
+std::shared_ptr<const Palette> getImagePalette(const Image *ggimg,
+	const Tileset *ggtileset)
+{
 	if (ggimg->caps() & Image::Caps::HasPalette) {
-		ggpal = ggimg->palette();
-	} else {
-		if (ggtileset) {
-			// We are within a tileset, see if that has a palette
-			if (ggtileset->caps() & Tileset::Caps::HasPalette) {
-				ggpal = ggtileset->palette();
-			}
+		return ggimg->palette();
+	}
+	if (ggtileset) {
+		// We are within a tileset, see if that has a palette
+		if (ggtileset->caps() & Tileset::Caps::HasPalette) {
+			return ggtileset->palette();
 		}
 	}
-	if (!ggpal) {
-		// No image or tileset palette, use default for image colour depth
-		switch (ggimg->colourDepth()) {
-			case ColourDepth::Mono: ggpal = createPalette_DefaultMono(); break;
-			case ColourDepth::CGA: ggpal = createPalette_CGA(CGAPaletteType::CyanMagenta); break;
-			case ColourDepth::EGA: ggpal = createPalette_DefaultEGA(); break;
-			case ColourDepth::VGA: ggpal = createPalette_DefaultVGA(); break;
+
+	// No image or tileset palette, use default for image colour depth.  These
+	// are created the first time they are needed and then kept for good.
+	static std::mutex mtxDefault;
+	static std::shared_ptr<const Palette> palMono, palCGA, palEGA, palVGA;
+	std::lock_guard<std::mutex> lock(mtxDefault);
+	switch (ggimg->colourDepth()) {
+		case ColourDepth::Mono:
+			if (!palMono) palMono = createPalette_DefaultMono();
+			return palMono;
+		case ColourDepth::CGA:
+			if (!palCGA) palCGA = createPalette_CGA(CGAPaletteType::CyanMagenta);
+			return palCGA;
+		case ColourDepth::EGA:
+			if (!palEGA) palEGA = createPalette_DefaultEGA();
+			return palEGA;
+		case ColourDepth::VGA:
+			if (!palVGA) palVGA = createPalette_DefaultVGA();
+			return palVGA;
+	}
+	return nullptr;
+}
+
+std::shared_ptr<const PaletteLUT> getPaletteLUT(
+	const std::shared_ptr<const Palette>& pal)
+{
+	/// Lookup table for a palette, which is only valid while the palette exists.
+	struct CachedLUT {
+		std::weak_ptr<const Palette> pal;
+		std::shared_ptr<const PaletteLUT> lut;
+	};
+	static std::mutex mtxCache;
+	static std::map<const Palette *, CachedLUT> cache;
+
+	std::lock_guard<std::mutex> lock(mtxCache);
+	auto itCache = cache.find(pal.get());
+	if (itCache != cache.end()) {
+		// A palette freed since being cached could have been replaced by another
+		// at the same address, so check it's still the same object.
+		auto cachedPal = itCache->second.pal.lock();
+		if (cachedPal == pal) return itCache->second.lut;
+	}
+
+	// Drop tables for palettes that no longer exist before adding a new one
+	for (auto it = cache.begin(); it != cache.end(); ) {
+		if (it->second.pal.expired()) it = cache.erase(it);
+		else ++it;
+	}
+
+	auto lut = std::make_shared<PaletteLUT>();
+	unsigned int palSize = pal ? std::min<std::size_t>(pal->size(), 256) : 0;
+	for (unsigned int i = 0; i < 256; i++) {
+		if (palSize == 0) {
+			(*lut)[i] = 0;
+			continue;
 		}
+		auto& pix = (*pal)[(i < palSize) ? i : 0];
+		// Cairo expects each colour channel to be premultiplied by the alpha
+		unsigned int a = pix.alpha;
+		(*lut)[i] = (a << 24)
+			| (((pix.red   * a + 127) / 255) << 16)
+			| (((pix.green * a + 127) / 255) <<  8)
+			| (((pix.blue  * a + 127) / 255) <<  0);
 	}
+	cache[pal.get()] = {pal, lut};
+	return lut;
+}
+
+/// Value of an Image::Mask byte that makes the pixel transparent.
+static const uint8_t maskTransparent = (uint8_t)Image::Mask::Transparent;
 
-	auto dims = ggimg->dimensions();
-	auto cimg = Cairo::ImageSurface::create(Cairo::FORMAT_ARGB32, dims.x, dims.y);
-	auto cdata = cimg->get_data();
-	auto in = &rawimg[0];
-	auto in_mask = &rawmask[0];
-	auto stride = Cairo::ImageSurface::format_stride_for_width(Cairo::FORMAT_ARGB32, dims.x);
-	auto& defaultPalEntry = ggpal->at(0);
+/// Convert a row of indexed pixels into Cairo's ARGB32 format.
+/**
+ * Uses AVX2 or SSE2 if the compiler has been told the CPU supports them,
+ * otherwise one pixel at a time.  The mask is applied without any branching,
+ * by clearing transparent pixels to zero, which is the only valid colour for
+ * them in Cairo's premultiplied format.
+ *
+ * @param out
+ *   Destination, with room for width pixels.
+ *
+ * @param in
+ *   Palette indices, one byte per pixel.
+ *
+ * @param inMask
+ *   Image::Mask values, one byte per pixel.
+ *
+ * @param width
+ *   Number of pixels to convert.
+ *
+ * @param lut
+ *   Colour for each of the 256 possible palette indices, in ARGB32.
+ *
+ * @return The largest palette index in the row.
+ */
+static uint8_t expandRow(uint32_t *out, const uint8_t *in,
+	const uint8_t *inMask, unsigned int width, const uint32_t *lut)
+{
+	unsigned int x = 0;
+	uint8_t maxIndex = 0;
+
+#if defined(__AVX2__)
+	const __m256i vZero = _mm256_setzero_si256();
+	const __m256i vTransparent = _mm256_set1_epi32(maskTransparent);
+	__m256i vMax = vZero;
+	for (; x + 32 <= width; x += 32) {
+		vMax = _mm256_max_epu8(vMax,
+			_mm256_loadu_si256((const __m256i *)(in + x)));
+		for (unsigned int i = x; i < x + 32; i += 8) {
+			__m256i index = _mm256_cvtepu8_epi32(
+				_mm_loadl_epi64((const __m128i *)(in + i)));
+			__m256i mask = _mm256_cvtepu8_epi32(
+				_mm_loadl_epi64((const __m128i *)(inMask + i)));
+			__m256i pix = _mm256_i32gather_epi32((const int *)lut, index, 4);
+			// All bits set in each pixel that is not transparent
+			__m256i opaque = _mm256_cmpeq_epi32(
+				_mm256_and_si256(mask, vTransparent), vZero);
+			pix = _mm256_and_si256(pix, opaque);
+			_mm256_storeu_si256((__m256i *)(out + i), pix);
+		}
+	}
+	alignas(32) uint8_t lanes[32];
+	_mm256_store_si256((__m256i *)lanes, vMax);
+	for (auto l : lanes) maxIndex = std::max(maxIndex, l);
+
+#elif defined(__SSE2__)
+	const __m128i vZero = _mm_setzero_si128();
+	const __m128i vTransparent = _mm_set1_epi8(maskTransparent);
+	__m128i vMax = vZero;
+	for (; x + 16 <= width; x += 16) {
+		__m128i index = _mm_loadu_si128((const __m128i *)(in + x));
+		vMax = _mm_max_epu8(vMax, index);
+
+		// SSE2 has no gather instruction, so look up the colours one by one
+		alignas(16) uint32_t pix[16];
+		for (unsigned int i = 0; i < 16; i++) pix[i] = lut[in[x + i]];
+
+		// 0xFF in each byte that is not transparent, widened to 32 bits
+		__m128i opaque = _mm_cmpeq_epi8(_mm_and_si128(
+			_mm_loadu_si128((const __m128i *)(inMask + x)), vTransparent), vZero);
+		__m128i opaqueLo = _mm_unpacklo_epi8(opaque, opaque);
+		__m128i opaqueHi = _mm_unpackhi_epi8(opaque, opaque);
+		__m128i keep[4] = {
+			_mm_unpacklo_epi16(opaqueLo, opaqueLo),
+			_mm_unpackhi_epi16(opaqueLo, opaqueLo),
+			_mm_unpacklo_epi16(opaqueHi, opaqueHi),
+			_mm_unpackhi_epi16(opaqueHi, opaqueHi),
+		};
+		for (unsigned int i = 0; i < 4; i++) {
+			__m128i p = _mm_load_si128((const __m128i *)&pix[i * 4]);
+			p = _mm_and_si128(p, keep[i]);
+			_mm_storeu_si128((__m128i *)(out + x + i * 4), p);
+		}
+	}
+	alignas(16) uint8_t lanes[16];
+	_mm_store_si128((__m128i *)lanes, vMax);
+	for (auto l : lanes) maxIndex = std::max(maxIndex, l);
+#endif
+
+	// Any pixels left over, or the whole row without SIMD
+	for (; x < width; x++) {
+		uint8_t index = in[x];
+		maxIndex = std::max(maxIndex, index);
+		// All bits set if the pixel is not transparent, none if it is
+		uint32_t opaque = (uint32_t)((inMask[x] & maskTransparent) != 0) - 1;
+		out[x] = lut[index] & opaque;
+	}
+	return maxIndex;
+}
+
+uint8_t expandIndexedPixels(const uint8_t *pixels, const uint8_t *mask,
+	const Point& dims, const PaletteLUT& lut, unsigned char *dst, int stride)
+{
+	uint8_t maxIndex = 0;
 	for (unsigned int y = 0; y < dims.y; y++) {
-		uint32_t *out = (uint32_t*)&cdata[y * stride];
-		for (unsigned int x = 0; x < dims.x; x++) {
-			if (*in > ggpal->size()) {
-				std::cerr << "Tried to load image with palette index " << (int)*in
-					<< " but the palette only has " << ggpal->size() << " entries!" << std::endl;
-			}
-			auto& pix = (*in < ggpal->size()) ? ggpal->at(*in) : defaultPalEntry;
-			*out = (pix.red << 16)
-				| (pix.green  <<  8)
-				| (pix.blue   <<  0);
-
-			if (!(((Image::Mask)*in_mask) & Image::Mask::Transparent)) {
-				// Pixel is NOT transparent, use palette transparency
-				*out |= pix.alpha << 24;
-			}
-			out++;
-
-			in++;
-			in_mask++;
+		uint32_t *out = (uint32_t*)&dst[y * stride];
+		maxIndex = std::max(maxIndex,
+			expandRow(out, pixels, mask, dims.x, lut.data()));
+		pixels += dims.x;
+		mask += dims.x;
+	}
+	return maxIndex;
+}
+
+bool isIndexedOpaque(const uint8_t *pixels, const uint8_t *mask,
+	unsigned long count, const PaletteLUT& lut)
+{
+	uint8_t anyMask = 0;
+	for (unsigned long i = 0; i < count; i++) anyMask |= mask[i];
+	if (anyMask & maskTransparent) return false;
+
+	// Most palettes have no transparent colours, so the pixels themselves only
+	// need checking if this one does.
+	uint32_t alpha = 0xFF000000;
+	for (auto c : lut) alpha &= c;
+	if (alpha == 0xFF000000) return true;
+
+	for (unsigned long i = 0; i < count; i++) alpha &= lut[pixels[i]];
+	return (alpha | 0x00FFFFFF) == 0xFFFFFFFF;
+}
+
+bool copyToCairoSurface(const Image *ggimg, const Tileset *ggtileset,
+	unsigned char *cdata, int stride)
+{
+	auto d = decodeImage(ggimg, ggtileset);
+	writeDecoded(d, cdata, stride);
+	return isDecodedOpaque(d);
+}
+
+uint32_t averageColour(const Cairo::RefPtr<Cairo::ImageSurface>& surface,
+	const Rect& rect)
+{
+	if ((rect.width <= 0) || (rect.height <= 0)) return 0;
+
+	surface->flush();
+	auto data = surface->get_data();
+	int stride = surface->get_stride();
+	unsigned long total[4] = {0, 0, 0, 0};
+	for (long y = rect.y; y < (long)rect.y + rect.height; y++) {
+		const uint32_t *in = (const uint32_t *)&data[y * stride] + rect.x;
+		for (long x = 0; x < (long)rect.width; x++) {
+			uint32_t pix = *in++;
+			// Fully transparent pixels only add to the count, as their colour
+			// values are meaningless.
+			if ((pix >> 24) == 0) continue;
+			for (int c = 0; c < 4; c++) total[c] += (pix >> (c * 8)) & 0xFF;
 		}
 	}
-	cimg->mark_dirty();
-	return cimg;
+
+	unsigned long count = (unsigned long)rect.width * rect.height;
+	uint32_t avg = 0;
+	for (int c = 0; c < 4; c++) avg |= (uint32_t)(total[c] / count) << (c * 8);
+	return avg;
 }
 
 Cairo::RefPtr<Cairo::ImageSurface> createCairoSurface(UtilImage img)
@@ -88,6 +364,7 @@ Cairo::RefPtr<Cairo::ImageSurface> createCairoSurface(UtilImage img)
 	std::string filename;
 	switch (img) {
 		case UtilImage::HexDigits: filename = "hexdigits-small.png"; break;
+		case UtilImage::UnknownTile: filename = "unknown-tile.png"; break;
 	}
 	assert(!filename.empty());
 	return Cairo::ImageSurface::create_from_png(
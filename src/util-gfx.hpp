@@ -21,10 +21,46 @@
 #ifndef _UTIL_GFX_HPP_
 #define _UTIL_GFX_HPP_
 
+#include <array>
+#include <memory>
 #include <cairomm/surface.h>
 #include <camoto/gamegraphics/image.hpp>
 #include <camoto/gamegraphics/tileset.hpp>
 
+/// Colour for each of the 256 possible palette indices, in Cairo's ARGB32
+/// format.  Indices past the end of the palette use the first colour.
+typedef std::array<uint32_t, 256> PaletteLUT;
+
+/// Work out which palette an image should be drawn with.
+/**
+ * @param ggimg
+ *   Image to be drawn.
+ *
+ * @param ggtileset
+ *   Optional tileset the image came from, as for createCairoSurface().
+ *
+ * @return The image's own palette, or failing that the tileset's, or failing
+ *   that the default palette for the image's colour depth.  Default palettes
+ *   are only created once and then shared.
+ */
+std::shared_ptr<const camoto::gamegraphics::Palette> getImagePalette(
+	const camoto::gamegraphics::Image *ggimg,
+	const camoto::gamegraphics::Tileset *ggtileset);
+
+/// Get the lookup table used to convert pixels in a palette into Cairo colours.
+/**
+ * Tables are cached for as long as the palette exists, so converting every
+ * image in a tileset only builds one table.  This function may be called from
+ * any thread.
+ *
+ * @param pal
+ *   Palette to convert.
+ *
+ * @return The lookup table for the palette.
+ */
+std::shared_ptr<const PaletteLUT> getPaletteLUT(
+	const std::shared_ptr<const camoto::gamegraphics::Palette>& pal);
+
 /// Copy a libgamegraphics Image instance into a new Cairo surface.
 /**
  * @param ggimg
@@ -36,15 +72,107 @@
  *   palette if the image does not contain its own and shares the same palette
  *   as the other tiles in the tileset.
  *
- * @return A Cairo ImageSurface matching the source image.
+ * @return A Cairo ImageSurface matching the source image, with premultiplied
+ *   alpha.  This is in FORMAT_RGB24 if the image has no transparent pixels, so
+ *   Cairo can draw it without blending, otherwise in FORMAT_ARGB32.
  */
 Cairo::RefPtr<Cairo::ImageSurface> createCairoSurface(
 	const camoto::gamegraphics::Image *ggimg,
 	const camoto::gamegraphics::Tileset *ggtileset);
 
+/// Copy a libgamegraphics Image instance into existing Cairo pixel memory.
+/**
+ * This allows a number of images to be written into different parts of the
+ * same surface.  The caller must call flush() on the surface beforehand and
+ * mark_dirty() afterwards.
+ *
+ * @param ggimg
+ *   Source image.
+ *
+ * @param ggtileset
+ *   Optional tileset the image came from, as for createCairoSurface().
+ *
+ * @param dst
+ *   Pointer to the top-left pixel of the area to write, in Cairo's ARGB32
+ *   format.  The area must be at least as large as the image.
+ *
+ * @param stride
+ *   Number of bytes from the start of one row of dst to the start of the next.
+ *
+ * @return true if every pixel is fully opaque.
+ */
+bool copyToCairoSurface(const camoto::gamegraphics::Image *ggimg,
+	const camoto::gamegraphics::Tileset *ggtileset, unsigned char *dst,
+	int stride);
+
+/// Convert 8-bit indexed pixels already in memory into Cairo pixel memory.
+/**
+ * This is the conversion done by copyToCairoSurface(), for callers that
+ * already have the pixel data and so can skip decoding the image again.
+ *
+ * @param pixels
+ *   Palette indices, one byte per pixel, dims.x bytes per row with no padding.
+ *
+ * @param mask
+ *   Image::Mask values in the same layout as pixels.
+ *
+ * @param dims
+ *   Size of the image, in pixels.
+ *
+ * @param lut
+ *   Palette to use, from getPaletteLUT().
+ *
+ * @param dst
+ *   Pointer to the top-left pixel of the area to write, in Cairo's ARGB32
+ *   format, as for copyToCairoSurface().
+ *
+ * @param stride
+ *   Number of bytes from the start of one row of dst to the start of the next.
+ *
+ * @return The largest palette index used, so the caller can report any that
+ *   are past the end of the palette.
+ */
+uint8_t expandIndexedPixels(const uint8_t *pixels, const uint8_t *mask,
+	const camoto::gamegraphics::Point& dims, const PaletteLUT& lut,
+	unsigned char *dst, int stride);
+
+/// Find out whether any 8-bit indexed pixels will be transparent.
+/**
+ * @param pixels
+ *   Palette indices, one byte per pixel.
+ *
+ * @param mask
+ *   Image::Mask values, one byte per pixel.
+ *
+ * @param count
+ *   Number of pixels to check.
+ *
+ * @param lut
+ *   Palette the pixels will be drawn with, from getPaletteLUT().
+ *
+ * @return true if every pixel is fully opaque.
+ */
+bool isIndexedOpaque(const uint8_t *pixels, const uint8_t *mask,
+	unsigned long count, const PaletteLUT& lut);
+
+/// Find the average colour of part of a Cairo surface.
+/**
+ * @param surface
+ *   Surface to read.
+ *
+ * @param rect
+ *   Area of the surface to average.
+ *
+ * @return Average of every pixel in Cairo's ARGB32 format, including alpha,
+ *   so an area that is half transparent gives a colour with half the alpha.
+ */
+uint32_t averageColour(const Cairo::RefPtr<Cairo::ImageSurface>& surface,
+	const camoto::gamegraphics::Rect& rect);
+
 /// Types of images that can be loaded.
 enum class UtilImage {
 	HexDigits,
+	UnknownTile,
 };
 
 /// Load a graphic from a Camoto data .png file.
@@ -0,0 +1,308 @@
+/**
+ * @file  util-mmap.cpp
+ * @brief Stream reading straight from a memory-mapped file.
+ *
+ * Copyright (C) 2013-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <thread>
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include <camoto/stream_file.hpp>
+#include "util-mmap.hpp"
+
+using namespace camoto;
+
+MappedFile::MappedFile(const std::string& filename, fn_commit commit)
+	:	map(nullptr),
+		lenMap(0),
+		start(0),
+		lenData(0),
+		inMemory(false),
+		changed(false),
+		commit(commit)
+{
+#ifndef WIN32
+	int fd = ::open(filename.c_str(), O_RDONLY);
+	if (fd < 0) {
+		throw stream::open_error("Unable to open " + filename + ": "
+			+ strerror(errno));
+	}
+	struct stat st;
+	if (::fstat(fd, &st) < 0) {
+		int e = errno;
+		::close(fd);
+		throw stream::open_error("Unable to open " + filename + ": "
+			+ strerror(e));
+	}
+	this->lenMap = st.st_size;
+	if (this->lenMap) {
+		// Private and writable, so changes are copied by the kernel page by page
+		// and never reach the file.
+		void *p = ::mmap(nullptr, this->lenMap, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED) {
+			int e = errno;
+			::close(fd);
+			throw stream::open_error("Unable to map " + filename + ": "
+				+ strerror(e));
+		}
+		this->map = static_cast<uint8_t *>(p);
+	}
+	// The mapping stays valid without the file descriptor
+	::close(fd);
+	this->lenData = this->lenMap;
+#else
+	// No mmap(), so read the whole file into memory instead
+	try {
+		stream::input_file in(filename);
+		this->copy.resize(in.size());
+		in.read(this->copy.data(), this->copy.size());
+	} catch (const stream::error& e) {
+		throw stream::open_error("Unable to open " + filename + ": " + e.what());
+	}
+	this->inMemory = true;
+	this->lenData = this->copy.size();
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+	this->unmap();
+}
+
+MappedFile::fn_commit MappedFile::saveToFile(const std::string& filename)
+{
+	return [filename](const uint8_t *data, stream::len len) {
+		// Several threads could be saving the same file at once
+		std::ostringstream ssTemp;
+		ssTemp << filename << ".tmp" << std::this_thread::get_id();
+		auto filenameTemp = ssTemp.str();
+		try {
+			stream::output_file out(filenameTemp, true);
+			out.write(data, len);
+			out.flush();
+		} catch (const stream::error& e) {
+			std::remove(filenameTemp.c_str());
+			throw stream::write_error("Unable to write " + filenameTemp + ": "
+				+ e.what());
+		}
+#ifndef WIN32
+		struct stat st;
+		if (::stat(filename.c_str(), &st) == 0) {
+			::chmod(filenameTemp.c_str(), st.st_mode & 07777);
+		}
+#else
+		// Windows won't rename over an existing file
+		std::remove(filename.c_str());
+#endif
+		if (std::rename(filenameTemp.c_str(), filename.c_str()) != 0) {
+			int e = errno;
+			std::remove(filenameTemp.c_str());
+			throw stream::write_error("Unable to replace " + filename + ": "
+				+ strerror(e));
+		}
+	};
+}
+
+bool MappedFile::isChanged()
+{
+	std::lock_guard<std::mutex> lock(this->mtx);
+	return this->changed;
+}
+
+void MappedFile::reserve(stream::len len)
+{
+	if (!this->commit) {
+		throw stream::write_error("This stream is read-only.");
+	}
+	if (this->inMemory) {
+		if (len > this->copy.size()) this->copy.resize(len);
+		return;
+	}
+	// Anything that still fits can be changed in place, as the mapping is
+	// private.
+	if (len <= this->lenMap - this->start) return;
+
+	this->copy.resize(len);
+	if (this->lenData) {
+		memcpy(this->copy.data(), this->map + this->start, this->lenData);
+	}
+	this->inMemory = true;
+	this->unmap();
+	this->start = 0;
+	return;
+}
+
+uint8_t *MappedFile::data()
+{
+	if (this->inMemory) return this->copy.data();
+	return this->map + this->start;
+}
+
+void MappedFile::unmap()
+{
+#ifndef WIN32
+	if (this->map) ::munmap(this->map, this->lenMap);
+#endif
+	this->map = nullptr;
+	this->lenMap = 0;
+	return;
+}
+
+MappedStream::MappedStream(const std::string& filename, fn_commit commit)
+	:	file(std::make_shared<MappedFile>(filename, commit)),
+		offset(0)
+{
+}
+
+MappedStream::MappedStream(std::shared_ptr<MappedFile> file)
+	:	file(file),
+		offset(0)
+{
+}
+
+void MappedStream::setRange(stream::pos start, stream::len len)
+{
+	auto& f = *this->file;
+	std::lock_guard<std::mutex> lock(f.mtx);
+	stream::len lenFile = f.inMemory ? f.copy.size() : f.lenMap;
+	if ((start > lenFile) || (len > lenFile - start)) {
+		throw stream::seek_error("Range is past the end of the mapped file.");
+	}
+	if (f.inMemory) {
+		// The file was read into memory instead, so drop the rest of it
+		f.copy.resize(start + len);
+		f.copy.erase(f.copy.begin(), f.copy.begin() + start);
+	} else {
+		f.start = start;
+	}
+	f.lenData = len;
+	this->offset = 0;
+	return;
+}
+
+stream::len MappedStream::try_read(uint8_t *buffer, stream::len len)
+{
+	auto& f = *this->file;
+	std::lock_guard<std::mutex> lock(f.mtx);
+	// Another stream may have made the file shorter
+	if (this->offset >= f.lenData) return 0;
+	len = std::min(len, f.lenData - this->offset);
+	memcpy(buffer, f.data() + this->offset, len);
+	this->offset += len;
+	return len;
+}
+
+void MappedStream::seekg(stream::delta off, stream::seek_from from)
+{
+	this->seek(off, from);
+	return;
+}
+
+stream::pos MappedStream::tellg() const
+{
+	return this->offset;
+}
+
+stream::len MappedStream::size() const
+{
+	std::lock_guard<std::mutex> lock(this->file->mtx);
+	return this->file->lenData;
+}
+
+stream::len MappedStream::try_write(const uint8_t *buffer, stream::len len)
+{
+	if (len == 0) return 0;
+	auto& f = *this->file;
+	std::lock_guard<std::mutex> lock(f.mtx);
+	stream::len end = this->offset + len;
+	f.reserve(end);
+	if (this->offset > f.lenData) {
+		// Another stream has made the file shorter, so fill the gap as if the
+		// file had been extended
+		memset(f.data() + f.lenData, 0, this->offset - f.lenData);
+	}
+	memcpy(f.data() + this->offset, buffer, len);
+	this->offset = end;
+	if (end > f.lenData) f.lenData = end;
+	f.changed = true;
+	return len;
+}
+
+void MappedStream::seekp(stream::delta off, stream::seek_from from)
+{
+	this->seek(off, from);
+	return;
+}
+
+stream::pos MappedStream::tellp() const
+{
+	return this->offset;
+}
+
+void MappedStream::truncate(stream::pos size)
+{
+	auto& f = *this->file;
+	std::lock_guard<std::mutex> lock(f.mtx);
+	f.reserve(size);
+	if (size > f.lenData) {
+		// New space at the end reads as zero, as when a file is extended
+		memset(f.data() + f.lenData, 0, size - f.lenData);
+	}
+	f.lenData = size;
+	if (this->offset > size) this->offset = size;
+	f.changed = true;
+	return;
+}
+
+void MappedStream::flush()
+{
+	auto& f = *this->file;
+	std::lock_guard<std::mutex> lock(f.mtx);
+	if (!f.changed) return;
+	f.commit(f.data(), f.lenData);
+	f.changed = false;
+	return;
+}
+
+void MappedStream::seek(stream::delta off, stream::seek_from from)
+{
+	auto& f = *this->file;
+	std::lock_guard<std::mutex> lock(f.mtx);
+	stream::delta target;
+	switch (from) {
+		case stream::start: target = off; break;
+		case stream::cur:   target = this->offset + off; break;
+		case stream::end:   target = f.lenData + off; break;
+		default:            target = -1; break;
+	}
+	if ((target < 0) || ((stream::pos)target > f.lenData)) {
+		throw stream::seek_error("Cannot seek past the start or end of the "
+			"stream.");
+	}
+	this->offset = target;
+	return;
+}
@@ -0,0 +1,202 @@
+/**
+ * @file  util-mmap.hpp
+ * @brief Stream reading straight from a memory-mapped file.
+ *
+ * Copyright (C) 2013-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef STUDIO_UTIL_MMAP_HPP_
+#define STUDIO_UTIL_MMAP_HPP_
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <camoto/stream.hpp>
+
+/// A memory-mapped file, keeping any changes in memory until they are
+/// committed.
+/**
+ * The content is read and changed through MappedStream.  Any number of
+ * streams can share one MappedFile, each with its own position.  They all see
+ * each other's changes, and every call locks the file, so the streams can be
+ * used on different threads.
+ *
+ * The file is mapped privately, so changes never reach it directly.  Pages
+ * are copied by the kernel as they are first written to, and the whole
+ * content is moved into memory only if it has to grow past the end of the
+ * mapping.  A flush() of any stream passes the changed content to a commit
+ * function, which decides where it gets saved.
+ *
+ * Nothing here writes to the mapped file in place.  Anything else that does
+ * may show through in pages that haven't been changed yet, or crash the
+ * program with SIGBUS if it makes the file shorter, so anything writing to a
+ * mapped file should do so through the same MappedFile.
+ *
+ * mmap() is only used on POSIX systems.  On Windows the whole file is read
+ * into memory when it is opened, which works the same way but without the
+ * savings.
+ */
+class MappedFile
+{
+	public:
+		/// Called by flush() to save the file's content.
+		/**
+		 * @param data
+		 *   Entire content of the file.
+		 *
+		 * @param len
+		 *   Number of bytes in data.
+		 */
+		typedef std::function<void(const uint8_t *data, camoto::stream::len len)>
+			fn_commit;
+
+		/// Map a file.
+		/**
+		 * @param filename
+		 *   File to map.
+		 *
+		 * @param commit
+		 *   Function to save any changes when flush() is called.  If this is
+		 *   empty the file is read-only, and any attempt to change it throws
+		 *   stream::write_error.
+		 *
+		 * @throw stream::open_error if the file could not be opened or mapped.
+		 */
+		MappedFile(const std::string& filename, fn_commit commit);
+
+		~MappedFile();
+
+		/// Get a commit function that saves changes back to a file.
+		/**
+		 * The new content is written to a temporary file, which then replaces
+		 * the original with the same permissions (on POSIX systems).  Any other
+		 * MappedFile still mapping the original keeps seeing its old content
+		 * rather than a half written file, and can't crash if the file gets
+		 * shorter.
+		 *
+		 * @param filename
+		 *   File to replace.
+		 *
+		 * @return Function to pass to the constructor.  It throws
+		 *   stream::write_error if the file could not be replaced.
+		 */
+		static fn_commit saveToFile(const std::string& filename);
+
+		/// Are there changes that haven't been committed yet?
+		bool isChanged();
+
+	protected:
+		friend class MappedStream;
+
+		/// Make sure the file can hold a certain number of bytes.
+		/**
+		 * The content is moved out of the mapping and into memory if it won't
+		 * fit.  The file's size is not changed.  mtx must be held.
+		 *
+		 * @param len
+		 *   Number of bytes needed.
+		 *
+		 * @throw stream::write_error if the file is read-only.
+		 */
+		void reserve(camoto::stream::len len);
+
+		/// Start of the current content, either in the mapping or in copy.
+		uint8_t *data();
+
+		/// Release the mapping, if there is one.
+		void unmap();
+
+		uint8_t *map;                ///< Start of the mapping, or null if empty
+		camoto::stream::len lenMap;  ///< Size of the mapping
+		camoto::stream::pos start;   ///< Offset of the content within the mapping
+		camoto::stream::len lenData; ///< Current size of the content
+		bool inMemory;               ///< true once the content is in copy
+		std::vector<uint8_t> copy;   ///< Content, once it has outgrown the map
+		bool changed;                ///< true if there are changes to commit
+		fn_commit commit;
+		std::mutex mtx;              ///< Held during every MappedStream call
+};
+
+/// Stream over a MappedFile.
+/**
+ * Reads are a copy out of the mapping, so there is no system call per read
+ * and the data comes straight from the page cache.
+ */
+class MappedStream: virtual public camoto::stream::inout
+{
+	public:
+		typedef MappedFile::fn_commit fn_commit;
+
+		/// Map a file for use by this stream alone.
+		/**
+		 * @param filename
+		 *   File to map.
+		 *
+		 * @param commit
+		 *   Function to save any changes, as for MappedFile.
+		 *
+		 * @throw stream::open_error if the file could not be opened or mapped.
+		 */
+		MappedStream(const std::string& filename, fn_commit commit);
+
+		/// Open a stream over a file that may be shared with other streams.
+		/**
+		 * @param file
+		 *   File to use.  The stream starts at offset 0.
+		 */
+		MappedStream(std::shared_ptr<MappedFile> file);
+
+		/// Limit the stream to part of the file, such as to skip a header.
+		/**
+		 * @param start
+		 *   Offset into the file of the first byte to include.  This becomes
+		 *   offset 0 in the stream.
+		 *
+		 * @param len
+		 *   Number of bytes to include.
+		 *
+		 * @pre The file is not shared with any other stream, and has not been
+		 *   changed yet.
+		 *
+		 * @throw stream::seek_error if the range goes past the end of the file.
+		 */
+		void setRange(camoto::stream::pos start, camoto::stream::len len);
+
+		virtual camoto::stream::len try_read(uint8_t *buffer,
+			camoto::stream::len len);
+		virtual void seekg(camoto::stream::delta off, camoto::stream::seek_from from);
+		virtual camoto::stream::pos tellg() const;
+		virtual camoto::stream::len size() const;
+
+		virtual camoto::stream::len try_write(const uint8_t *buffer,
+			camoto::stream::len len);
+		virtual void seekp(camoto::stream::delta off, camoto::stream::seek_from from);
+		virtual camoto::stream::pos tellp() const;
+		virtual void truncate(camoto::stream::pos size);
+		virtual void flush();
+
+	protected:
+		/// Move to a new position, shared by seekg() and seekp().
+		void seek(camoto::stream::delta off, camoto::stream::seek_from from);
+
+		std::shared_ptr<MappedFile> file;
+		camoto::stream::pos offset;  ///< Current read/write position
+};
+
+#endif // STUDIO_UTIL_MMAP_HPP_
@@ -0,0 +1,724 @@
+/**
+ * @file  util-png.cpp
+ * @brief Import and export images and tilesets as .png files.
+ *
+ * Copyright (C) 2013-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <png.h>
+#include <glibmm/i18n.h>
+#include "exceptions.hpp"
+#include "util-gfx.hpp"
+#include "util-png.hpp"
+
+using namespace camoto::gamegraphics;
+
+static const uint8_t maskTransparent = (uint8_t)Image::Mask::Transparent;
+
+/// Number of cells in the colour cube.
+#define CUBE_CELLS (1 << (3 * PNG_CUBE_BITS))
+
+/// Get the cell of the colour cube a colour falls in.
+static inline unsigned int cubeCell(uint8_t red, uint8_t green, uint8_t blue)
+{
+	return ((red >> (8 - PNG_CUBE_BITS)) << (2 * PNG_CUBE_BITS))
+		| ((green >> (8 - PNG_CUBE_BITS)) << PNG_CUBE_BITS)
+		| (blue >> (8 - PNG_CUBE_BITS));
+}
+
+PaletteMatcher::PaletteMatcher(const Palette& pal)
+	:	cube(CUBE_CELLS, 0),
+		crowded(CUBE_CELLS, false)
+{
+	unsigned int numColours = std::min<unsigned long>(pal.size(), 256);
+	for (unsigned int i = 0; i < numColours; i++) {
+		auto& p = pal[i];
+		this->colours.push_back((p.red << 16) | (p.green << 8) | p.blue);
+		this->usable.push_back(p.alpha != 0);
+	}
+
+	// Give each palette entry the cell it falls in, so exact matches always find
+	// it.  Cells holding more than one entry are searched in full instead.
+	std::vector<bool> owned(CUBE_CELLS, false);
+	for (unsigned int i = 0; i < numColours; i++) {
+		if (!this->usable[i]) continue;
+		auto& p = pal[i];
+		unsigned int cell = cubeCell(p.red, p.green, p.blue);
+		if (owned[cell]) {
+			this->crowded[cell] = true;
+		} else {
+			owned[cell] = true;
+			this->cube[cell] = i;
+		}
+	}
+
+	// Every other cell gets the entry nearest its centre
+	const unsigned int half = 1 << (7 - PNG_CUBE_BITS);
+	for (unsigned int cell = 0; cell < CUBE_CELLS; cell++) {
+		if (owned[cell]) continue;
+		uint8_t red = ((cell >> (2 * PNG_CUBE_BITS)) << (8 - PNG_CUBE_BITS)) + half;
+		uint8_t green = (((cell >> PNG_CUBE_BITS) & ((1 << PNG_CUBE_BITS) - 1))
+			<< (8 - PNG_CUBE_BITS)) + half;
+		uint8_t blue = ((cell & ((1 << PNG_CUBE_BITS) - 1))
+			<< (8 - PNG_CUBE_BITS)) + half;
+		this->cube[cell] = this->search(red, green, blue);
+	}
+}
+
+uint8_t PaletteMatcher::match(uint8_t red, uint8_t green, uint8_t blue) const
+{
+	unsigned int cell = cubeCell(red, green, blue);
+	if (this->crowded[cell]) return this->search(red, green, blue);
+	return this->cube[cell];
+}
+
+uint8_t PaletteMatcher::search(uint8_t red, uint8_t green, uint8_t blue) const
+{
+	uint8_t best = 0;
+	long bestDist = LONG_MAX;
+	for (unsigned int i = 0; i < this->colours.size(); i++) {
+		if (!this->usable[i]) continue;
+		long dr = (long)((this->colours[i] >> 16) & 0xFF) - red;
+		long dg = (long)((this->colours[i] >> 8) & 0xFF) - green;
+		long db = (long)(this->colours[i] & 0xFF) - blue;
+		long dist = dr * dr + dg * dg + db * db;
+		if (dist < bestDist) {
+			best = i;
+			bestDist = dist;
+			if (dist == 0) break;
+		}
+	}
+	return best;
+}
+
+/// libpng error callback.  libpng must not regain control, so this throws.
+static void pngError(png_structp png, png_const_charp msg)
+{
+	throw EFailure(Glib::ustring::compose(_("PNG error: %1"), msg));
+}
+
+/// libpng warning callback.
+static void pngWarning(png_structp png, png_const_charp msg)
+{
+	std::cerr << "[util-png] " << msg << std::endl;
+	return;
+}
+
+/// Pick the palette index to use for transparent pixels in an indexed .png.
+/**
+ * @param pal
+ *   Palette the image uses.
+ *
+ * @return The first fully transparent palette entry, or failing that the
+ *   first unused entry, or -1 if all 256 entries are opaque colours.
+ */
+static int transparentIndex(const Palette& pal)
+{
+	for (unsigned int i = 0; i < pal.size(); i++) {
+		if (pal[i].alpha == 0) return i;
+	}
+	if (pal.size() < 256) return pal.size();
+	return -1;
+}
+
+/// Writes a .png file one row at a time.
+class PNGWriter
+{
+	public:
+		/// Prepare to write.
+		/**
+		 * @param pal
+		 *   Palette of the pixels that will be written.
+		 *
+		 * @param indexed
+		 *   true to write an indexed .png with pal as its palette, false to write
+		 *   a full colour .png with an alpha channel.
+		 *
+		 * @param transIndex
+		 *   Index used for transparent pixels in an indexed .png, from
+		 *   transparentIndex().  Must be valid if indexed is true and any pixels
+		 *   will be transparent.
+		 */
+		PNGWriter(const Palette& pal, bool indexed, int transIndex)
+			:	f(nullptr),
+				png(nullptr),
+				info(nullptr),
+				indexed(indexed),
+				transIndex(transIndex)
+		{
+			// Straight RGBA for each palette entry, for full colour output.  Entries
+			// past the end of the palette use the first colour, as on screen.
+			unsigned int numColours = std::min<unsigned long>(pal.size(), 256);
+			for (unsigned int i = 0; i < 256; i++) {
+				if (numColours == 0) {
+					std::memset(&this->rgba[i * 4], 0, 4);
+					continue;
+				}
+				auto& p = pal[i < numColours ? i : 0];
+				this->rgba[i * 4 + 0] = p.red;
+				this->rgba[i * 4 + 1] = p.green;
+				this->rgba[i * 4 + 2] = p.blue;
+				this->rgba[i * 4 + 3] = p.alpha;
+			}
+		}
+
+		~PNGWriter()
+		{
+			if (this->png) png_destroy_write_struct(&this->png, &this->info);
+			if (this->f) std::fclose(this->f);
+		}
+
+		/// Create the file and write the header.
+		/**
+		 * @param filename
+		 *   File to create, replacing any existing file.
+		 *
+		 * @param dims
+		 *   Size of the image, in pixels.
+		 *
+		 * @param pal
+		 *   Palette, as passed to the constructor.
+		 */
+		void start(const std::string& filename, const Point& dims,
+			const Palette& pal)
+		{
+			this->f = std::fopen(filename.c_str(), "wb");
+			if (!this->f) {
+				throw EFailure(Glib::ustring::compose(_("Unable to create %1: %2"),
+					filename, std::strerror(errno)));
+			}
+			this->png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr,
+				pngError, pngWarning);
+			if (this->png) this->info = png_create_info_struct(this->png);
+			if (!this->info) {
+				throw EFailure(_("Out of memory while creating .png file."));
+			}
+			png_init_io(this->png, this->f);
+
+			png_set_IHDR(this->png, this->info, dims.x, dims.y, 8,
+				this->indexed ? PNG_COLOR_TYPE_PALETTE : PNG_COLOR_TYPE_RGB_ALPHA,
+				PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+				PNG_FILTER_TYPE_DEFAULT);
+
+			if (this->indexed) {
+				unsigned int numColours = std::min<unsigned long>(pal.size(), 256);
+				unsigned int numEntries = std::max<int>(numColours,
+					this->transIndex + 1);
+				png_color plte[256];
+				png_byte trans[256];
+				int numTrans = 0;
+				for (unsigned int i = 0; i < numEntries; i++) {
+					if (i < numColours) {
+						plte[i].red = pal[i].red;
+						plte[i].green = pal[i].green;
+						plte[i].blue = pal[i].blue;
+						trans[i] = pal[i].alpha;
+					} else {
+						plte[i].red = plte[i].green = plte[i].blue = 0;
+						trans[i] = 0xFF;
+					}
+					if ((int)i == this->transIndex) trans[i] = 0;
+					// The tRNS chunk only needs to go up to the last non-opaque entry
+					if (trans[i] != 0xFF) numTrans = i + 1;
+				}
+				png_set_PLTE(this->png, this->info, plte, numEntries);
+				if (numTrans) {
+					png_set_tRNS(this->png, this->info, trans, numTrans, nullptr);
+				}
+			}
+			png_write_info(this->png, this->info);
+
+			this->row.resize((unsigned long)dims.x * (this->indexed ? 1 : 4));
+			return;
+		}
+
+		/// Convert one row of 8-bit pixels and write it out.
+		/**
+		 * @param pixels
+		 *   Palette indices, one byte per pixel.
+		 *
+		 * @param mask
+		 *   Image::Mask values, one byte per pixel.
+		 */
+		void writeRow(const uint8_t *pixels, const uint8_t *mask)
+		{
+			uint8_t *out = this->row.data();
+			if (this->indexed) {
+				unsigned long width = this->row.size();
+				for (unsigned long x = 0; x < width; x++) {
+					out[x] = (mask[x] & maskTransparent) ? this->transIndex : pixels[x];
+				}
+			} else {
+				unsigned long width = this->row.size() / 4;
+				for (unsigned long x = 0; x < width; x++) {
+					if (mask[x] & maskTransparent) {
+						std::memset(&out[x * 4], 0, 4);
+					} else {
+						std::memcpy(&out[x * 4], &this->rgba[pixels[x] * 4], 4);
+					}
+				}
+			}
+			png_write_row(this->png, out);
+			return;
+		}
+
+		/// Finish the file once every row has been written.
+		void finish()
+		{
+			png_write_end(this->png, nullptr);
+			png_destroy_write_struct(&this->png, &this->info);
+			std::FILE *f = this->f;
+			this->f = nullptr;
+			if (std::fclose(f) != 0) {
+				throw EFailure(Glib::ustring::compose(_("Unable to write .png file: %1"),
+					std::strerror(errno)));
+			}
+			return;
+		}
+
+	protected:
+		std::FILE *f;
+		png_structp png;
+		png_infop info;
+		bool indexed;             ///< true for PNG_COLOR_TYPE_PALETTE
+		int transIndex;           ///< Index written for transparent pixels
+		uint8_t rgba[256 * 4];    ///< Colour of each index, for full colour output
+		std::vector<uint8_t> row; ///< One row in the .png's format
+};
+
+/// Reads a .png file one row at a time, mapping its colours to a palette.
+class PNGReader
+{
+	public:
+		PNGReader()
+			:	f(nullptr),
+				png(nullptr),
+				info(nullptr),
+				nextRow(0)
+		{
+		}
+
+		/// Open the file and read the header.
+		/**
+		 * @param filename
+		 *   File to read.
+		 *
+		 * @param pal
+		 *   Palette to map the colours in the .png to.
+		 *
+		 * @post dims is set to the size of the image.
+		 */
+		void open(const std::string& filename, const Palette& pal)
+		{
+			this->f = std::fopen(filename.c_str(), "rb");
+			if (!this->f) {
+				throw EFailure(Glib::ustring::compose(_("Unable to open %1: %2"),
+					filename, std::strerror(errno)));
+			}
+			png_byte sig[8];
+			if (
+				(std::fread(sig, 1, sizeof(sig), this->f) != sizeof(sig))
+				|| png_sig_cmp(sig, 0, sizeof(sig))
+			) {
+				throw EFailure(Glib::ustring::compose(_("%1 is not a .png file."),
+					filename));
+			}
+			this->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr,
+				pngError, pngWarning);
+			if (this->png) this->info = png_create_info_struct(this->png);
+			if (!this->info) {
+				throw EFailure(_("Out of memory while reading .png file."));
+			}
+			png_init_io(this->png, this->f);
+			png_set_sig_bytes(this->png, sizeof(sig));
+			png_read_info(this->png, this->info);
+
+			png_uint_32 width, height;
+			int bitDepth, colourType, interlace;
+			png_get_IHDR(this->png, this->info, &width, &height, &bitDepth,
+				&colourType, &interlace, nullptr, nullptr);
+			this->dims = {(long)width, (long)height};
+
+			this->indexed = colourType == PNG_COLOR_TYPE_PALETTE;
+			if (this->indexed) {
+				// Work out what each of the .png's palette entries maps to, so each
+				// pixel is then a single table lookup.
+				if (bitDepth < 8) png_set_packing(this->png);
+				png_colorp plte = nullptr;
+				int numPlte = 0;
+				png_get_PLTE(this->png, this->info, &plte, &numPlte);
+				png_bytep trans = nullptr;
+				int numTrans = 0;
+				if (png_get_valid(this->png, this->info, PNG_INFO_tRNS)) {
+					png_get_tRNS(this->png, this->info, &trans, &numTrans, nullptr);
+				}
+				for (int i = 0; i < 256; i++) {
+					this->indexMap[i] = 0;
+					this->maskMap[i] = 0;
+					if (i >= numPlte) continue;
+					if ((i < numTrans) && (trans[i] < 0x80)) {
+						this->maskMap[i] = maskTransparent;
+						continue;
+					}
+					auto& c = plte[i];
+					if (
+						((unsigned int)i < pal.size())
+						&& (pal[i].red == c.red)
+						&& (pal[i].green == c.green)
+						&& (pal[i].blue == c.blue)
+					) {
+						// Same colour in the same place, most likely exported from here
+						this->indexMap[i] = i;
+					} else {
+						if (!this->matcher) this->matcher.reset(new PaletteMatcher(pal));
+						this->indexMap[i] = this->matcher->match(c.red, c.green, c.blue);
+					}
+				}
+			} else {
+				// Anything else is read as 8-bit RGBA and matched pixel by pixel
+				png_set_expand(this->png);
+				png_set_strip_16(this->png);
+				png_set_gray_to_rgb(this->png);
+				png_set_filler(this->png, 0xFF, PNG_FILLER_AFTER);
+				this->matcher.reset(new PaletteMatcher(pal));
+			}
+			int passes = png_set_interlace_handling(this->png);
+			png_read_update_info(this->png, this->info);
+
+			unsigned long rowBytes = png_get_rowbytes(this->png, this->info);
+			if (passes > 1) {
+				// Interlaced images can't be read one row at a time
+				this->whole.resize(rowBytes * height);
+				std::vector<png_bytep> rows(height);
+				for (png_uint_32 y = 0; y < height; y++) {
+					rows[y] = &this->whole[y * rowBytes];
+				}
+				png_read_image(this->png, rows.data());
+			} else {
+				this->row.resize(rowBytes);
+			}
+			return;
+		}
+
+		~PNGReader()
+		{
+			if (this->png) png_destroy_read_struct(&this->png, &this->info, nullptr);
+			if (this->f) std::fclose(this->f);
+		}
+
+		/// Read the next row, converted to palette indices and mask values.
+		/**
+		 * @param pixels
+		 *   On return, dims.x palette indices.
+		 *
+		 * @param mask
+		 *   On return, dims.x Image::Mask values.
+		 */
+		void readRow(uint8_t *pixels, uint8_t *mask)
+		{
+			const uint8_t *in;
+			if (this->whole.empty()) {
+				png_read_row(this->png, this->row.data(), nullptr);
+				in = this->row.data();
+			} else {
+				in = &this->whole[this->nextRow * (this->whole.size() / this->dims.y)];
+			}
+			this->nextRow++;
+
+			unsigned long width = this->dims.x;
+			if (this->indexed) {
+				for (unsigned long x = 0; x < width; x++) {
+					pixels[x] = this->indexMap[in[x]];
+					mask[x] = this->maskMap[in[x]];
+				}
+			} else {
+				// Neighbouring pixels are often the same colour, so remember the last
+				// match to save looking it up again.
+				uint32_t lastColour = 0xFFFFFFFF;
+				uint8_t lastIndex = 0;
+				for (unsigned long x = 0; x < width; x++, in += 4) {
+					if (in[3] < 0x80) {
+						pixels[x] = 0;
+						mask[x] = maskTransparent;
+						continue;
+					}
+					uint32_t colour = (in[0] << 16) | (in[1] << 8) | in[2];
+					if (colour != lastColour) {
+						lastIndex = this->matcher->match(in[0], in[1], in[2]);
+						lastColour = colour;
+					}
+					pixels[x] = lastIndex;
+					mask[x] = 0;
+				}
+			}
+			return;
+		}
+
+		Point dims; ///< Image size, in pixels
+
+	protected:
+		std::FILE *f;
+		png_structp png;
+		png_infop info;
+		bool indexed;                 ///< true if rows are palette indices
+		uint8_t indexMap[256];        ///< Our palette index for each .png index
+		uint8_t maskMap[256];         ///< Mask value for each .png index
+		std::unique_ptr<PaletteMatcher> matcher; ///< For colours not in palette
+		std::vector<uint8_t> row;     ///< Row being read
+		std::vector<uint8_t> whole;   ///< Entire image, if interlaced
+		unsigned long nextRow;        ///< Row to be returned by readRow()
+};
+
+/// Decide whether an image can be exported as an indexed .png.
+static bool canExportIndexed(const Pixels& mask, int transIndex)
+{
+	if (transIndex >= 0) return true;
+	for (auto m : mask) {
+		if (m & maskTransparent) return false;
+	}
+	return true;
+}
+
+/// Arrangement of a tileset's tiles in a .png.
+struct TilesetLayout {
+	Point cell;             ///< Size of each cell, in pixels
+	unsigned int columns;   ///< Number of cells across
+	unsigned int rows;      ///< Number of cells down
+	std::shared_ptr<const Palette> pal; ///< Palette used for every tile
+};
+
+/// true if a tileset item is a tile, rather than a folder or empty slot.
+static bool isTile(const Tileset::FileHandle& f)
+{
+	return !(f->fAttr & Tileset::File::Attribute::Vacant)
+		&& !(f->fAttr & Tileset::File::Attribute::Folder);
+}
+
+/// Work out where each tile goes in a .png.
+/**
+ * Import and export both use this, so a file exported from a tileset can be
+ * imported back into it.
+ *
+ * @param tileset
+ *   Tileset to measure.
+ *
+ * @return The layout.  The palette is that of the first tile.
+ */
+static TilesetLayout getTilesetLayout(Tileset& tileset)
+{
+	TilesetLayout layout;
+	auto& files = tileset.files();
+	layout.columns = tileset.layoutWidth();
+	if (layout.columns == 0) layout.columns = PNG_TILESET_COLUMNS;
+	layout.rows = (files.size() + layout.columns - 1) / layout.columns;
+
+	// Only open every tile to measure it if they aren't all the same size
+	layout.cell = {0, 0};
+	bool fixed = false;
+	if (tileset.caps() & Tileset::Caps::HasDimensions) {
+		layout.cell = tileset.dimensions();
+		fixed = (layout.cell.x > 0) && (layout.cell.y > 0);
+	}
+	for (auto& f : files) {
+		if (!isTile(f)) continue;
+		if (fixed && layout.pal) break;
+		auto img = tileset.openImage(f);
+		if (!layout.pal) layout.pal = getImagePalette(img.get(), &tileset);
+		if (!fixed) {
+			auto dims = img->dimensions();
+			layout.cell.x = std::max(layout.cell.x, dims.x);
+			layout.cell.y = std::max(layout.cell.y, dims.y);
+		}
+	}
+	if (!layout.pal || (layout.cell.x <= 0) || (layout.cell.y <= 0)) {
+		throw EFailure(_("This tileset does not contain any images."));
+	}
+	return layout;
+}
+
+void exportImagePNG(const std::string& filename, const Image& img,
+	const Tileset *tileset)
+{
+	auto pal = getImagePalette(&img, tileset);
+	auto dims = img.dimensions();
+	auto pixels = img.convert();
+	auto mask = img.convert_mask();
+
+	int transIndex = transparentIndex(*pal);
+	PNGWriter png(*pal, canExportIndexed(mask, transIndex), transIndex);
+	png.start(filename, dims, *pal);
+	for (long y = 0; y < dims.y; y++) {
+		png.writeRow(&pixels[y * dims.x], &mask[y * dims.x]);
+	}
+	png.finish();
+	return;
+}
+
+void importImagePNG(const std::string& filename, Image *img,
+	const Tileset *tileset)
+{
+	auto pal = getImagePalette(img, tileset);
+	PNGReader png;
+	png.open(filename, *pal);
+
+	auto dims = img->dimensions();
+	Pixels oldMask;
+	if ((png.dims.x != dims.x) || (png.dims.y != dims.y)) {
+		if (!(img->caps() & Image::Caps::SetDimensions)) {
+			throw EFailure(Glib::ustring::compose(
+				// Translators: %1 and %2 are the image size, %3 is the filename and %4
+				// and %5 are the size of that file
+				_("The image must be %1x%2 pixels, but %3 is %4x%5."),
+				dims.x, dims.y, filename, png.dims.x, png.dims.y));
+		}
+		img->dimensions(png.dims);
+		dims = png.dims;
+	} else {
+		// Keep any mask bits other than transparency, such as touch
+		oldMask = img->convert_mask();
+	}
+
+	unsigned long numPixels = (unsigned long)dims.x * dims.y;
+	Pixels pixels(numPixels), mask(numPixels);
+	for (long y = 0; y < dims.y; y++) {
+		png.readRow(&pixels[y * dims.x], &mask[y * dims.x]);
+	}
+	if (!oldMask.empty()) {
+		for (unsigned long i = 0; i < numPixels; i++) {
+			mask[i] |= oldMask[i] & ~maskTransparent;
+		}
+	}
+	img->convert(pixels, mask);
+	return;
+}
+
+void exportTilesetPNG(const std::string& filename, Tileset& tileset)
+{
+	auto layout = getTilesetLayout(tileset);
+	auto& files = tileset.files();
+	Point dims = {
+		layout.cell.x * (long)layout.columns,
+		layout.cell.y * (long)layout.rows
+	};
+
+	// Empty cells are transparent, so full colour is only needed if there are
+	// no palette entries free to use for that.
+	int transIndex = transparentIndex(*layout.pal);
+	PNGWriter png(*layout.pal, transIndex >= 0, transIndex);
+	png.start(filename, dims, *layout.pal);
+
+	// Convert one row of tiles at a time into a strip of 8-bit pixels, and write
+	// that out before moving on to the next row.
+	unsigned long stripSize = (unsigned long)dims.x * layout.cell.y;
+	Pixels stripPixels(stripSize), stripMask(stripSize);
+	for (unsigned int row = 0; row < layout.rows; row++) {
+		std::fill(stripPixels.begin(), stripPixels.end(), 0);
+		std::fill(stripMask.begin(), stripMask.end(), maskTransparent);
+
+		for (unsigned int col = 0; col < layout.columns; col++) {
+			unsigned long index = row * layout.columns + col;
+			if (index >= files.size()) break;
+			if (!isTile(files[index])) continue;
+
+			auto img = tileset.openImage(files[index]);
+			auto tileDims = img->dimensions();
+			auto pixels = img->convert();
+			auto mask = img->convert_mask();
+			long width = std::min(tileDims.x, layout.cell.x);
+			long height = std::min(tileDims.y, layout.cell.y);
+			for (long y = 0; y < height; y++) {
+				unsigned long dst = y * dims.x + col * layout.cell.x;
+				std::copy(&pixels[y * tileDims.x], &pixels[y * tileDims.x + width],
+					&stripPixels[dst]);
+				std::copy(&mask[y * tileDims.x], &mask[y * tileDims.x + width],
+					&stripMask[dst]);
+			}
+		}
+
+		for (long y = 0; y < layout.cell.y; y++) {
+			png.writeRow(&stripPixels[y * dims.x], &stripMask[y * dims.x]);
+		}
+	}
+	png.finish();
+	return;
+}
+
+void importTilesetPNG(const std::string& filename, Tileset& tileset)
+{
+	auto layout = getTilesetLayout(tileset);
+	auto& files = tileset.files();
+	PNGReader png;
+	png.open(filename, *layout.pal);
+
+	// Check the size first, so nothing is changed if the file won't fit
+	Point need = {
+		layout.cell.x * (long)layout.columns,
+		layout.cell.y * (long)layout.rows
+	};
+	if ((png.dims.x < need.x) || (png.dims.y < need.y)) {
+		throw EFailure(Glib::ustring::compose(
+			// Translators: %1 and %2 are the image size, %3 is the filename and %4
+			// and %5 are the size of that file
+			_("The image must be at least %1x%2 pixels to hold every tile, but %3 "
+				"is only %4x%5."),
+			need.x, need.y, filename, png.dims.x, png.dims.y));
+	}
+
+	// Read every row the tiles need before changing any of them, so a file that
+	// turns out to be corrupted part way through doesn't leave some tiles
+	// replaced and others not.
+	unsigned long stripSize = (unsigned long)png.dims.x * layout.cell.y;
+	Pixels allPixels(stripSize * layout.rows), allMask(stripSize * layout.rows);
+	for (long y = 0; y < need.y; y++) {
+		png.readRow(&allPixels[y * png.dims.x], &allMask[y * png.dims.x]);
+	}
+
+	for (unsigned int row = 0; row < layout.rows; row++) {
+		const uint8_t *stripPixels = &allPixels[row * stripSize];
+		const uint8_t *stripMask = &allMask[row * stripSize];
+		for (unsigned int col = 0; col < layout.columns; col++) {
+			unsigned long index = row * layout.columns + col;
+			if (index >= files.size()) break;
+			if (!isTile(files[index])) continue;
+
+			auto img = tileset.openImage(files[index]);
+			auto tileDims = img->dimensions();
+			long width = std::min(tileDims.x, layout.cell.x);
+			long height = std::min(tileDims.y, layout.cell.y);
+			Pixels pixels((unsigned long)tileDims.x * tileDims.y, 0);
+			auto mask = img->convert_mask();
+			for (long y = 0; y < height; y++) {
+				unsigned long src = y * png.dims.x + col * layout.cell.x;
+				for (long x = 0; x < width; x++) {
+					unsigned long dst = y * tileDims.x + x;
+					pixels[dst] = stripPixels[src + x];
+					// Keep any mask bits other than transparency, such as touch
+					mask[dst] = (mask[dst] & ~maskTransparent) | stripMask[src + x];
+				}
+			}
+			img->convert(pixels, mask);
+		}
+	}
+	tileset.flush();
+	return;
+}
@@ -0,0 +1,166 @@
+/**
+ * @file  util-png.hpp
+ * @brief Import and export images and tilesets as .png files.
+ *
+ * Copyright (C) 2013-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STUDIO_UTIL_PNG_HPP_
+#define STUDIO_UTIL_PNG_HPP_
+
+#include <string>
+#include <vector>
+#include <camoto/gamegraphics/image.hpp>
+#include <camoto/gamegraphics/tileset.hpp>
+
+/// Number of tiles across an exported tileset that has no preferred layout.
+#define PNG_TILESET_COLUMNS 16
+
+/// Bits kept from each colour channel when looking up the nearest palette
+/// entry, giving a cube of 2^(3*bits) cells.
+#define PNG_CUBE_BITS 5
+
+/// Finds the closest palette entry to any colour.
+/**
+ * The answer for every cell of a 32K colour cube is worked out up front, so
+ * matching a pixel is a table lookup rather than a search of the palette.
+ * Colours that exactly match a palette entry always map to that entry, even
+ * when several entries share a cell of the cube.
+ */
+class PaletteMatcher
+{
+	public:
+		/// Prepare the lookup table for a palette.
+		/**
+		 * @param pal
+		 *   Palette to match against.  Entries that are fully transparent are
+		 *   never returned.
+		 */
+		PaletteMatcher(const camoto::gamegraphics::Palette& pal);
+
+		/// Get the palette index nearest to a colour.
+		/**
+		 * @param red
+		 *   Red channel, 0-255.
+		 *
+		 * @param green
+		 *   Green channel, 0-255.
+		 *
+		 * @param blue
+		 *   Blue channel, 0-255.
+		 *
+		 * @return Index into the palette.
+		 */
+		uint8_t match(uint8_t red, uint8_t green, uint8_t blue) const;
+
+	protected:
+		/// Search the whole palette for the nearest colour.
+		uint8_t search(uint8_t red, uint8_t green, uint8_t blue) const;
+
+		std::vector<uint32_t> colours; ///< Palette as 0xRRGGBB, one per entry
+		std::vector<bool> usable;      ///< false for transparent entries
+		std::vector<uint8_t> cube;     ///< Nearest entry for each cell
+		std::vector<bool> crowded;     ///< true if more than one entry in a cell
+};
+
+/// Write an image to a .png file.
+/**
+ * The file is written as an indexed .png using the image's palette wherever
+ * possible, so it can be edited without losing the palette order.  Only if
+ * the image has transparent pixels and every palette entry is in use is a
+ * full colour .png written instead.
+ *
+ * @param filename
+ *   File to write.
+ *
+ * @param img
+ *   Image to export.
+ *
+ * @param tileset
+ *   Optional tileset the image came from, used for the palette as per
+ *   getImagePalette().
+ *
+ * @throw EFailure on I/O or encoding error.
+ */
+void exportImagePNG(const std::string& filename,
+	const camoto::gamegraphics::Image& img,
+	const camoto::gamegraphics::Tileset *tileset);
+
+/// Replace an image with the content of a .png file.
+/**
+ * Colours are mapped to the image's palette.  If the .png uses the same
+ * palette the indices are copied as-is, otherwise each colour is matched with
+ * a PaletteMatcher.  Pixels that are more than half transparent become
+ * transparent in the image.
+ *
+ * @param filename
+ *   File to read.
+ *
+ * @param img
+ *   Image to overwrite.  If the .png is a different size the image is
+ *   resized if possible.
+ *
+ * @param tileset
+ *   Optional tileset the image came from, as for exportImagePNG().
+ *
+ * @throw EFailure if the file can't be read or is the wrong size.
+ */
+void importImagePNG(const std::string& filename,
+	camoto::gamegraphics::Image *img,
+	const camoto::gamegraphics::Tileset *tileset);
+
+/// Write every tile in a tileset to a single .png file.
+/**
+ * Tiles are placed in a grid of equal sized cells, one per item in files(),
+ * with as many across as the tileset's layoutWidth() or PNG_TILESET_COLUMNS
+ * if that is zero.  Cells for folders and vacant slots are left transparent.
+ *
+ * Only one row of tiles is held in memory at a time, with the .png written
+ * out as each row is finished.
+ *
+ * @param filename
+ *   File to write.
+ *
+ * @param tileset
+ *   Tileset to export.
+ *
+ * @throw EFailure on I/O or encoding error.
+ */
+void exportTilesetPNG(const std::string& filename,
+	camoto::gamegraphics::Tileset& tileset);
+
+/// Replace every tile in a tileset with the content of a .png file.
+/**
+ * The .png must be laid out as written by exportTilesetPNG().  Unlike on
+ * export, the whole area covered by the tiles is read into memory before any
+ * tile is changed.
+ *
+ * @param filename
+ *   File to read.
+ *
+ * @param tileset
+ *   Tileset to overwrite.  It is flushed once all tiles have been written.
+ *
+ * @throw EFailure if the file can't be read or is too small to hold every
+ *   tile.  The tileset is not modified in this case.
+ *
+ * @throw stream::error if a tile could not be written.  Any tiles before it
+ *   have already been replaced.
+ */
+void importTilesetPNG(const std::string& filename,
+	camoto::gamegraphics::Tileset& tileset);
+
+#endif // STUDIO_UTIL_PNG_HPP_
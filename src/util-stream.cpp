@@ -0,0 +1,89 @@
+/**
+ * @file  util-stream.cpp
+ * @brief Stream wrapper allowing files in one archive to be used by many
+ *        threads at once.
+ *
+ * Copyright (C) 2013-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "util-stream.hpp"
+
+using namespace camoto;
+
+LockedStream::LockedStream(std::unique_ptr<stream::inout> parent,
+	std::shared_ptr<std::mutex> mtx)
+	:	parent(std::move(parent)),
+		mtx(mtx)
+{
+}
+
+stream::len LockedStream::try_read(uint8_t *buffer, stream::len len)
+{
+	std::lock_guard<std::mutex> lock(*this->mtx);
+	return this->parent->try_read(buffer, len);
+}
+
+void LockedStream::seekg(stream::delta off, stream::seek_from from)
+{
+	std::lock_guard<std::mutex> lock(*this->mtx);
+	this->parent->seekg(off, from);
+	return;
+}
+
+stream::pos LockedStream::tellg() const
+{
+	std::lock_guard<std::mutex> lock(*this->mtx);
+	return this->parent->tellg();
+}
+
+stream::len LockedStream::size() const
+{
+	std::lock_guard<std::mutex> lock(*this->mtx);
+	return this->parent->size();
+}
+
+stream::len LockedStream::try_write(const uint8_t *buffer, stream::len len)
+{
+	std::lock_guard<std::mutex> lock(*this->mtx);
+	return this->parent->try_write(buffer, len);
+}
+
+void LockedStream::seekp(stream::delta off, stream::seek_from from)
+{
+	std::lock_guard<std::mutex> lock(*this->mtx);
+	this->parent->seekp(off, from);
+	return;
+}
+
+stream::pos LockedStream::tellp() const
+{
+	std::lock_guard<std::mutex> lock(*this->mtx);
+	return this->parent->tellp();
+}
+
+void LockedStream::truncate(stream::pos size)
+{
+	std::lock_guard<std::mutex> lock(*this->mtx);
+	this->parent->truncate(size);
+	return;
+}
+
+void LockedStream::flush()
+{
+	std::lock_guard<std::mutex> lock(*this->mtx);
+	this->parent->flush();
+	return;
+}
@@ -0,0 +1,73 @@
+/**
+ * @file  util-stream.hpp
+ * @brief Stream wrapper allowing files in one archive to be used by many
+ *        threads at once.
+ *
+ * Copyright (C) 2013-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STUDIO_UTIL_STREAM_HPP_
+#define STUDIO_UTIL_STREAM_HPP_
+
+#include <memory>
+#include <mutex>
+#include <camoto/stream.hpp>
+
+/// Stream that holds a lock shared with other streams during every call.
+/**
+ * Files opened from an archive are substreams of the archive's own stream,
+ * and reading one means seeking the archive stream then reading from it.  If
+ * two threads do this at once they can read each other's data.  Wrapping
+ * every file opened from the same archive in a LockedStream sharing one mutex
+ * makes each seek and read happen together.
+ *
+ * Only the calls themselves are locked, so threads reading different files
+ * take turns at the I/O but can decode what they've read at the same time.
+ */
+class LockedStream: virtual public camoto::stream::inout
+{
+	public:
+		/// Wrap a stream.
+		/**
+		 * @param parent
+		 *   Stream to wrap.  All calls are passed on to this stream.
+		 *
+		 * @param mtx
+		 *   Lock to hold during each call, shared with every other stream that
+		 *   uses the same underlying data.
+		 */
+		LockedStream(std::unique_ptr<camoto::stream::inout> parent,
+			std::shared_ptr<std::mutex> mtx);
+
+		virtual camoto::stream::len try_read(uint8_t *buffer,
+			camoto::stream::len len);
+		virtual void seekg(camoto::stream::delta off, camoto::stream::seek_from from);
+		virtual camoto::stream::pos tellg() const;
+		virtual camoto::stream::len size() const;
+
+		virtual camoto::stream::len try_write(const uint8_t *buffer,
+			camoto::stream::len len);
+		virtual void seekp(camoto::stream::delta off, camoto::stream::seek_from from);
+		virtual camoto::stream::pos tellp() const;
+		virtual void truncate(camoto::stream::pos size);
+		virtual void flush();
+
+	protected:
+		std::unique_ptr<camoto::stream::inout> parent;
+		std::shared_ptr<std::mutex> mtx;
+};
+
+#endif // STUDIO_UTIL_STREAM_HPP_
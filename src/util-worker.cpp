@@ -0,0 +1,122 @@
+/**
+ * @file  util-worker.cpp
+ * @brief Pool of background threads for running long jobs off the GUI thread.
+ *
+ * Copyright (C) 2013-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <exception>
+#include <iostream>
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include "util-worker.hpp"
+
+WorkerPool::WorkerPool(unsigned int numThreads, bool lowPriority)
+	:	busy(0),
+		stopping(false)
+{
+	if (numThreads == 0) {
+		numThreads = std::thread::hardware_concurrency();
+		if (numThreads == 0) numThreads = 1; // unknown core count
+	}
+	for (unsigned int i = 0; i < numThreads; i++) {
+		this->threads.emplace_back(&WorkerPool::run, this, lowPriority);
+	}
+}
+
+WorkerPool::~WorkerPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(this->mtx);
+		this->queue.clear();
+		this->stopping = true;
+	}
+	this->cvQueue.notify_all();
+	for (auto& t : this->threads) t.join();
+}
+
+void WorkerPool::add(Job job)
+{
+	{
+		std::lock_guard<std::mutex> lock(this->mtx);
+		this->queue.push_back(std::move(job));
+	}
+	this->cvQueue.notify_one();
+	return;
+}
+
+void WorkerPool::cancel()
+{
+	{
+		std::lock_guard<std::mutex> lock(this->mtx);
+		this->queue.clear();
+	}
+	this->cvIdle.notify_all();
+	return;
+}
+
+void WorkerPool::wait()
+{
+	std::unique_lock<std::mutex> lock(this->mtx);
+	this->cvIdle.wait(lock, [this]() {
+		return this->queue.empty() && (this->busy == 0);
+	});
+	return;
+}
+
+void WorkerPool::run(bool lowPriority)
+{
+	if (lowPriority) {
+#ifdef __linux__
+		// Linux applies the nice value to individual threads when given a
+		// thread ID, so this doesn't slow down the rest of the program.
+		setpriority(PRIO_PROCESS, syscall(SYS_gettid), 10);
+#endif
+	}
+
+	std::unique_lock<std::mutex> lock(this->mtx);
+	for (;;) {
+		this->cvQueue.wait(lock, [this]() {
+			return this->stopping || !this->queue.empty();
+		});
+		if (this->stopping) break;
+
+		Job job = std::move(this->queue.front());
+		this->queue.pop_front();
+		this->busy++;
+		lock.unlock();
+
+		try {
+			job();
+		} catch (const std::exception& e) {
+			std::cerr << "[worker] Unhandled exception in background job: "
+				<< e.what() << std::endl;
+		} catch (...) {
+			// Letting this escape would terminate the whole program
+			std::cerr << "[worker] Unhandled non-standard exception in background "
+				"job" << std::endl;
+		}
+		job = nullptr; // release anything the job captured before relocking
+
+		lock.lock();
+		this->busy--;
+		this->cvIdle.notify_all();
+	}
+	return;
+}
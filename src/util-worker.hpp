@@ -0,0 +1,92 @@
+/**
+ * @file  util-worker.hpp
+ * @brief Pool of background threads for running long jobs off the GUI thread.
+ *
+ * Copyright (C) 2013-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STUDIO_UTIL_WORKER_HPP_
+#define STUDIO_UTIL_WORKER_HPP_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// Fixed set of threads that run queued jobs in the background.
+/**
+ * Jobs must not touch any GTK widgets, as GTK may only be used from the main
+ * thread.  Results should be passed back with a Glib::Dispatcher instead.
+ */
+class WorkerPool
+{
+	public:
+		typedef std::function<void()> Job;
+
+		/// Start the worker threads.
+		/**
+		 * @param numThreads
+		 *   Number of jobs that can run at the same time.  0 means one per CPU
+		 *   core.
+		 *
+		 * @param lowPriority
+		 *   true to ask the OS to run the threads only when nothing more
+		 *   important needs the CPU, for work the user isn't waiting on.  Only
+		 *   supported on Linux, and ignored elsewhere.
+		 */
+		WorkerPool(unsigned int numThreads, bool lowPriority = false);
+
+		/// Discard any queued jobs and wait for running ones to finish.
+		~WorkerPool();
+
+		/// Queue a job to run on the next free thread.
+		/**
+		 * @param job
+		 *   Function to run.  Any exception it throws is printed and otherwise
+		 *   ignored.
+		 */
+		void add(Job job);
+
+		/// Discard all queued jobs that have not started yet.
+		/**
+		 * Jobs already running are not interrupted.  Call wait() afterwards to
+		 * be sure they have finished.
+		 */
+		void cancel();
+
+		/// Block until the queue is empty and no jobs are running.
+		void wait();
+
+	protected:
+		/// Thread body, running jobs until the pool is destroyed.
+		/**
+		 * @param lowPriority
+		 *   Value passed to the constructor.
+		 */
+		void run(bool lowPriority);
+
+		std::vector<std::thread> threads; ///< Worker threads
+		std::deque<Job> queue;            ///< Jobs waiting to run
+		std::mutex mtx;                   ///< Protects all members below
+		std::condition_variable cvQueue;  ///< Signalled when a job is queued
+		std::condition_variable cvIdle;   ///< Signalled when a job finishes
+		unsigned int busy;                ///< Number of jobs currently running
+		bool stopping;                    ///< true when threads should exit
+};
+
+#endif // STUDIO_UTIL_WORKER_HPP_